@@ -0,0 +1,207 @@
+#!/bin/sh
+# Throughput benchmarks for the demo tools
+#
+# Usage: ./benchmark.sh <test> [seconds]
+#   overlapped: streamer RX, synchronous loop against overlapped queue depths
+#   write: streamer TX, synchronous loop against overlapped queue depths,
+#          with underrun/stall counts for sizing the queue
+#   threads: streamer TX+RX on all CHANNELS with one thread per direction
+#            against one thread per channel (-t), synchronous and with 8
+#            overlapped transfers
+#   sink: zynqtest dump path fed with synthetic 300 and 400MiB/s input,
+#         ofstream against the O_DIRECT pwrite and io_uring sinks
+#   verify: file_transfer content verifier on two identical multi-GB files
+#   tune: streamer -T sweep of the driver transfer parameters and buffer
+#         size, seconds per point; writes transfer.profile for -p
+#   affinity: streamer RX and TX with default scheduling, with the
+#             threads pinned per PLACEMENT, and pinned with SCHED_FIFO
+#             priority 50; compare the rates and the p99/p99.9/max
+#             latency (jitter) of the three runs. SCHED_FIFO needs root
+#             or an rtprio limit.
+#   fanin: fanin capture from all attached devices into one file, per
+#          device and aggregate rates (the loopback library needs
+#          FT_LOOPBACK_DEVICES and an FT_LOOPBACK_SOURCE pattern)
+#   pool: streamer TX+RX with 8 overlapped transfers and the zynqtest
+#         capture path at 400MiB/s, with plain posix_memalign buffers
+#         (D3XX_BUFFER_POOL=malloc) against the huge page, mlock'd
+#         buffer pool; locking needs enough "ulimit -l"
+#   stream: streamer TX+RX with and without FT_SetStreamPipe, 4KiB
+#           synchronous bursts (-S 4096) for latency and 8 overlapped
+#           buffers (-S capture) for long-run throughput (the loopback
+#           library charges FT_LOOPBACK_SESSION_US per chip session)
+#   notify: streamer TX+RX with the writer sending 10% and 90% of the
+#           time (-u), RX by polling FT_ReadPipeEx against event driven
+#           reads (-e); RX latency is measured from the write, CPU is
+#           that of the whole process (including the loopback library)
+#   epoll: streamer TX+RX with one thread per pipe (-t, plus a producer
+#          per writer) against one epoll loop driving all pipes through
+#          pipe_events (-E), 1 and 8 overlapped transfers per pipe, then
+#          with notified reads (-e); run with CHANNELS=4 for all eight
+#          pipes of an FT600
+#   coroutines: streamer TX+RX with 8 and 32 transfers per pipe, one
+#               thread per pipe (-t) against the -E event loop and the
+#               C++20 coroutine port (streamer_co -C)
+#   messages: streamer TX+RX of 64B to 2KiB messages at 1k, 10k, 100k
+#             per second per channel and unpaced, one FT_WritePipeEx per
+#             message against gathered writes flushed after COALESCE_US
+#
+# Build with "make LOOPBACK=1" to run the tests against the software
+# loopback library (see ftd3xx_loopback.cpp for its FT_LOOPBACK_*
+# settings) when no FT60x board is attached.
+#
+# Environment:
+#   CHANNELS: channel count to stream on (default 1)
+#   MODE: 0 = FT245 mode, 1 = FT600 mode (default)
+#   VERIFY_MB: size of the files compared by the verify test (default 4096)
+#   PLACEMENT: streamer -a thread placement of the affinity test
+#              (default read=1,write=2,producer=3,measure=0)
+#   COALESCE_US: flush deadline of the messages test (default 100)
+
+SECONDS_PER_RUN=${2:-10}
+CHANNELS=${CHANNELS:-1}
+MODE=${MODE:-1}
+VERIFY_MB=${VERIFY_MB:-4096}
+PLACEMENT=${PLACEMENT:-read=1,write=2,producer=3,measure=0}
+COALESCE_US=${COALESCE_US:-100}
+
+summary()
+{
+	grep -E "^(RX|TX) " | sed "s/^/$1: /"
+}
+
+case "$1" in
+overlapped)
+	./streamer -d "$SECONDS_PER_RUN" 0 "$CHANNELS" "$MODE" | summary "sync"
+	for depth in 4 8 16 32 64; do
+		./streamer -q $depth -d "$SECONDS_PER_RUN" 0 "$CHANNELS" "$MODE" |
+			summary "depth $depth"
+	done
+	;;
+write)
+	./streamer -d "$SECONDS_PER_RUN" "$CHANNELS" 0 "$MODE" | summary "sync"
+	for depth in 2 4 8 16 32 64; do
+		./streamer -q $depth -d "$SECONDS_PER_RUN" "$CHANNELS" 0 "$MODE" |
+			summary "depth $depth"
+	done
+	;;
+threads)
+	for depth in 0 8; do
+		./streamer -q $depth -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" | summary "shared"
+		./streamer -t -q $depth -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" | summary "per channel"
+	done
+	;;
+sink)
+	for rate in 300 400; do
+		for sink in ofstream pwrite uring; do
+			./zynqtest -s $sink -b $rate -d "$SECONDS_PER_RUN" |
+				grep "^Sink "
+		done
+	done
+	rm -f dumpfile.264
+	;;
+verify)
+	dd if=/dev/urandom of=verify_a.bin bs=1M count="$VERIFY_MB" 2>/dev/null
+	cp verify_a.bin verify_b.bin
+	./file_transfer -V verify_a.bin verify_b.bin | grep "^Compared"
+	./file_transfer -V verify_a.bin verify_b.bin | grep "^Compared"
+	rm -f verify_a.bin verify_b.bin
+	;;
+tune)
+	./streamer -T transfer.profile -d "$SECONDS_PER_RUN" \
+		"$CHANNELS" "$CHANNELS" "$MODE" | grep -E "^(urb_count|Best)"
+	;;
+affinity)
+	FIFO_PLACEMENT=$(echo "$PLACEMENT" | sed 's/=\([0-9]*\)\(:[0-9]*\)\{0,1\}/=\1:50/g')
+	for depth in 0 8; do
+		./streamer -q $depth -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" | summary "default"
+		./streamer -q $depth -a "$PLACEMENT" -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" | summary "pinned"
+		./streamer -q $depth -a "$FIFO_PLACEMENT" -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" | summary "SCHED_FIFO"
+	done
+	;;
+fanin)
+	./fanin -o fanin.cap -d "$SECONDS_PER_RUN" "$CHANNELS" "$MODE" |
+		grep -E "(buffers, ring|^Total:)"
+	rm -f fanin.cap
+	;;
+pool)
+	for pool in malloc hugepage; do
+		D3XX_BUFFER_POOL=$pool ./streamer -q 8 -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" | summary "$pool"
+		D3XX_BUFFER_POOL=$pool ./zynqtest -s none -v bytes -b 400 \
+			-d "$SECONDS_PER_RUN" | grep "^Sink " | sed "s/^/$pool: /"
+	done
+	;;
+stream)
+	echo "buffer_len=4096" > burst.profile
+	./streamer -p burst.profile -d "$SECONDS_PER_RUN" \
+		"$CHANNELS" "$CHANNELS" "$MODE" | summary "4KiB bursts"
+	./streamer -S 4096 -d "$SECONDS_PER_RUN" \
+		"$CHANNELS" "$CHANNELS" "$MODE" | summary "4KiB frames streamed"
+	./streamer -q 8 -d "$SECONDS_PER_RUN" \
+		"$CHANNELS" "$CHANNELS" "$MODE" | summary "capture"
+	./streamer -q 8 -S capture -d "$SECONDS_PER_RUN" \
+		"$CHANNELS" "$CHANNELS" "$MODE" | summary "capture streamed"
+	rm -f burst.profile
+	;;
+notify)
+	for duty in 10 90; do
+		./streamer -u $duty -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" |
+			grep -E "^(RX [a-z]|CPU)" | sed "s/^/$duty% poll: /"
+		./streamer -e -u $duty -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" |
+			grep -E "^(RX [a-z]|CPU)" | sed "s/^/$duty% event: /"
+	done
+	;;
+epoll)
+	for depth in 1 8; do
+		./streamer -t -q $depth -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" |
+			grep -E "^(RX|TX) [a-z]|^CPU" | sed "s/^/depth $depth threads: /"
+		./streamer -E -q $depth -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" |
+			grep -E "^(RX|TX) [a-z]|^CPU" | sed "s/^/depth $depth epoll: /"
+	done
+	./streamer -t -e -d "$SECONDS_PER_RUN" "$CHANNELS" "$CHANNELS" "$MODE" |
+		grep -E "^(RX|TX) [a-z]|^CPU" | sed "s/^/notified threads: /"
+	./streamer -E -e -q 8 -d "$SECONDS_PER_RUN" \
+		"$CHANNELS" "$CHANNELS" "$MODE" |
+		grep -E "^(RX|TX) [a-z]|^CPU" | sed "s/^/notified epoll: /"
+	;;
+coroutines)
+	for depth in 8 32; do
+		./streamer -t -q $depth -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" |
+			grep -E "^(RX|TX) [a-z]|^CPU" | sed "s/^/depth $depth threads: /"
+		./streamer -E -q $depth -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" |
+			grep -E "^(RX|TX) [a-z]|^CPU" | sed "s/^/depth $depth epoll: /"
+		./streamer_co -C -q $depth -d "$SECONDS_PER_RUN" \
+			"$CHANNELS" "$CHANNELS" "$MODE" |
+			grep -E "^(RX|TX) [a-z]|^CPU" | sed "s/^/depth $depth coroutines: /"
+	done
+	;;
+messages)
+	for size in 64 256 1024 2048; do
+		for rate in 1000 10000 100000 0; do
+			./streamer -m $size -r $rate -d "$SECONDS_PER_RUN" \
+				"$CHANNELS" "$CHANNELS" "$MODE" |
+				grep -E "^TX [a-z]" | sed "s/^/${size}B at $rate\/s direct: /"
+			./streamer -m $size -r $rate -g "$COALESCE_US" \
+				-d "$SECONDS_PER_RUN" "$CHANNELS" "$CHANNELS" "$MODE" |
+				grep -E "^TX [a-z]" | sed "s/^/${size}B at $rate\/s gathered: /"
+		done
+	done
+	;;
+*)
+	echo "Usage: $0 <test> [seconds]"
+	echo "  test: overlapped, write, threads, sink, verify, tune, affinity, fanin, pool,"
+	echo "        stream, notify, epoll, coroutines, messages"
+	exit 1
+	;;
+esac
@@ -0,0 +1,148 @@
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <sys/mman.h>
+#include "buffer_pool.h"
+
+using namespace std;
+
+static const size_t PAGE = 4096;
+static const size_t HUGE_PAGE = 2*1024*1024;
+
+enum pool_memory { POOL_HUGETLB, POOL_THP, POOL_MALLOC };
+
+struct buffer_pool {
+	uint8_t *base;
+	size_t map_len;
+	size_t slot_size;
+	size_t count;
+	pool_memory memory;
+	bool locked;
+	char desc[64];
+	/* Free list: next[i] is the slot below slot i on the stack, as
+	 * index + 1 with 0 for the bottom */
+	unique_ptr<atomic<uint32_t>[]> next;
+	/* Index + 1 of the top free slot in the low half, a counter bumped by
+	 * every change in the high half so a stale compare-exchange cannot
+	 * succeed after the slot was taken and returned in between (ABA) */
+	atomic<uint64_t> top;
+};
+
+static size_t round_up(size_t len, size_t align)
+{
+	return (len + align - 1) / align * align;
+}
+
+static bool map_pool(buffer_pool *pool, size_t len)
+{
+	const char *env = getenv("D3XX_BUFFER_POOL");
+	void *mem;
+
+	if (env && !strcmp(env, "malloc")) {
+		pool->map_len = len;
+		pool->memory = POOL_MALLOC;
+		if (posix_memalign(&mem, PAGE, len))
+			return false;
+		pool->base = (uint8_t *)mem;
+		return true;
+	}
+
+	pool->map_len = round_up(len, HUGE_PAGE);
+	mem = mmap(NULL, pool->map_len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	pool->memory = POOL_HUGETLB;
+	if (mem == MAP_FAILED) {
+		/* No huge pages reserved, ask for transparent ones */
+		mem = mmap(NULL, pool->map_len, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return false;
+		madvise(mem, pool->map_len, MADV_HUGEPAGE);
+		pool->memory = POOL_THP;
+	}
+	pool->base = (uint8_t *)mem;
+	pool->locked = !mlock(mem, pool->map_len);
+	return true;
+}
+
+struct buffer_pool *buffer_pool_create(size_t slot_size, size_t count)
+{
+	unique_ptr<buffer_pool> pool(new buffer_pool());
+
+	if (!count || count > UINT32_MAX - 1)
+		return NULL;
+	pool->slot_size = round_up(slot_size ? slot_size : 1, PAGE);
+	pool->count = count;
+	if (!map_pool(pool.get(), pool->slot_size * count))
+		return NULL;
+	/* Fault everything in now, from the creating thread */
+	memset(pool->base, 0, pool->slot_size * count);
+
+	pool->next.reset(new atomic<uint32_t>[count]);
+	for (size_t i = 0; i < count; i++)
+		pool->next[i].store(i + 1 < count ? i + 2 : 0,
+				memory_order_relaxed);
+	pool->top.store(1, memory_order_release);
+
+	snprintf(pool->desc, sizeof(pool->desc), "%s, %s",
+			pool->memory == POOL_HUGETLB ? "2MiB pages" :
+			pool->memory == POOL_THP ? "transparent huge pages" :
+			"posix_memalign",
+			pool->memory == POOL_MALLOC ? "not locked" :
+			pool->locked ? "locked" : "not locked (RLIMIT_MEMLOCK)");
+	return pool.release();
+}
+
+void buffer_pool_destroy(struct buffer_pool *pool)
+{
+	if (!pool)
+		return;
+	if (pool->memory == POOL_MALLOC) {
+		free(pool->base);
+	} else {
+		if (pool->locked)
+			munlock(pool->base, pool->map_len);
+		munmap(pool->base, pool->map_len);
+	}
+	delete pool;
+}
+
+void *buffer_pool_get(struct buffer_pool *pool)
+{
+	uint64_t old = pool->top.load(memory_order_acquire);
+
+	for (;;) {
+		uint32_t slot = (uint32_t)old;
+
+		if (!slot)
+			return NULL;
+
+		uint64_t val = ((old >> 32) + 1) << 32 |
+			pool->next[slot - 1].load(memory_order_relaxed);
+
+		if (pool->top.compare_exchange_weak(old, val,
+					memory_order_acquire, memory_order_acquire))
+			return pool->base + (slot - 1) * pool->slot_size;
+	}
+}
+
+void buffer_pool_put(struct buffer_pool *pool, void *buf)
+{
+	size_t idx = ((uint8_t *)buf - pool->base) / pool->slot_size;
+	uint64_t old = pool->top.load(memory_order_relaxed);
+	uint64_t val;
+
+	do {
+		pool->next[idx].store((uint32_t)old, memory_order_relaxed);
+		val = ((old >> 32) + 1) << 32 | (idx + 1);
+	} while (!pool->top.compare_exchange_weak(old, val,
+				memory_order_release, memory_order_relaxed));
+}
+
+const char *buffer_pool_describe(const struct buffer_pool *pool)
+{
+	return pool->desc;
+}
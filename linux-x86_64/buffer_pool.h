@@ -0,0 +1,68 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+/* Fixed size transfer buffers carved out of one mapping. The mapping
+ * uses 2MiB huge pages when the system has them reserved, otherwise
+ * normal pages with transparent huge pages requested, and is locked with
+ * mlock so buffers are never swapped out. Slots are 4KiB aligned, which
+ * also keeps them on their own cache lines.
+ *
+ * get and put are lock free and may be called from any thread. Pages
+ * are written once at creation, so they are placed on the NUMA node of
+ * the creating thread.
+ *
+ * D3XX_BUFFER_POOL=malloc in the environment makes every pool a plain
+ * posix_memalign allocation without huge pages or locking, to compare
+ * against. */
+
+struct buffer_pool;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* count slots of at least slot_size bytes, NULL when out of memory */
+struct buffer_pool *buffer_pool_create(size_t slot_size, size_t count);
+void buffer_pool_destroy(struct buffer_pool *pool);
+
+/* A free slot, NULL when all are in use */
+void *buffer_pool_get(struct buffer_pool *pool);
+void buffer_pool_put(struct buffer_pool *pool, void *buf);
+
+/* Description of the backing memory, e.g. "2MiB pages, locked" */
+const char *buffer_pool_describe(const struct buffer_pool *pool);
+
+#ifdef __cplusplus
+}
+
+#include <cstdint>
+#include <memory>
+
+struct buffer_pool_deleter {
+	void operator()(buffer_pool *pool) const { buffer_pool_destroy(pool); }
+};
+
+typedef std::unique_ptr<buffer_pool, buffer_pool_deleter> buffer_pool_ptr;
+
+/* A slot held for the lifetime of the object, get() is NULL when the
+ * pool had none free */
+class pool_slot {
+public:
+	explicit pool_slot(buffer_pool *pool)
+		: pool(pool), buf((uint8_t *)buffer_pool_get(pool)) {}
+	~pool_slot() { if (buf) buffer_pool_put(pool, buf); }
+
+	uint8_t *get(void) const { return buf; }
+
+private:
+	pool_slot(const pool_slot &) = delete;
+	pool_slot &operator=(const pool_slot &) = delete;
+
+	buffer_pool *pool;
+	uint8_t *buf;
+};
+#endif /* __cplusplus */
+
+#endif /* BUFFER_POOL_H */
@@ -0,0 +1,132 @@
+#ifndef CAPTURE_RING_H
+#define CAPTURE_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "ftd3xx.h"
+#include "buffer_pool.h"
+
+/* Single producer ring of page aligned capture buffers.
+ * The USB reader fills slots in place and publishes them; each consumer
+ * (disk writer, pattern verifier) walks them in order with its own tail
+ * and a slot is reused once all consumers released it. Nothing is copied
+ * or allocated after start-up.
+ *
+ * The slots come from a buffer pool, which is allocated by allocate()
+ * rather than init() so that the reader thread can call it after pinning
+ * itself and have the pages placed on its NUMA node. */
+class capture_ring {
+public:
+	static const int MAX_CONSUMERS = 2;
+
+	void init(size_t count, size_t slot_size, int consumer_cnt)
+	{
+		info.reset(new slot_info[count]);
+		size = slot_size;
+		slots = count;
+		consumers = consumer_cnt;
+		head.store(0, std::memory_order_relaxed);
+		for (int i = 0; i < MAX_CONSUMERS; i++)
+			tails[i].pos.store(0, std::memory_order_relaxed);
+		high_water.store(0, std::memory_order_relaxed);
+	}
+
+	/* Allocate and fault in the slots from the calling thread, before
+	 * the consumers start */
+	bool allocate(void)
+	{
+		pool.reset(buffer_pool_create(size, slots));
+		if (!pool)
+			return false;
+		buf.reset(new uint8_t *[slots]);
+		for (size_t i = 0; i < slots; i++)
+			buf[i] = (uint8_t *)buffer_pool_get(pool.get());
+		return true;
+	}
+
+	const char *describe(void) const { return buffer_pool_describe(pool.get()); }
+
+	/* Producer side: next free slot, NULL if the ring is full */
+	uint8_t *acquire(void)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+
+		if (h - min_tail(std::memory_order_acquire) == slots)
+			return NULL;
+		return buf[h % slots];
+	}
+
+	void publish(ULONG len, uint8_t channel)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		size_t used = h + 1 - min_tail(std::memory_order_relaxed);
+
+		info[h % slots].len = len;
+		info[h % slots].channel = channel;
+		head.store(h + 1, std::memory_order_release);
+		if (used > high_water.load(std::memory_order_relaxed))
+			high_water.store(used, std::memory_order_relaxed);
+	}
+
+	/* Consumer side: oldest slot not yet released by this consumer,
+	 * NULL if there is none */
+	uint8_t *peek(int consumer, ULONG *len, uint8_t *channel)
+	{
+		size_t t = tails[consumer].pos.load(std::memory_order_relaxed);
+
+		if (t == head.load(std::memory_order_acquire))
+			return NULL;
+		*len = info[t % slots].len;
+		*channel = info[t % slots].channel;
+		return buf[t % slots];
+	}
+
+	void release(int consumer)
+	{
+		std::atomic<size_t> &t = tails[consumer].pos;
+
+		t.store(t.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	size_t used(void) const
+	{
+		return head.load(std::memory_order_relaxed) -
+			min_tail(std::memory_order_relaxed);
+	}
+
+	size_t capacity(void) const { return slots; }
+	size_t peak(void) const { return high_water.load(std::memory_order_relaxed); }
+
+private:
+	struct slot_info {
+		ULONG len;
+		uint8_t channel;
+	};
+
+	struct alignas(64) cursor {
+		std::atomic<size_t> pos;
+	};
+
+	size_t min_tail(std::memory_order order) const
+	{
+		size_t t = tails[0].pos.load(order);
+
+		for (int i = 1; i < consumers; i++)
+			t = std::min(t, tails[i].pos.load(order));
+		return t;
+	}
+
+	buffer_pool_ptr pool;
+	std::unique_ptr<uint8_t *[]> buf;
+	std::unique_ptr<slot_info[]> info;
+	size_t size;
+	size_t slots;
+	int consumers;
+	alignas(64) std::atomic<size_t> head;
+	cursor tails[MAX_CONSUMERS];
+	alignas(64) std::atomic<size_t> high_water;
+};
+
+#endif /* CAPTURE_RING_H */
@@ -0,0 +1,495 @@
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "capture_sink.h"
+
+using namespace std;
+
+class ofstream_sink : public capture_sink {
+public:
+	bool open(const char *path)
+	{
+		file.open(path, ios::out | ios::binary);
+		return file.is_open();
+	}
+
+	bool write(const uint8_t *buf, size_t len)
+	{
+		file.write((const char *)buf, len);
+		return file.good();
+	}
+
+	bool close(void)
+	{
+		file.close();
+		return !file.fail();
+	}
+
+	const char *name(void) const { return "ofstream"; }
+
+private:
+	ofstream file;
+};
+
+/* Common part of the O_DIRECT sinks: stream data is gathered into large
+ * aligned blocks which are handed to the backend at aligned offsets. The
+ * file is preallocated ahead of the write offset with fallocate. */
+class direct_sink : public capture_sink {
+public:
+	direct_sink() : fd(-1) {}
+
+	bool open(const char *path)
+	{
+		fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		if (fd < 0 && errno == EINVAL) {
+			printf("%s: O_DIRECT not supported, using page cache\r\n",
+					path);
+			fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		}
+		if (fd < 0) {
+			printf("Failed to open %s: %s\r\n", path, strerror(errno));
+			return false;
+		}
+
+		for (size_t i = 0; i < BLOCK_COUNT; i++) {
+			void *mem;
+
+			if (posix_memalign(&mem, ALIGN, BLOCK_LEN)) {
+				release();
+				return false;
+			}
+			blocks.push_back((uint8_t *)mem);
+			free_blocks.push_back(i);
+		}
+		offset = size = allocated = 0;
+		fill = 0;
+		failed = false;
+		if (!start()) {
+			release();
+			return false;
+		}
+		current = take_block();
+		return true;
+	}
+
+	bool write(const uint8_t *buf, size_t len)
+	{
+		while (len && !failed) {
+			size_t n = min(len, BLOCK_LEN - fill);
+
+			memcpy(blocks[current] + fill, buf, n);
+			fill += n;
+			size += n;
+			buf += n;
+			len -= n;
+			if (fill == BLOCK_LEN) {
+				flush_block(BLOCK_LEN);
+				current = take_block();
+			}
+		}
+		return !failed;
+	}
+
+	bool close(void)
+	{
+		if (fd < 0)
+			return false;
+		if (fill) {
+			/* O_DIRECT needs whole sectors, trimmed by ftruncate below */
+			size_t len = (fill + ALIGN - 1) & ~(ALIGN - 1);
+
+			memset(blocks[current] + fill, 0, len - fill);
+			flush_block(len);
+		} else
+			release_block(current);
+		drain();
+		stop();
+		if (ftruncate(fd, size))
+			failed = true;
+		release();
+		return !failed;
+	}
+
+protected:
+	static const size_t BLOCK_LEN = 1 << 20;
+	static const size_t BLOCK_COUNT = 16;
+	static const size_t ALIGN = 4096;
+	static const uint64_t PREALLOC_STEP = 256 << 20;
+
+	/* Backend interface */
+	virtual bool start(void) = 0;
+	virtual void stop(void) = 0;
+	virtual void submit(size_t block, size_t len, uint64_t off) = 0;
+	/* Wait until at least one block is free again */
+	virtual void reap(void) = 0;
+	/* Wait until all submitted blocks are written */
+	virtual void drain(void) = 0;
+
+	void release_block(size_t block)
+	{
+		lock_guard<mutex> lk(lock);
+
+		free_blocks.push_back(block);
+		cv.notify_one();
+	}
+
+	void complete(size_t block, ssize_t res, size_t len)
+	{
+		if (res != (ssize_t)len) {
+			printf("Capture write failed: %s\r\n",
+					res < 0 ? strerror(-res) : "short write");
+			failed = true;
+		}
+		release_block(block);
+	}
+
+	int fd;
+	vector<uint8_t *> blocks;
+	deque<size_t> free_blocks;
+	mutex lock;
+	condition_variable cv;
+	atomic_bool failed;
+
+private:
+	void release(void)
+	{
+		::close(fd);
+		fd = -1;
+		for (uint8_t *p : blocks)
+			free(p);
+		blocks.clear();
+		free_blocks.clear();
+	}
+
+	size_t take_block(void)
+	{
+		for (;;) {
+			{
+				lock_guard<mutex> lk(lock);
+
+				if (!free_blocks.empty()) {
+					size_t block = free_blocks.front();
+
+					free_blocks.pop_front();
+					return block;
+				}
+			}
+			reap();
+		}
+	}
+
+	void flush_block(size_t len)
+	{
+		if (offset + len > allocated) {
+			/* Keep the file size, the tail is trimmed on close */
+			if (!fallocate(fd, FALLOC_FL_KEEP_SIZE, allocated,
+						PREALLOC_STEP))
+				allocated += PREALLOC_STEP;
+			else
+				allocated = UINT64_MAX;
+		}
+		submit(current, len, offset);
+		offset += len;
+		fill = 0;
+	}
+
+	uint64_t offset; /* file offset of the current block */
+	uint64_t size; /* bytes written by the caller */
+	uint64_t allocated;
+	size_t current;
+	size_t fill;
+};
+
+class pwrite_sink : public direct_sink {
+public:
+	const char *name(void) const { return "pwrite"; }
+
+protected:
+	static const int WORKERS = 4;
+
+	struct job {
+		size_t block;
+		size_t len;
+		uint64_t off;
+	};
+
+	bool start(void)
+	{
+		stopping = false;
+		outstanding = 0;
+		for (int i = 0; i < WORKERS; i++)
+			workers.push_back(thread(&pwrite_sink::worker, this));
+		return true;
+	}
+
+	void stop(void)
+	{
+		{
+			lock_guard<mutex> lk(lock);
+			stopping = true;
+			job_cv.notify_all();
+		}
+		for (thread &t : workers)
+			t.join();
+		workers.clear();
+	}
+
+	void submit(size_t block, size_t len, uint64_t off)
+	{
+		lock_guard<mutex> lk(lock);
+
+		jobs.push_back(job{block, len, off});
+		outstanding++;
+		job_cv.notify_one();
+	}
+
+	void reap(void)
+	{
+		unique_lock<mutex> lk(lock);
+
+		cv.wait(lk, [this] { return !free_blocks.empty(); });
+	}
+
+	void drain(void)
+	{
+		unique_lock<mutex> lk(lock);
+
+		cv.wait(lk, [this] { return !outstanding; });
+	}
+
+private:
+	void worker(void)
+	{
+		unique_lock<mutex> lk(lock);
+
+		for (;;) {
+			job_cv.wait(lk, [this] { return stopping || !jobs.empty(); });
+			if (jobs.empty())
+				break;
+
+			job j = jobs.front();
+			jobs.pop_front();
+			lk.unlock();
+
+			ssize_t res = pwrite(fd, blocks[j.block], j.len, j.off);
+
+			complete(j.block, res < 0 ? -errno : res, j.len);
+			lk.lock();
+			outstanding--;
+			cv.notify_all();
+		}
+	}
+
+	vector<thread> workers;
+	deque<job> jobs;
+	condition_variable job_cv;
+	size_t outstanding;
+	bool stopping;
+};
+
+/* io_uring through the raw system calls, liburing is not required */
+class uring_sink : public direct_sink {
+public:
+	uring_sink() : ring_fd(-1), sq_ptr((uint8_t *)MAP_FAILED),
+		cq_ptr((uint8_t *)MAP_FAILED), sqes((io_uring_sqe *)MAP_FAILED) {}
+
+	const char *name(void) const { return "uring"; }
+
+	/* Probe whether the kernel lets us create a ring of the size used.
+	 * Fails without io_uring (ENOSYS) or with it disabled (EPERM). */
+	static bool supported(void)
+	{
+		io_uring_params p;
+
+		memset(&p, 0, sizeof(p));
+		int fd = syscall(__NR_io_uring_setup, BLOCK_COUNT, &p);
+		if (fd < 0) {
+			printf("io_uring not available: %s\r\n", strerror(errno));
+			return false;
+		}
+		::close(fd);
+		return true;
+	}
+
+protected:
+	bool start(void)
+	{
+		io_uring_params p;
+
+		memset(&p, 0, sizeof(p));
+		ring_fd = syscall(__NR_io_uring_setup, BLOCK_COUNT, &p);
+		if (ring_fd < 0) {
+			printf("io_uring_setup failed: %s, try -s pwrite\r\n",
+					strerror(errno));
+			return false;
+		}
+
+		sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			sq_len = cq_len = max(sq_len, cq_len);
+		sq_ptr = (uint8_t *)mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			cq_ptr = sq_ptr;
+		else
+			cq_ptr = (uint8_t *)mmap(NULL, cq_len,
+					PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					ring_fd, IORING_OFF_CQ_RING);
+		sqes_len = p.sq_entries * sizeof(io_uring_sqe);
+		sqes = (io_uring_sqe *)mmap(NULL, sqes_len,
+				PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ring_fd, IORING_OFF_SQES);
+		if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED ||
+				sqes == MAP_FAILED) {
+			printf("Failed to map io_uring: %s, try -s pwrite\r\n",
+					strerror(errno));
+			stop();
+			return false;
+		}
+
+		sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+		sq_mask = *(unsigned *)(sq_ptr + p.sq_off.ring_mask);
+		sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+		cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+		cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+		cq_mask = *(unsigned *)(cq_ptr + p.cq_off.ring_mask);
+		cqes = (io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+		iovecs.resize(BLOCK_COUNT);
+		in_flight = 0;
+		return true;
+	}
+
+	/* Also undoes a start() that failed part way */
+	void stop(void)
+	{
+		if (sqes != MAP_FAILED)
+			munmap(sqes, sqes_len);
+		if (cq_ptr != sq_ptr && cq_ptr != MAP_FAILED)
+			munmap(cq_ptr, cq_len);
+		if (sq_ptr != MAP_FAILED)
+			munmap(sq_ptr, sq_len);
+		sqes = (io_uring_sqe *)MAP_FAILED;
+		sq_ptr = cq_ptr = (uint8_t *)MAP_FAILED;
+		::close(ring_fd);
+		ring_fd = -1;
+	}
+
+	void submit(size_t block, size_t len, uint64_t off)
+	{
+		unsigned tail = *sq_tail;
+		unsigned idx = tail & sq_mask;
+		io_uring_sqe *sqe = &sqes[idx];
+
+		iovecs[block].iov_base = blocks[block];
+		iovecs[block].iov_len = len;
+
+		/* IORING_OP_WRITEV is available since the first io_uring kernel */
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_WRITEV;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)&iovecs[block];
+		sqe->len = 1;
+		sqe->off = off;
+		sqe->user_data = block;
+		sq_array[idx] = idx;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+		long ret;
+
+		while ((ret = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0,
+						NULL, 0)) < 0 && errno == EINTR)
+			;
+		if (ret != 1) {
+			/* Not consumed by the kernel, take the entry back so no
+			 * completion is waited for */
+			printf("Capture write not submitted: %s\r\n",
+					ret < 0 ? strerror(errno) : "ring full");
+			__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+			failed = true;
+			release_block(block);
+			return;
+		}
+		in_flight++;
+		complete_ready();
+	}
+
+	void reap(void)
+	{
+		wait_completion(1);
+	}
+
+	void drain(void)
+	{
+		while (in_flight)
+			wait_completion(1);
+	}
+
+private:
+	void wait_completion(unsigned min)
+	{
+		if (!complete_ready() && in_flight)
+			syscall(__NR_io_uring_enter, ring_fd, 0, min,
+					IORING_ENTER_GETEVENTS, NULL, 0);
+		complete_ready();
+	}
+
+	unsigned complete_ready(void)
+	{
+		unsigned head = *cq_head;
+		unsigned count = 0;
+
+		while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+			io_uring_cqe *cqe = &cqes[head & cq_mask];
+			size_t block = cqe->user_data;
+
+			complete(block, cqe->res, iovecs[block].iov_len);
+			head++;
+			count++;
+			in_flight--;
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		return count;
+	}
+
+	int ring_fd;
+	uint8_t *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+	io_uring_sqe *sqes;
+	io_uring_cqe *cqes;
+	unsigned *sq_tail, *sq_array, *cq_head, *cq_tail;
+	unsigned sq_mask, cq_mask;
+	vector<struct iovec> iovecs;
+	size_t in_flight;
+};
+
+unique_ptr<capture_sink> create_capture_sink(const char *type)
+{
+	string t(type);
+
+	if (t == "ofstream")
+		return unique_ptr<capture_sink>(new ofstream_sink);
+	if (t == "pwrite")
+		return unique_ptr<capture_sink>(new pwrite_sink);
+	if (t == "uring") {
+		if (uring_sink::supported())
+			return unique_ptr<capture_sink>(new uring_sink);
+		printf("io_uring not available, falling back to pwrite\r\n");
+		return unique_ptr<capture_sink>(new pwrite_sink);
+	}
+	return NULL;
+}
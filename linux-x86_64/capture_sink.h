@@ -0,0 +1,29 @@
+#ifndef CAPTURE_SINK_H
+#define CAPTURE_SINK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/* Backend that writes a capture stream to a file
+ *
+ * write() may queue the data and return before it is on disk, but the
+ * caller's buffer can be reused as soon as write() returns. close() waits
+ * for all queued data and leaves the file at the exact written size. */
+class capture_sink {
+public:
+	virtual ~capture_sink() {}
+
+	virtual bool open(const char *path) = 0;
+	virtual bool write(const uint8_t *buf, size_t len) = 0;
+	virtual bool close(void) = 0;
+	virtual const char *name(void) const = 0;
+};
+
+/* type: "ofstream" (buffered std::ofstream), "pwrite" (O_DIRECT writes
+ * from a thread pool) or "uring" (O_DIRECT writes through io_uring, falls
+ * back to "pwrite" when io_uring is not available).
+ * Returns NULL for an unknown type. */
+std::unique_ptr<capture_sink> create_capture_sink(const char *type);
+
+#endif /* CAPTURE_SINK_H */
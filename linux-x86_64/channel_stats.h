@@ -0,0 +1,130 @@
+#ifndef CHANNEL_STATS_H
+#define CHANNEL_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+/* Transfer counters of one channel and direction. Only the thread moving
+ * data on the pipe writes a block, so updates are relaxed load/store pairs
+ * instead of locked read-modify-writes, and every block owns its cache
+ * line so channels never bounce one between cores. */
+struct alignas(64) channel_stats {
+	std::atomic<uint64_t> bytes;
+	std::atomic<uint64_t> transfers;
+	std::atomic<uint64_t> timeouts;
+	std::atomic<uint64_t> errors;
+
+	void add(uint64_t count)
+	{
+		bump(bytes, count);
+		bump(transfers, 1);
+	}
+
+	void timeout(void) { bump(timeouts, 1); }
+	void error(void) { bump(errors, 1); }
+
+	static void bump(std::atomic<uint64_t> &val, uint64_t n)
+	{
+		val.store(val.load(std::memory_order_relaxed) + n,
+				std::memory_order_relaxed);
+	}
+};
+
+struct stats_sample {
+	uint64_t bytes;
+	uint64_t transfers;
+	uint64_t timeouts;
+	uint64_t errors;
+};
+
+enum stats_dir { STATS_TX, STATS_RX };
+
+/* Counters of every channel of a device. The measure thread never resets
+ * a block, it keeps the previous readings itself, so it cannot stall or
+ * race with the data threads. */
+class device_stats {
+public:
+	static const int MAX_CHANNELS = 4;
+
+	channel_stats &channel(stats_dir dir, uint8_t ch)
+	{
+		return blocks[dir][ch];
+	}
+
+	/* Counts since the start */
+	stats_sample total(stats_dir dir, uint8_t ch) const
+	{
+		const channel_stats &b = blocks[dir][ch];
+		stats_sample s;
+
+		s.bytes = b.bytes.load(std::memory_order_relaxed);
+		s.transfers = b.transfers.load(std::memory_order_relaxed);
+		s.timeouts = b.timeouts.load(std::memory_order_relaxed);
+		s.errors = b.errors.load(std::memory_order_relaxed);
+		return s;
+	}
+
+	/* Counts since the previous call, measure thread only */
+	stats_sample interval(stats_dir dir, uint8_t ch)
+	{
+		stats_sample now = total(dir, ch);
+		stats_sample &prev = last[dir][ch];
+		stats_sample s;
+
+		s.bytes = now.bytes - prev.bytes;
+		s.transfers = now.transfers - prev.transfers;
+		s.timeouts = now.timeouts - prev.timeouts;
+		s.errors = now.errors - prev.errors;
+		prev = now;
+		return s;
+	}
+
+	/* Print the 1 second "TX:x RX:y, total:z" rates, broken down per
+	 * channel when more than one is in use, plus any timeouts and errors.
+	 * The caller ends the line. tx_bytes/rx_bytes may be NULL. */
+	void show_rates(uint8_t out_cnt, uint8_t in_cnt,
+			uint64_t *tx_bytes = NULL, uint64_t *rx_bytes = NULL)
+	{
+		stats_sample tx[MAX_CHANNELS] = {}, rx[MAX_CHANNELS] = {};
+		uint64_t tx_sum = 0, rx_sum = 0, timeouts = 0, errors = 0;
+		uint8_t ch_cnt = out_cnt > in_cnt ? out_cnt : in_cnt;
+
+		for (uint8_t ch = 0; ch < ch_cnt; ch++) {
+			if (ch < out_cnt)
+				tx[ch] = interval(STATS_TX, ch);
+			if (ch < in_cnt)
+				rx[ch] = interval(STATS_RX, ch);
+			tx_sum += tx[ch].bytes;
+			rx_sum += rx[ch].bytes;
+			timeouts += tx[ch].timeouts + rx[ch].timeouts;
+			errors += tx[ch].errors + rx[ch].errors;
+		}
+
+		printf("TX:%.2fMiB/s RX:%.2fMiB/s, total:%.2fMiB",
+			(double)tx_sum/1000/1000, (double)rx_sum/1000/1000,
+			(double)(tx_sum + rx_sum)/1000/1000);
+		for (uint8_t ch = 0; ch_cnt > 1 && ch < ch_cnt; ch++) {
+			printf(" | CH%d", ch);
+			if (ch < out_cnt)
+				printf(" TX:%.2f", (double)tx[ch].bytes/1000/1000);
+			if (ch < in_cnt)
+				printf(" RX:%.2f", (double)rx[ch].bytes/1000/1000);
+		}
+		if (timeouts || errors)
+			printf(" timeouts:%llu errors:%llu",
+				(unsigned long long)timeouts,
+				(unsigned long long)errors);
+
+		if (tx_bytes)
+			*tx_bytes = tx_sum;
+		if (rx_bytes)
+			*rx_bytes = rx_sum;
+	}
+
+private:
+	channel_stats blocks[2][MAX_CHANNELS];
+	stats_sample last[2][MAX_CHANNELS]; /* measure thread only */
+};
+
+#endif /* CHANNEL_STATS_H */
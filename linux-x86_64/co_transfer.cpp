@@ -0,0 +1,181 @@
+#include <cstdio>
+#include <new>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "co_transfer.h"
+
+using namespace std;
+
+/* Free task frames of this thread by size. All tasks of one coroutine
+ * function have the same frame size, so a few sizes cover a program. */
+struct frame_list {
+	size_t size;
+	void *head;
+};
+
+static const int FRAME_SIZES = 8;
+static thread_local frame_list frames[FRAME_SIZES];
+
+void *co_task::promise_type::operator new(size_t size)
+{
+	for (frame_list &list : frames) {
+		if (list.size == size && list.head) {
+			void *frame = list.head;
+
+			list.head = *(void **)frame;
+			return frame;
+		}
+	}
+	return ::operator new(size);
+}
+
+void co_task::promise_type::operator delete(void *frame, size_t size)
+{
+	for (frame_list &list : frames) {
+		if (list.size == size || !list.size) {
+			list.size = size;
+			*(void **)frame = list.head;
+			list.head = frame;
+			return;
+		}
+	}
+	::operator delete(frame);
+}
+
+co_task::promise_type::~promise_type()
+{
+	if (exec)
+		exec->live--;
+}
+
+bool transfer_awaiter::await_suspend(coroutine_handle<> h)
+{
+	waiter = h;
+	if (pipe->in_flight == pipe->depth) {
+		if (pipe->line_tail)
+			pipe->line_tail->next = this;
+		else
+			pipe->line_head = this;
+		pipe->line_tail = this;
+		return true;
+	}
+	/* Refused, resume right away with the error */
+	return pipe->start(this);
+}
+
+bool co_pipe::open(co_executor &ex, FT_HANDLE dev, UCHAR ep, int max)
+{
+	exec = &ex;
+	handle = dev;
+	pipe = ep;
+	depth = max;
+	in_flight = 0;
+	line_head = line_tail = nullptr;
+	return events.open(handle, pipe, depth) && exec->watch(this);
+}
+
+void co_pipe::close(void)
+{
+	events.close();
+}
+
+bool co_pipe::start(transfer_awaiter *op)
+{
+	if (!events.submit(op->buf, op->len, op)) {
+		op->result.count = 0;
+		op->result.status = FT_IO_ERROR;
+		op->result.submitted = chrono::steady_clock::now();
+		return false;
+	}
+	in_flight++;
+	return true;
+}
+
+/* Resume the tasks whose transfers completed, each slot going to the
+ * next transfer in line first */
+void co_pipe::dispatch(void)
+{
+	pipe_completion done;
+
+	while (events.complete(&done)) {
+		transfer_awaiter *op = (transfer_awaiter *)done.ctx;
+
+		in_flight--;
+		op->result.count = done.count;
+		op->result.status = done.status;
+		op->result.submitted = done.submitted;
+
+		while (line_head && in_flight < depth) {
+			transfer_awaiter *next = line_head;
+
+			line_head = next->next;
+			if (!line_head)
+				line_tail = nullptr;
+			next->next = nullptr;
+			if (!start(next))
+				next->waiter.resume();
+		}
+		op->waiter.resume();
+	}
+}
+
+void co_pipe::abort(void)
+{
+	FT_AbortPipe(handle, pipe);
+}
+
+co_executor::~co_executor()
+{
+	if (ep >= 0)
+		close(ep);
+}
+
+bool co_executor::init(void)
+{
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (ep < 0) {
+		printf("Failed to create epoll instance\r\n");
+		return false;
+	}
+	return true;
+}
+
+bool co_executor::watch(co_pipe *pipe)
+{
+	epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = pipe;
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, pipe->events.fd(), &ev)) {
+		printf("Failed to watch pipe %02X\r\n", pipe->pipe);
+		return false;
+	}
+	pipes.push_back(pipe);
+	return true;
+}
+
+void co_executor::spawn(co_task task)
+{
+	coroutine_handle<co_task::promise_type> h = task.handle;
+
+	task.handle = nullptr;
+	h.promise().exec = this;
+	live++;
+	h.resume();
+}
+
+void co_executor::run(const bool *stop)
+{
+	while (live) {
+		/* Again on every pass, transfers in line start after an abort */
+		if (*stop)
+			for (co_pipe *pipe : pipes)
+				pipe->abort();
+
+		epoll_event events[16];
+		int n = epoll_wait(ep, events, 16, 100);
+
+		for (int i = 0; i < n; i++)
+			((co_pipe *)events[i].data.ptr)->dispatch();
+	}
+}
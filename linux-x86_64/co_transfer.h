@@ -0,0 +1,162 @@
+#ifndef CO_TRANSFER_H
+#define CO_TRANSFER_H
+
+#include <chrono>
+#include <coroutine>
+#include <span>
+#include <vector>
+#include "ftd3xx.h"
+#include "pipe_events.h"
+
+/* Coroutines over the overlapped transfer calls, C++20 (-std=c++20):
+ *
+ *	co_task reader(co_pipe &pipe, std::span<uint8_t> buf)
+ *	{
+ *		for (;;) {
+ *			transfer_result res = co_await pipe.read(buf);
+ *			...
+ *		}
+ *	}
+ *
+ * One co_executor thread runs all tasks. Every co_pipe is a pipe_events
+ * queue whose eventfd the executor waits for with epoll, and a transfer
+ * awaited while depth transfers are already queued waits in line for a
+ * free slot. The transfer state lives in the awaiting frame and task
+ * frames are reused from a per-thread free list, so nothing is allocated
+ * per transfer. Tasks and pipes belong to the executor's thread. */
+
+struct transfer_result {
+	ULONG count;
+	FT_STATUS status;
+	std::chrono::steady_clock::time_point submitted; /* queued to the pipe */
+};
+
+class co_executor;
+class co_pipe;
+
+/* A task started by co_executor::spawn, its frame goes back to the free
+ * list when it returns */
+class co_task {
+public:
+	struct promise_type {
+		co_executor *exec = nullptr;
+
+		~promise_type();
+		co_task get_return_object(void)
+		{
+			return co_task(std::coroutine_handle<promise_type>::
+					from_promise(*this));
+		}
+		std::suspend_always initial_suspend(void) noexcept { return {}; }
+		std::suspend_never final_suspend(void) noexcept { return {}; }
+		void return_void(void) {}
+		void unhandled_exception(void) { std::terminate(); }
+
+		static void *operator new(size_t size);
+		static void operator delete(void *frame, size_t size);
+	};
+
+	co_task(co_task &&other) : handle(other.handle) { other.handle = nullptr; }
+	~co_task() { if (handle) handle.destroy(); }
+	co_task(const co_task &) = delete;
+	co_task &operator=(const co_task &) = delete;
+
+private:
+	friend class co_executor;
+	explicit co_task(std::coroutine_handle<promise_type> h) : handle(h) {}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+/* co_await pipe.read(buf) / pipe.write(buf) */
+class transfer_awaiter {
+public:
+	bool await_ready(void) const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h);
+	transfer_result await_resume(void) const noexcept { return result; }
+
+private:
+	friend class co_pipe;
+	transfer_awaiter(co_pipe *pipe, uint8_t *buf, ULONG len)
+		: pipe(pipe), buf(buf), len(len), next(nullptr) {}
+
+	co_pipe *pipe;
+	uint8_t *buf;
+	ULONG len;
+	std::coroutine_handle<> waiter;
+	transfer_result result;
+	transfer_awaiter *next; /* in line for a slot */
+};
+
+class co_pipe {
+public:
+	co_pipe() : exec(nullptr), depth(0), in_flight(0),
+		line_head(nullptr), line_tail(nullptr) {}
+	co_pipe(const co_pipe &) = delete;
+	co_pipe &operator=(const co_pipe &) = delete;
+
+	/* Up to depth transfers on pipe (0x02+ch OUT, 0x82+ch IN) at a time.
+	 * Prints the reason and returns false on failure. */
+	bool open(co_executor &exec, FT_HANDLE handle, UCHAR pipe, int depth);
+	void close(void);
+
+	transfer_awaiter read(std::span<uint8_t> buf)
+	{
+		return transfer_awaiter(this, buf.data(), buf.size());
+	}
+	transfer_awaiter write(std::span<const uint8_t> buf)
+	{
+		return transfer_awaiter(this, (uint8_t *)buf.data(), buf.size());
+	}
+
+	/* Transfers on the pipe now, not counting those in line */
+	int queued(void) const { return in_flight; }
+
+private:
+	friend class co_executor;
+	friend class transfer_awaiter;
+
+	bool start(transfer_awaiter *op);
+	void dispatch(void);
+	void abort(void);
+
+	pipe_events events;
+	co_executor *exec;
+	FT_HANDLE handle;
+	UCHAR pipe;
+	int depth;
+	int in_flight;
+	transfer_awaiter *line_head;
+	transfer_awaiter *line_tail;
+};
+
+class co_executor {
+public:
+	co_executor() : ep(-1), live(0) {}
+	~co_executor();
+	co_executor(const co_executor &) = delete;
+	co_executor &operator=(const co_executor &) = delete;
+
+	/* Prints the reason and returns false on failure */
+	bool init(void);
+	/* Run the task until its first co_await */
+	void spawn(co_task task);
+	/* Resume tasks as their transfers complete until none is left. Once
+	 * *stop is set every pipe is aborted, so the tasks get their
+	 * transfers back and can see it. */
+	void run(const bool *stop);
+
+	int tasks(void) const { return live; }
+
+private:
+	friend class co_pipe;
+	friend struct co_task::promise_type;
+
+	bool watch(co_pipe *pipe);
+
+	int ep;
+	int live;
+	std::vector<co_pipe *> pipes;
+};
+
+#endif /* CO_TRANSFER_H */
@@ -0,0 +1,150 @@
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "content_compare.h"
+
+using namespace std;
+
+/* Work is handed out in chunks so an early mismatch stops the workers
+ * that are still busy with later parts of the buffers */
+static const size_t CHUNK_LEN = 16*1024*1024;
+
+static size_t mismatch_scalar(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 8 <= len; i += 8) {
+		uint64_t wa, wb;
+
+		/* Any alignment, memcpy compiles to plain loads */
+		memcpy(&wa, a + i, sizeof(wa));
+		memcpy(&wb, b + i, sizeof(wb));
+		if (wa != wb)
+			break;
+	}
+	for (; i < len; i++)
+		if (a[i] != b[i])
+			break;
+	return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static size_t mismatch_sse2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		__m128i m0 = _mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)(a + i)),
+				_mm_loadu_si128((const __m128i *)(b + i)));
+		__m128i m1 = _mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)(a + i + 16)),
+				_mm_loadu_si128((const __m128i *)(b + i + 16)));
+		__m128i m2 = _mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)(a + i + 32)),
+				_mm_loadu_si128((const __m128i *)(b + i + 32)));
+		__m128i m3 = _mm_cmpeq_epi8(
+				_mm_loadu_si128((const __m128i *)(a + i + 48)),
+				_mm_loadu_si128((const __m128i *)(b + i + 48)));
+		__m128i m = _mm_and_si128(_mm_and_si128(m0, m1),
+				_mm_and_si128(m2, m3));
+
+		if (_mm_movemask_epi8(m) != 0xFFFF)
+			break;
+	}
+	return i + mismatch_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t mismatch_avx2(const uint8_t *a, const uint8_t *b, size_t len)
+{
+	size_t i = 0;
+
+	for (; i + 128 <= len; i += 128) {
+		__m256i m0 = _mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i *)(a + i)),
+				_mm256_loadu_si256((const __m256i *)(b + i)));
+		__m256i m1 = _mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i *)(a + i + 32)),
+				_mm256_loadu_si256((const __m256i *)(b + i + 32)));
+		__m256i m2 = _mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i *)(a + i + 64)),
+				_mm256_loadu_si256((const __m256i *)(b + i + 64)));
+		__m256i m3 = _mm256_cmpeq_epi8(
+				_mm256_loadu_si256((const __m256i *)(a + i + 96)),
+				_mm256_loadu_si256((const __m256i *)(b + i + 96)));
+		__m256i m = _mm256_and_si256(_mm256_and_si256(m0, m1),
+				_mm256_and_si256(m2, m3));
+
+		if ((uint32_t)_mm256_movemask_epi8(m) != 0xFFFFFFFF)
+			break;
+	}
+	return i + mismatch_sse2(a + i, b + i, len - i);
+}
+#endif
+
+typedef size_t (*mismatch_fn)(const uint8_t *, const uint8_t *, size_t);
+
+static mismatch_fn select_mismatch(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return mismatch_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return mismatch_sse2;
+#endif
+	return mismatch_scalar;
+}
+
+size_t find_mismatch(const uint8_t *a, const uint8_t *b, size_t len,
+		unsigned threads)
+{
+	static const mismatch_fn mismatch = select_mismatch();
+	size_t chunks = (len + CHUNK_LEN - 1) / CHUNK_LEN;
+	atomic<size_t> next_chunk(0);
+	atomic<size_t> first(len);
+
+	if (!threads)
+		threads = max(thread::hardware_concurrency(), 1U);
+	threads = min<size_t>(threads, max<size_t>(chunks, 1));
+
+	auto worker = [&] {
+		for (;;) {
+			size_t chunk = next_chunk++;
+			size_t start = chunk * CHUNK_LEN;
+
+			/* Chunks are taken in order, anything past a known
+			 * mismatch can't hold an earlier one */
+			if (chunk >= chunks || start >= first.load())
+				break;
+
+			size_t n = min(CHUNK_LEN, len - start);
+			size_t off = mismatch(a + start, b + start, n);
+
+			if (off < n) {
+				size_t found = start + off;
+				size_t cur = first.load();
+
+				while (found < cur &&
+						!first.compare_exchange_weak(cur, found))
+					;
+				break;
+			}
+		}
+	};
+
+	vector<thread> workers;
+	for (unsigned i = 1; i < threads; i++)
+		workers.push_back(thread(worker));
+	worker();
+	for (thread &t : workers)
+		t.join();
+	return first;
+}
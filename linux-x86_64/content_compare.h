@@ -0,0 +1,13 @@
+#ifndef CONTENT_COMPARE_H
+#define CONTENT_COMPARE_H
+
+#include <cstddef>
+#include <cstdint>
+
+/* Offset of the first byte that differs between a and b, len if the
+ * buffers are equal. The buffers are split across up to threads workers
+ * (0 = one per CPU), each comparing with AVX2 or SSE2 when available. */
+size_t find_mismatch(const uint8_t *a, const uint8_t *b, size_t len,
+		unsigned threads = 0);
+
+#endif /* CONTENT_COMPARE_H */
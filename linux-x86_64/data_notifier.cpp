@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "data_notifier.h"
+
+using namespace std;
+
+bool data_notifier::start(FT_HANDLE dev)
+{
+	stop();
+	memset(pending, 0, sizeof(pending));
+	next = 0;
+	stopped = false;
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0) {
+		printf("Failed to create notification eventfd\r\n");
+		return false;
+	}
+	if (FT_OK != FT_SetNotificationCallback(dev, callback, this)) {
+		printf("Failed to set notification callback\r\n");
+		close(efd);
+		efd = -1;
+		return false;
+	}
+	handle = dev;
+	return true;
+}
+
+void data_notifier::stop(void)
+{
+	if (handle) {
+		FT_ClearNotificationCallback(handle);
+		handle = NULL;
+	}
+	if (efd >= 0) {
+		close(efd);
+		efd = -1;
+	}
+	lock_guard<mutex> lk(lock);
+	stopped = true;
+	cv.notify_all();
+}
+
+/* Called from the driver's notification thread, once per chunk the pipe
+ * received */
+void data_notifier::callback(PVOID ctx, E_FT_NOTIFICATION_CALLBACK_TYPE type,
+		PVOID info)
+{
+	data_notifier *self = (data_notifier *)ctx;
+	FT_NOTIFICATION_CALLBACK_INFO_DATA *data =
+		(FT_NOTIFICATION_CALLBACK_INFO_DATA *)info;
+	int channel = data->ucEndpointNo - 0x82;
+
+	if (type != E_FT_NOTIFICATION_CALLBACK_TYPE_DATA ||
+			channel < 0 || channel >= MAX_CHANNELS)
+		return;
+	lock_guard<mutex> lk(self->lock);
+	self->pending[channel] += data->ulRecvNotificationLength;
+	self->cv.notify_all();
+
+	uint64_t one = 1;
+
+	if (write(self->efd, &one, sizeof(one)) != sizeof(one))
+		printf("Failed to signal notification eventfd\r\n");
+}
+
+ULONG data_notifier::wait(uint8_t first, uint8_t end, uint8_t *channel,
+		chrono::milliseconds timeout)
+{
+	auto deadline = chrono::steady_clock::now() + timeout;
+	unique_lock<mutex> lk(lock);
+
+	for (;;) {
+		for (uint8_t i = 0; i < end - first; i++) {
+			uint8_t ch = first + (next + i) % (end - first);
+
+			if (pending[ch]) {
+				next = (ch - first + 1) % (end - first);
+				*channel = ch;
+				return pending[ch];
+			}
+		}
+		if (stopped || cv.wait_until(lk, deadline) == cv_status::timeout)
+			return 0;
+	}
+}
+
+ULONG data_notifier::unread(uint8_t channel)
+{
+	lock_guard<mutex> lk(lock);
+
+	return pending[channel];
+}
+
+void data_notifier::consumed(uint8_t channel, ULONG count)
+{
+	lock_guard<mutex> lk(lock);
+
+	pending[channel] -= min(count, pending[channel]);
+}
@@ -0,0 +1,58 @@
+#ifndef DATA_NOTIFIER_H
+#define DATA_NOTIFIER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include "ftd3xx.h"
+
+/* Event driven receive: registers FT_SetNotificationCallback on a device
+ * and lets reader threads sleep until an IN pipe has data, instead of
+ * blocking in FT_ReadPipeEx through timeout after timeout. Every
+ * notification adds its length to the channel's count of unread bytes,
+ * a reader reads at most that much, which returns without waiting for
+ * more data, and takes what it read off with consumed(). */
+class data_notifier {
+public:
+	static const int MAX_CHANNELS = 4;
+
+	data_notifier() : handle(NULL), efd(-1), stopped(false) {}
+	~data_notifier() { stop(); }
+	data_notifier(const data_notifier &) = delete;
+	data_notifier &operator=(const data_notifier &) = delete;
+
+	/* Prints the reason and returns false on failure */
+	bool start(FT_HANDLE handle);
+	/* Unregister the callback and wake all waiting readers */
+	void stop(void);
+
+	/* Wait up to timeout for data on one of the IN channels [first, end),
+	 * taking them in turn. Returns the channel and its unread bytes, 0 on
+	 * timeout or after stop(). The count stays until consumed(). */
+	ULONG wait(uint8_t first, uint8_t end, uint8_t *channel,
+			std::chrono::milliseconds timeout);
+	/* Unread bytes on channel, never blocks */
+	ULONG unread(uint8_t channel);
+	/* Take count bytes read from channel off its unread bytes */
+	void consumed(uint8_t channel, ULONG count);
+
+	/* An eventfd signalled on every notification, for an epoll loop:
+	 * read it to clear, then look at unread(). Valid from start() to
+	 * stop(). */
+	int fd(void) const { return efd; }
+
+private:
+	static void callback(PVOID ctx, E_FT_NOTIFICATION_CALLBACK_TYPE type,
+			PVOID info);
+
+	FT_HANDLE handle;
+	int efd;
+	std::mutex lock;
+	std::condition_variable cv;
+	/* Bytes notified and not consumed yet per channel */
+	ULONG pending[MAX_CHANNELS];
+	uint8_t next; /* channel to look at first */
+	bool stopped;
+};
+
+#endif /* DATA_NOTIFIER_H */
@@ -0,0 +1,437 @@
+#include <chrono>
+#include <thread>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include "device_session.h"
+
+using namespace std;
+
+static const int LIST_TIMEOUT_MS = 500;
+static const int REENUM_GONE_MS = 1000;    /* for the chip to drop off */
+static const int REENUM_TIMEOUT_MS = 6000; /* for it to come back */
+static const int POLL_MS = 10;
+
+void session_config_init(struct session_config *cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->channel_config = CONFIGURATION_CHANNEL_CONFIG_1;
+	cfg->clock = CONFIGURATION_FIFO_CLK_100;
+}
+
+UCHAR session_channel_config(int out_cnt, int in_cnt)
+{
+	if (in_cnt == 1 && out_cnt == 0)
+		return CONFIGURATION_CHANNEL_CONFIG_1_INPIPE;
+	if (in_cnt == 0 && out_cnt == 1)
+		return CONFIGURATION_CHANNEL_CONFIG_1_OUTPIPE;
+
+	int total = in_cnt < out_cnt ? out_cnt : in_cnt;
+
+	/* There is no 3 channel configuration. streamer and zynqtest used
+	 * to fall back to CONFIG_1 for 3, which leaves channels 1 and 2
+	 * without pipes; CONFIG_4 (as rw always used) provides them, the
+	 * fourth stays unused. */
+	if (total > 2)
+		return CONFIGURATION_CHANNEL_CONFIG_4;
+	if (total == 2)
+		return CONFIGURATION_CHANNEL_CONFIG_2;
+	return CONFIGURATION_CHANNEL_CONFIG_1;
+}
+
+void show_versions(void)
+{
+	DWORD dwVersion;
+
+	FT_GetDriverVersion(NULL, &dwVersion);
+	printf("Driver version:%d.%d.%d.%d\r\n", dwVersion >> 24,
+			(uint8_t)(dwVersion >> 16), (uint8_t)(dwVersion >> 8),
+			dwVersion & 0xFF);
+
+	FT_GetLibraryVersion(&dwVersion);
+	printf("Library version:%d.%d.%d\r\n", dwVersion >> 24,
+			(uint8_t)(dwVersion >> 16), dwVersion & 0xFFFF);
+}
+
+static void get_vid_pid(FT_HANDLE handle)
+{
+	WORD vid, pid;
+
+	if (FT_OK != FT_GetVIDPID(handle, &vid, &pid))
+		return;
+	printf("VID:%04X PID:%04X\r\n", vid, pid);
+}
+
+#if defined(_WIN32) || defined(_WIN64)
+#define turn_off_all_pipes()
+#define set_transfer_params(transfer, shared)
+#else /* _WIN32 || _WIN64 */
+static void turn_off_all_pipes(void)
+{
+	FT_TRANSFER_CONF conf;
+
+	memset(&conf, 0, sizeof(FT_TRANSFER_CONF));
+	conf.wStructSize = sizeof(FT_TRANSFER_CONF);
+	conf.pipe[FT_PIPE_DIR_IN].fPipeNotUsed = true;
+	conf.pipe[FT_PIPE_DIR_OUT].fPipeNotUsed = true;
+	for (DWORD i = 0; i < 4; i++)
+		FT_SetTransferParams(&conf, i);
+}
+
+/* Must be called before every FT_Create */
+static void set_transfer_params(const FT_TRANSFER_CONF *transfer, bool shared)
+{
+	FT_TRANSFER_CONF conf;
+
+	if (transfer)
+		conf = *transfer;
+	else
+		memset(&conf, 0, sizeof(FT_TRANSFER_CONF));
+	conf.wStructSize = sizeof(FT_TRANSFER_CONF);
+	conf.pipe[FT_PIPE_DIR_IN].fNonThreadSafeTransfer = !shared;
+	conf.pipe[FT_PIPE_DIR_OUT].fNonThreadSafeTransfer = !shared;
+	for (DWORD i = 0; i < 4; i++)
+		FT_SetTransferParams(&conf, i);
+}
+#endif /* !_WIN32 && !_WIN64 */
+
+DWORD list_devices(FT_DEVICE_LIST_INFO_NODE *nodes, DWORD max, int timeout_ms)
+{
+	DWORD count = 0;
+
+	chrono::steady_clock::time_point const timeout =
+		chrono::steady_clock::now() +
+		chrono::milliseconds(timeout_ms);
+
+	do {
+		if (FT_OK == FT_CreateDeviceInfoList(&count))
+			break;
+		this_thread::sleep_for(chrono::milliseconds(POLL_MS));
+	} while (chrono::steady_clock::now() < timeout);
+	printf("Total %u device(s)\r\n", count);
+	if (!count)
+		return 0;
+
+	FT_DEVICE_LIST_INFO_NODE all[SESSION_MAX_DEVICES];
+
+	if (count > SESSION_MAX_DEVICES)
+		count = SESSION_MAX_DEVICES;
+	if (FT_OK != FT_GetDeviceInfoList(all, &count))
+		return 0;
+	if (count > max)
+		count = max;
+	memcpy(nodes, all, count * sizeof(*nodes));
+	return count;
+}
+
+/* Look up the device by serial number, or by index without one */
+static bool find_device(const session_config &cfg,
+		FT_DEVICE_LIST_INFO_NODE *node)
+{
+	FT_DEVICE_LIST_INFO_NODE nodes[SESSION_MAX_DEVICES];
+	DWORD count = list_devices(nodes, SESSION_MAX_DEVICES, LIST_TIMEOUT_MS);
+
+	for (DWORD i = 0; cfg.serial && i < count; i++) {
+		if (!strncmp(nodes[i].SerialNumber, cfg.serial,
+					sizeof(nodes[i].SerialNumber))) {
+			*node = nodes[i];
+			return true;
+		}
+	}
+	if (cfg.serial) {
+		printf("Device %s not found\r\n", cfg.serial);
+		return false;
+	}
+	if (cfg.index >= count)
+		return false;
+	*node = nodes[cfg.index];
+	return true;
+}
+
+static bool device_listed(const FT_DEVICE_LIST_INFO_NODE *dev)
+{
+	DWORD count;
+	FT_DEVICE_LIST_INFO_NODE nodes[SESSION_MAX_DEVICES];
+
+	if (FT_OK != FT_CreateDeviceInfoList(&count) || !count ||
+			count > SESSION_MAX_DEVICES)
+		return false;
+	if (FT_OK != FT_GetDeviceInfoList(nodes, &count))
+		return false;
+	if (!dev->SerialNumber[0])
+		return true;
+	for (DWORD i = 0; i < count; i++)
+		if (!strncmp(nodes[i].SerialNumber, dev->SerialNumber,
+					sizeof(dev->SerialNumber)))
+			return true;
+	return false;
+}
+
+/* The chip resets after FT_SetChipConfiguration. Wait for it to drop off
+ * the list and come back instead of sleeping for the worst case. */
+static bool wait_for_reenumeration(const FT_DEVICE_LIST_INFO_NODE *dev)
+{
+	auto begin = chrono::steady_clock::now();
+	auto gone_by = begin + chrono::milliseconds(REENUM_GONE_MS);
+	auto timeout = begin + chrono::milliseconds(REENUM_TIMEOUT_MS);
+
+	while (device_listed(dev) && chrono::steady_clock::now() < gone_by)
+		this_thread::sleep_for(chrono::milliseconds(POLL_MS));
+	do {
+		if (device_listed(dev)) {
+			printf("Device back after %lld ms\r\n", (long long)
+					chrono::duration_cast<chrono::milliseconds>(
+						chrono::steady_clock::now() - begin).count());
+			return true;
+		}
+		this_thread::sleep_for(chrono::milliseconds(POLL_MS));
+	} while (chrono::steady_clock::now() < timeout);
+	printf("Device did not come back after configuration\r\n");
+	return false;
+}
+
+static string cache_path(const char *serial)
+{
+	const char *base = getenv("XDG_CACHE_HOME");
+	string dir;
+
+	if (base && *base)
+		dir = base;
+	else if ((base = getenv("HOME")) && *base)
+		dir = string(base) + "/.cache";
+	else
+		return string();
+	mkdir(dir.c_str(), 0755);
+	dir += "/d3xx";
+	mkdir(dir.c_str(), 0755);
+	return dir + "/" + serial;
+}
+
+static bool load_cached_config(const char *serial, FT_60XCONFIGURATION *cfg)
+{
+	string path = cache_path(serial);
+	FILE *fp;
+	bool ok;
+
+	if (path.empty() || !(fp = fopen(path.c_str(), "rb")))
+		return false;
+	ok = fread(cfg, sizeof(*cfg), 1, fp) == 1 && fgetc(fp) == EOF;
+	fclose(fp);
+	return ok;
+}
+
+static void save_cached_config(const char *serial,
+		const FT_60XCONFIGURATION *cfg)
+{
+	string path = cache_path(serial);
+	FILE *fp;
+
+	if (path.empty() || !(fp = fopen(path.c_str(), "wb")))
+		return;
+	if (fwrite(cfg, sizeof(*cfg), 1, fp) != 1 || fclose(fp))
+		remove(path.c_str());
+}
+
+/* Apply the session settings to cfg. Returns 1 when the chip needs the
+ * new configuration, 0 when it already has it, -1 when not possible.
+ * verbose: report what is found and changed. */
+static int update_chip_config(FT_60XCONFIGURATION *cfg,
+		const session_config &sc, bool verbose)
+{
+	bool needs_update = false;
+	bool current_is_600mode;
+
+	if (cfg->OptionalFeatureSupport &
+			CONFIGURATION_OPTIONAL_FEATURE_ENABLENOTIFICATIONMESSAGE_INCHALL) {
+		/* Notification in D3XX for Linux is implemented at OS level
+		 * Turn off notification feature in firmware */
+		cfg->OptionalFeatureSupport &=
+			~CONFIGURATION_OPTIONAL_FEATURE_ENABLENOTIFICATIONMESSAGE_INCHALL;
+		needs_update = true;
+		if (verbose)
+			printf("Turn off firmware notification feature\r\n");
+	}
+
+	if (!(cfg->OptionalFeatureSupport &
+			CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN)) {
+		/* Turn off feature not supported by D3XX for Linux */
+		cfg->OptionalFeatureSupport |=
+			CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN;
+		needs_update = true;
+		if (verbose)
+			printf("disable cancel session on FIFO underrun 0x%X\r\n",
+					cfg->OptionalFeatureSupport);
+	}
+
+	if (sc.clock >= 0 && cfg->FIFOClock != sc.clock) {
+		cfg->FIFOClock = sc.clock;
+		needs_update = true;
+	}
+
+	if (cfg->FIFOMode == CONFIGURATION_FIFO_MODE_245) {
+		current_is_600mode = false;
+	} else if (cfg->FIFOMode == CONFIGURATION_FIFO_MODE_600) {
+		current_is_600mode = true;
+	} else {
+		if (verbose)
+			printf("FIFO is running at unknown mode\r\n");
+		return -1;
+	}
+	if (verbose)
+		printf("FIFO is running at %s mode\r\n",
+				current_is_600mode ? "FT600" : "FT245");
+
+	if (!sc.fifo_600mode &&
+			sc.channel_config != CONFIGURATION_CHANNEL_CONFIG_1 &&
+			sc.channel_config != CONFIGURATION_CHANNEL_CONFIG_1_OUTPIPE &&
+			sc.channel_config != CONFIGURATION_CHANNEL_CONFIG_1_INPIPE) {
+		if (verbose)
+			printf("245 mode only support single channel\r\n");
+		return -1;
+	}
+
+	if (cfg->ChannelConfig == sc.channel_config &&
+			current_is_600mode == sc.fifo_600mode && !needs_update)
+		return 0;
+	cfg->ChannelConfig = sc.channel_config;
+	cfg->FIFOMode = sc.fifo_600mode ? CONFIGURATION_FIFO_MODE_600 :
+		CONFIGURATION_FIFO_MODE_245;
+	return 1;
+}
+
+static FT_STATUS create(const FT_DEVICE_LIST_INFO_NODE *dev, DWORD index,
+		FT_HANDLE *handle)
+{
+	if (dev->SerialNumber[0])
+		return FT_Create((PVOID)dev->SerialNumber,
+				FT_OPEN_BY_SERIAL_NUMBER, handle);
+	return FT_Create((PVOID)(uintptr_t)index, FT_OPEN_BY_INDEX, handle);
+}
+
+/* Read, update and write back the chip configuration */
+static bool configure_chip(const FT_DEVICE_LIST_INFO_NODE *dev,
+		const session_config &sc)
+{
+	FT_HANDLE handle = NULL;
+	FT_60XCONFIGURATION cfg;
+	int update;
+
+	/* Must turn off all pipes before changing chip configuration */
+	turn_off_all_pipes();
+
+	create(dev, sc.index, &handle);
+	if (!handle) {
+		printf("Failed to create device\r\n");
+		return false;
+	}
+	if (FT_OK != FT_GetChipConfiguration(handle, &cfg)) {
+		printf("Failed to get chip conf\r\n");
+		FT_Close(handle);
+		return false;
+	}
+
+	update = update_chip_config(&cfg, sc, true);
+	if (update < 0) {
+		FT_Close(handle);
+		return false;
+	}
+	if (update && FT_OK != FT_SetChipConfiguration(handle, &cfg)) {
+		printf("Failed to set chip conf\r\n");
+		FT_Close(handle);
+		return true;
+	}
+	FT_Close(handle);
+
+	if (update) {
+		printf("Configuration changed\r\n");
+		if (!wait_for_reenumeration(dev))
+			return false;
+	}
+	if (dev->SerialNumber[0])
+		save_cached_config(dev->SerialNumber, &cfg);
+	return true;
+}
+
+bool device_session::open(const session_config &cfg)
+{
+	FT_DEVICE_LIST_INFO_NODE dev;
+	FT_60XCONFIGURATION cached;
+
+	close();
+	if (!find_device(cfg, &dev))
+		return false;
+	memcpy(serial_number, dev.SerialNumber, sizeof(serial_number));
+	serial_number[sizeof(serial_number) - 1] = '\0';
+
+	if (serial_number[0] && load_cached_config(serial_number, &cached) &&
+			update_chip_config(&cached, cfg, false) == 0)
+		printf("Chip configuration of %s unchanged\r\n", serial_number);
+	else if (!configure_chip(&dev, cfg))
+		return false;
+
+	set_transfer_params(cfg.transfer, cfg.shared_pipes);
+	create(&dev, cfg.index, &handle);
+	if (!handle) {
+		printf("Failed to create device\r\n");
+		return false;
+	}
+	get_vid_pid(handle);
+
+	if (cfg.stream_size) {
+		if (FT_OK != FT_SetStreamPipe(handle, true, true, 0,
+					cfg.stream_size)) {
+			printf("Failed to set stream pipes\r\n");
+			close();
+			return false;
+		}
+		streaming = true;
+		printf("Streaming %u byte transfers on all pipes\r\n",
+				cfg.stream_size);
+	}
+
+	/* Workaround for FT600/FT601 Rev.A device: Stop session before exit */
+	if (dev.Type == FT_DEVICE_600 || dev.Type == FT_DEVICE_601) {
+		ULONG version;
+
+		rev_a_chip = FT_OK == FT_GetFirmwareVersion(handle, &version) &&
+			version <= 0x105;
+	}
+	return true;
+}
+
+void device_session::close(void)
+{
+	if (!handle)
+		return;
+	if (streaming)
+		FT_ClearStreamPipe(handle, true, true, 0);
+	if (rev_a_chip)
+		FT_ResetDevicePort(handle);
+	FT_Close(handle);
+	handle = NULL;
+	rev_a_chip = false;
+	streaming = false;
+}
+
+struct device_session *device_session_open(const struct session_config *cfg)
+{
+	device_session *session = new device_session;
+
+	if (!session->open(*cfg)) {
+		delete session;
+		return NULL;
+	}
+	return session;
+}
+
+FT_HANDLE device_session_handle(const struct device_session *session)
+{
+	return session->get();
+}
+
+void device_session_close(struct device_session *session)
+{
+	delete session;
+}
@@ -0,0 +1,87 @@
+#ifndef DEVICE_SESSION_H
+#define DEVICE_SESSION_H
+
+#include "ftd3xx.h"
+
+/* Device setup shared by the demo tools: chip configuration, transfer
+ * parameters and FT_Create. The last chip configuration applied to a
+ * device is cached per serial number in $XDG_CACHE_HOME/d3xx (default
+ * ~/.cache/d3xx), so a tool started with unchanged settings neither
+ * touches the chip configuration nor waits for the device to come back.
+ * Delete the cache file after reprogramming a chip with another tool. */
+
+/* What a tool needs from the chip and the driver */
+struct session_config {
+	DWORD index;          /* position in the device list */
+	const char *serial;   /* NULL = use index */
+	UCHAR channel_config; /* CONFIGURATION_CHANNEL_CONFIG_* */
+	bool fifo_600mode;    /* false = FT245 mode */
+	int clock;            /* CONFIGURATION_FIFO_CLK_*, -1 keeps the current */
+	/* Driver parameters for all FIFOs, NULL = driver defaults. Transfers
+	 * are set up non thread safe, every pipe has one user, unless
+	 * shared_pipes is set. */
+	const FT_TRANSFER_CONF *transfer;
+	/* FT_SetStreamPipe size for every pipe, 0 = not streaming: the driver
+	 * then sets up a session with the chip for each transfer. Streaming
+	 * pipes stay in one session for dwStreamingSize bytes of transfers
+	 * of exactly this size. */
+	ULONG stream_size;
+	/* Pipes are used from more than one thread (pipe_events), keep the
+	 * driver's locking */
+	bool shared_pipes;
+};
+
+#define SESSION_MAX_DEVICES 16
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Device 0, single channel FT245 mode at 100MHz, driver defaults */
+void session_config_init(struct session_config *cfg);
+
+/* Channel configuration for the given pipe counts, single direction
+ * configurations when only one pipe is used */
+UCHAR session_channel_config(int out_cnt, int in_cnt);
+
+/* Copy up to max entries of the device list into nodes, waiting up to
+ * timeout_ms for the list to be created. Returns the number copied. */
+DWORD list_devices(FT_DEVICE_LIST_INFO_NODE *nodes, DWORD max,
+		int timeout_ms);
+
+/* Print the driver and library versions */
+void show_versions(void);
+
+/* C interface for rw.c, NULL when the device cannot be set up */
+struct device_session *device_session_open(const struct session_config *cfg);
+FT_HANDLE device_session_handle(const struct device_session *session);
+void device_session_close(struct device_session *session);
+
+#ifdef __cplusplus
+}
+
+/* An open device, closed on destruction. Streaming is cleared and Rev.A
+ * FT600/FT601 chips get their session stopped before the close. */
+class device_session {
+public:
+	device_session() : handle(NULL), rev_a_chip(false), streaming(false) {}
+	~device_session() { close(); }
+	device_session(const device_session &) = delete;
+	device_session &operator=(const device_session &) = delete;
+
+	/* Prints the reason and returns false on failure */
+	bool open(const session_config &cfg);
+	void close(void);
+
+	FT_HANDLE get(void) const { return handle; }
+	const char *serial(void) const { return serial_number; }
+
+private:
+	FT_HANDLE handle;
+	bool rev_a_chip;
+	bool streaming;
+	char serial_number[16];
+};
+#endif /* __cplusplus */
+
+#endif /* DEVICE_SESSION_H */
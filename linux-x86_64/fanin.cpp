@@ -0,0 +1,492 @@
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "ftd3xx.h"
+#include "capture_sink.h"
+#include "capture_ring.h"
+#include "channel_stats.h"
+#include "transfer_profile.h"
+#include "device_session.h"
+
+using namespace std;
+
+/* Header in front of every buffer in the capture file. A file holds the
+ * buffers of all devices (one file per device with -O) in the order of
+ * their timestamps, each header directly followed by len bytes.
+ *
+ * Timestamps are CLOCK_MONOTONIC, which NTP cannot step back, so they
+ * order the reads of all devices. The file starts with a clock record
+ * (device FANIN_CLOCK, no payload) holding the wall clock time of its
+ * timestamp_ns. */
+struct fanin_record {
+	uint32_t magic;        /* FANIN_MAGIC */
+	uint16_t device;       /* position in the device table printed at start */
+	uint8_t channel;
+	uint8_t reserved;
+	uint32_t len;          /* payload bytes */
+	uint32_t seq;          /* per device, counts every buffer read */
+	uint64_t timestamp_ns; /* read completion, CLOCK_MONOTONIC */
+	uint64_t wall_ns;      /* clock record: CLOCK_REALTIME, else 0 */
+};
+static_assert(sizeof(fanin_record) == 32, "fanin_record layout");
+
+static const uint32_t FANIN_MAGIC = 0x49464433; /* "3DFI" */
+static const uint16_t FANIN_CLOCK = 0xFFFF;
+
+struct capture_device {
+	device_session session;
+	char serial[16];
+	capture_ring ring;
+	device_stats stats;
+	atomic_bool done;
+	int core; /* -1 = not pinned */
+	thread reader;
+};
+
+static bool do_exit;
+static bool fifo_600mode;
+static uint8_t in_ch_cnt;
+static int buffer_len = 32*1024;
+static size_t ring_slots = 256;
+static const char *sink_type = "uring";
+static const char *out_path = "fanin.cap";
+static bool per_device; /* -O: one file per device */
+static const char *serial_prefix = "";
+static int first_core; /* -c, -1 = no pinning */
+static int run_seconds; /* 0 = run until SIGINT */
+static transfer_profile profile;
+
+static capture_device devs[SESSION_MAX_DEVICES];
+static int dev_cnt;
+static unique_ptr<unique_ptr<capture_sink>[]> sinks;
+static atomic_int ring_stall;
+
+static size_t slot_size(void)
+{
+	return (sizeof(fanin_record) + buffer_len + 63) & ~(size_t)63;
+}
+
+static uint64_t monotonic_ns(void)
+{
+	return chrono::duration_cast<chrono::nanoseconds>(
+			chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t wall_clock_ns(void)
+{
+	return chrono::duration_cast<chrono::nanoseconds>(
+			chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static void show_throughput(void)
+{
+	auto start = chrono::steady_clock::now();
+	auto next = start + chrono::seconds(1);
+
+	while (!do_exit) {
+		this_thread::sleep_until(next);
+		next += chrono::seconds(1);
+
+		uint64_t sum = 0, timeouts = 0, errors = 0;
+		string line;
+		char part[64];
+
+		for (int i = 0; i < dev_cnt; i++) {
+			uint64_t bytes = 0;
+
+			for (uint8_t ch = 0; ch < in_ch_cnt; ch++) {
+				stats_sample s = devs[i].stats.interval(STATS_RX, ch);
+
+				bytes += s.bytes;
+				timeouts += s.timeouts;
+				errors += s.errors;
+			}
+			sum += bytes;
+			snprintf(part, sizeof(part), " | %s RX:%.2f%s",
+					devs[i].serial, (double)bytes/1000/1000,
+					devs[i].done ? " stopped" : "");
+			line += part;
+		}
+		printf("RX:%.2fMiB/s from %d device(s)%s", (double)sum/1000/1000,
+				dev_cnt, line.c_str());
+		if (timeouts || errors)
+			printf(" timeouts:%llu errors:%llu",
+				(unsigned long long)timeouts,
+				(unsigned long long)errors);
+		printf(" stall:%d\r\n", ring_stall.exchange(0));
+
+		if (run_seconds && next - start >=
+				chrono::seconds(run_seconds + 1))
+			do_exit = true;
+	}
+}
+
+/* Read all IN channels of one device round robin into its ring, each
+ * buffer behind a record header */
+static void read_device(int idx)
+{
+	capture_device &dev = devs[idx];
+	FT_HANDLE handle = dev.session.get();
+	uint32_t seq = 0;
+
+	if (dev.core >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(dev.core, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			printf("Failed to pin %s reader to core %d\r\n",
+					dev.serial, dev.core);
+	}
+	/* Allocated by the pinned reader so the ring is on its node */
+	if (!dev.ring.allocate()) {
+		printf("Failed to allocate %s capture ring\r\n", dev.serial);
+		do_exit = true;
+		goto stop;
+	}
+
+	while (!do_exit) {
+		for (uint8_t channel = 0; channel < in_ch_cnt; channel++) {
+			ULONG count = 0;
+			uint8_t *buf = dev.ring.acquire();
+
+			if (!buf) {
+				ring_stall++;
+				while (!do_exit && !(buf = dev.ring.acquire()))
+					this_thread::sleep_for(
+							chrono::microseconds(100));
+				if (!buf)
+					break;
+			}
+
+			FT_STATUS status = FT_ReadPipeEx(handle, channel,
+					buf + sizeof(fanin_record), buffer_len,
+					&count, 1000);
+			if (status == FT_TIMEOUT) {
+				dev.stats.channel(STATS_RX, channel).timeout();
+				if (!count)
+					continue;
+			} else if (FT_OK != status) {
+				dev.stats.channel(STATS_RX, channel).error();
+				printf("%s CH%d read failed: %d\r\n", dev.serial,
+						channel, status);
+				goto stop;
+			}
+
+			fanin_record *rec = (fanin_record *)buf;
+
+			memset(rec, 0, sizeof(*rec));
+			rec->magic = FANIN_MAGIC;
+			rec->device = idx;
+			rec->channel = channel;
+			rec->len = count;
+			rec->seq = seq++;
+			rec->timestamp_ns = monotonic_ns();
+			dev.ring.publish(sizeof(*rec) + count, channel);
+			dev.stats.channel(STATS_RX, channel).add(count);
+		}
+	}
+stop:
+	dev.done = true;
+}
+
+/* Single writer for all rings, taking the oldest buffer available at any
+ * time so the merged file is in timestamp order across devices as far as
+ * the rings hold data */
+static void write_records(void)
+{
+	for (;;) {
+		int oldest = -1;
+		uint64_t oldest_ns = 0;
+		bool all_done = true;
+
+		for (int i = 0; i < dev_cnt; i++) {
+			ULONG len;
+			uint8_t channel;
+			bool done = devs[i].done;
+			const uint8_t *p = devs[i].ring.peek(0, &len, &channel);
+
+			if (!p) {
+				all_done = all_done && done;
+				continue;
+			}
+			all_done = false;
+
+			uint64_t ns = ((const fanin_record *)p)->timestamp_ns;
+
+			if (oldest < 0 || ns < oldest_ns) {
+				oldest = i;
+				oldest_ns = ns;
+			}
+		}
+		if (oldest < 0) {
+			if (all_done)
+				break;
+			this_thread::sleep_for(chrono::microseconds(100));
+			continue;
+		}
+
+		ULONG len = 0;
+		uint8_t channel;
+		const uint8_t *p = devs[oldest].ring.peek(0, &len, &channel);
+
+		if (!sinks[per_device ? oldest : 0]->write(p, len))
+			do_exit = true;
+		devs[oldest].ring.release(0);
+	}
+}
+
+/* The core for reader idx: the idx-th core of the process affinity mask
+ * counted from first_core, wrapping around */
+static int reader_core(int idx)
+{
+	cpu_set_t set;
+	int cores[CPU_SETSIZE];
+	int cnt = 0;
+
+	if (first_core < 0 || sched_getaffinity(0, sizeof(set), &set))
+		return -1;
+	for (int i = 0; i < CPU_SETSIZE; i++)
+		if (CPU_ISSET(i, &set))
+			cores[cnt++] = i;
+	return cnt ? cores[(first_core + idx) % cnt] : -1;
+}
+
+static bool open_devices(void)
+{
+	FT_DEVICE_LIST_INFO_NODE nodes[SESSION_MAX_DEVICES];
+	DWORD count = list_devices(nodes, SESSION_MAX_DEVICES, 500);
+	size_t prefix_len = strlen(serial_prefix);
+	FT_TRANSFER_CONF conf;
+	session_config cfg;
+
+	memset(&conf, 0, sizeof(conf));
+	apply_transfer_profile(&profile, &conf);
+	session_config_init(&cfg);
+	cfg.channel_config = session_channel_config(0, in_ch_cnt);
+	cfg.fifo_600mode = fifo_600mode;
+	cfg.transfer = &conf;
+
+	for (DWORD i = 0; i < count; i++) {
+		capture_device &dev = devs[dev_cnt];
+
+		memcpy(dev.serial, nodes[i].SerialNumber, sizeof(dev.serial));
+		dev.serial[sizeof(dev.serial) - 1] = '\0';
+		if (!dev.serial[0] || strncmp(dev.serial, serial_prefix, prefix_len))
+			continue;
+		cfg.serial = dev.serial;
+		if (!dev.session.open(cfg))
+			return false;
+		dev.ring.init(ring_slots, slot_size(), 1);
+		dev.done = false;
+		dev.core = reader_core(dev_cnt);
+		dev_cnt++;
+	}
+	if (!dev_cnt) {
+		printf("No device with serial number %s*\r\n", serial_prefix);
+		return false;
+	}
+	for (int i = 0; i < dev_cnt; i++)
+		printf("Device %d: %s, reader on core %d\r\n", i, devs[i].serial,
+				devs[i].core);
+	return true;
+}
+
+static bool open_sinks(void)
+{
+	int cnt = per_device ? dev_cnt : 1;
+
+	sinks.reset(new unique_ptr<capture_sink>[cnt]);
+	for (int i = 0; i < cnt; i++) {
+		string path = out_path;
+
+		if (per_device)
+			path += string(".") + devs[i].serial;
+		sinks[i] = create_capture_sink(sink_type);
+		if (!sinks[i]->open(path.c_str()))
+			return false;
+
+		fanin_record clock;
+
+		memset(&clock, 0, sizeof(clock));
+		clock.magic = FANIN_MAGIC;
+		clock.device = FANIN_CLOCK;
+		clock.timestamp_ns = monotonic_ns();
+		clock.wall_ns = wall_clock_ns();
+		if (!sinks[i]->write((const uint8_t *)&clock, sizeof(clock)))
+			return false;
+	}
+	return true;
+}
+
+static void show_summary(double seconds)
+{
+	uint64_t sum = 0;
+
+	for (int i = 0; i < dev_cnt; i++) {
+		uint64_t bytes = 0, transfers = 0;
+
+		for (uint8_t ch = 0; ch < in_ch_cnt; ch++) {
+			stats_sample s = devs[i].stats.total(STATS_RX, ch);
+
+			bytes += s.bytes;
+			transfers += s.transfers;
+		}
+		sum += bytes;
+		printf("%s: %.2fMiB/s, %llu buffers, ring high water %zu/%zu\r\n",
+				devs[i].serial, bytes / seconds / 1000 / 1000,
+				(unsigned long long)transfers, devs[i].ring.peak(),
+				devs[i].ring.capacity());
+	}
+	printf("Total: %.2fMiB/s from %d device(s) over %.1fs\r\n",
+			sum / seconds / 1000 / 1000, dev_cnt, seconds);
+}
+
+static void sig_hdlr(int signum)
+{
+	switch (signum) {
+	case SIGINT:
+		do_exit = true;
+		break;
+	}
+}
+
+static void register_signals(void)
+{
+	signal(SIGINT, sig_hdlr);
+}
+
+static void show_help(const char *bin)
+{
+	printf("Capture from every attached FT60x into one file\r\n");
+	printf("Usage: %s [options] <in channel count> [mode]\r\n", bin);
+	printf("  channel count: 1 for 245 mode, [1-4] for 600 mode\r\n");
+	printf("  mode: 0 = FT245 mode (default), 1 = FT600 mode\r\n");
+	printf("Options:\r\n");
+	printf("  -m prefix: only devices whose serial number starts with prefix\r\n");
+	printf("  -o file: capture file (default %s), every buffer is preceded\r\n",
+			out_path);
+	printf("           by a %zu byte header with device, channel, length,\r\n",
+			sizeof(fanin_record));
+	printf("           sequence number and monotonic timestamp, the\r\n");
+	printf("           first record (device %u) maps them to wall clock\r\n",
+			FANIN_CLOCK);
+	printf("  -O: one file per device, <file>.<serial number>\r\n");
+	printf("  -s sink: file backend, ofstream, pwrite or uring (default)\r\n");
+	printf("  -c core: pin the reader of device N to the Nth allowed core\r\n");
+	printf("           after core (default 0), -1 = don't pin\r\n");
+	printf("  -r slots: ring size per device in buffers (default %zu)\r\n",
+			ring_slots);
+	printf("  -d seconds: stop after the given time\r\n");
+	printf("  -p profile: load transfer parameters and buffer size written\r\n");
+	printf("              by streamer -T\r\n");
+}
+
+static bool validate_arguments(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:o:Os:c:r:d:p:")) != -1) {
+		switch (opt) {
+		case 'm':
+			serial_prefix = optarg;
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'O':
+			per_device = true;
+			break;
+		case 's':
+			sink_type = optarg;
+			if (!create_capture_sink(sink_type))
+				return false;
+			break;
+		case 'c':
+			first_core = atoi(optarg);
+			break;
+		case 'r':
+			ring_slots = atoi(optarg);
+			if (ring_slots < 2)
+				return false;
+			break;
+		case 'd':
+			run_seconds = atoi(optarg);
+			if (run_seconds < 0)
+				return false;
+			break;
+		case 'p':
+			if (!load_transfer_profile(optarg, &profile))
+				return false;
+			if (profile.buffer_len)
+				buffer_len = profile.buffer_len;
+			break;
+		default:
+			return false;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc != 2 && argc != 3)
+		return false;
+
+	if (argc == 3) {
+		int val = atoi(argv[2]);
+		if (val != 0 && val != 1)
+			return false;
+		fifo_600mode = (bool)val;
+	}
+
+	in_ch_cnt = atoi(argv[1]);
+	if (in_ch_cnt < 1 || in_ch_cnt > (fifo_600mode ? 4 : 1))
+		return false;
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	show_versions();
+
+	if (!validate_arguments(argc, argv)) {
+		show_help(argv[0]);
+		return 1;
+	}
+
+	if (!open_devices() || !open_sinks())
+		return 1;
+
+	auto start = chrono::steady_clock::now();
+
+	for (int i = 0; i < dev_cnt; i++)
+		devs[i].reader = thread(read_device, i);
+	thread writer(write_records);
+	thread measure_thread(show_throughput);
+
+	register_signals();
+
+	for (int i = 0; i < dev_cnt; i++)
+		devs[i].reader.join();
+	do_exit = true;
+	writer.join();
+	measure_thread.join();
+
+	bool ok = true;
+
+	for (int i = 0; i < (per_device ? dev_cnt : 1); i++)
+		ok = sinks[i]->close() && ok;
+	if (!ok)
+		printf("Failed to complete the capture file\r\n");
+	show_summary(chrono::duration<double>(
+				chrono::steady_clock::now() - start).count());
+	for (int i = 0; i < dev_cnt; i++)
+		devs[i].session.close();
+	return ok ? 0 : 1;
+}
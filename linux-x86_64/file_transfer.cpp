@@ -7,7 +7,15 @@
 #include <cstring>
 #include <cstdlib>
 #include <random>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 #include "ftd3xx.h"
+#include "mapped_file.h"
+#include "content_compare.h"
+#include "channel_stats.h"
+#include "device_session.h"
+#include "buffer_pool.h"
 
 using namespace std;
 
@@ -15,8 +23,7 @@ static bool do_exit;
 static bool loop_mode;
 static const uint32_t WR_CTRL_INTERVAL = 1000; /* 1 second */
 static const uint32_t RD_CTRL_INTERVAL = 1000; /* 1 second */
-static atomic_int tx_count;
-static atomic_int rx_count;
+static device_stats stats;
 static uint8_t ch_cnt;
 static const int BUFFER_LEN = 128*1024;
 static random_device rd;
@@ -24,6 +31,60 @@ static mt19937 rng(rd());
 static uniform_int_distribution<size_t> random_len(1, BUFFER_LEN / 4);
 static size_t file_length;
 static bool transfer_failed;
+static bool buffered_source; /* copy through ifstream instead of mmap */
+static bool verify_only; /* compare two files, no device */
+static bool inline_verify; /* check received data against the source */
+static bool skip_dest; /* inline verification only, no destination file */
+static mapped_file source; /* shared by all channels */
+static buffer_pool_ptr pool; /* a read and a write buffer per channel */
+static const size_t PREFETCH_LEN = 8*1024*1024;
+
+/* CPU time spent by the calling thread, in cycles if the PMU is
+ * accessible, otherwise in nanoseconds */
+class cpu_usage {
+public:
+	cpu_usage()
+	{
+		struct perf_event_attr attr;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CPU_CYCLES;
+		attr.exclude_hv = 1;
+		fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (fd < 0) {
+			attr.exclude_kernel = 1;
+			fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		}
+		start = now();
+	}
+
+	~cpu_usage()
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+
+	uint64_t elapsed(void) { return now() - start; }
+	const char *unit(void) const { return fd >= 0 ? "cycles" : "ns"; }
+
+private:
+	uint64_t now(void)
+	{
+		uint64_t val;
+
+		if (fd >= 0 && read(fd, &val, sizeof(val)) == sizeof(val))
+			return val;
+
+		struct timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	int fd;
+	uint64_t start;
+};
 
 static void show_throughput(FT_HANDLE handle)
 {
@@ -34,69 +95,92 @@ static void show_throughput(FT_HANDLE handle)
 		this_thread::sleep_until(next);
 		next += chrono::seconds(1);
 
-		int tx = tx_count.exchange(0);
-		int rx = rx_count.exchange(0);
-
-		printf("TX:%.2fMiB/s RX:%.2fMiB/s, total:%.2fMiB\r\n",
-			(float)tx/1000/1000, (float)rx/1000/1000,
-			(float)(tx+ rx)/1000/1000);
+		stats.show_rates(ch_cnt, ch_cnt);
+		printf("\r\n");
 	}
 }
 
 static void stream_out(FT_HANDLE handle, uint8_t channel,
 		string from)
 {
-	unique_ptr<uint8_t[]> buf(new uint8_t[BUFFER_LEN]);
+	pool_slot buf(pool.get());
 	ifstream src;
-	try {
-		src.open(from, ios::binary);
-	} catch (istream::failure e) {
-		cout << "Failed to open file " << e.what() << endl;
-		return;
+	cpu_usage cpu;
+
+	if (buffered_source) {
+		try {
+			src.open(from, ios::binary);
+		} catch (istream::failure e) {
+			cout << "Failed to open file " << e.what() << endl;
+			return;
+		}
 	}
 	size_t total = 0;
+	size_t prefetched = 0;
 
 	while (!do_exit && total < file_length) {
 		size_t len = random_len(rng) * 4;
 		ULONG count = 0;
-
-		src.read((char*)buf.get(), len);
-		if (!src)
-			len = (int)src.gcount();
+		PUCHAR p;
+
+		if (buffered_source) {
+			src.read((char*)buf.get(), len);
+			if (!src)
+				len = (int)src.gcount();
+			p = buf.get();
+		} else {
+			/* Send straight from the shared mapping */
+			if (len > file_length - total)
+				len = file_length - total;
+			if (total + len > prefetched) {
+				source.prefetch(total, PREFETCH_LEN);
+				prefetched = total + PREFETCH_LEN;
+			}
+			p = (PUCHAR)source.data() + total;
+		}
 		if (len) {
 _retry:
-			FT_STATUS status = FT_WritePipeEx(handle, channel, buf.get(),
+			FT_STATUS status = FT_WritePipeEx(handle, channel, p,
 						len, &count, WR_CTRL_INTERVAL + 100);
 			if (FT_OK != status) {
 				if (do_exit)
 					break;
 				printf("Channel %d failed to write %zu, ret %d\r\n", channel, total, status);
-				if (FT_TIMEOUT == status)
+				if (FT_TIMEOUT == status) {
+					stats.channel(STATS_TX, channel).timeout();
 					goto _retry;
+				}
+				stats.channel(STATS_TX, channel).error();
 				do_exit = true;
 			}
 		} else
 			count = 0;
-		tx_count += count;
+		stats.channel(STATS_TX, channel).add(count);
 		total += count;
 	}
-	src.close();
-	printf("Channel %d write stopped, %zu\r\n", channel, total);
+	if (buffered_source)
+		src.close();
+	printf("Channel %d write stopped, %zu, %.2f CPU %s/byte (%s source)\r\n",
+			channel, total, total ? (double)cpu.elapsed() / total : 0.0,
+			cpu.unit(), buffered_source ? "ifstream" : "mmap");
 }
 
 static void stream_in(FT_HANDLE handle, uint8_t channel,
-		string to)
+		string to, bool *verified)
 {
-	unique_ptr<uint8_t[]> buf(new uint8_t[BUFFER_LEN]);
+	pool_slot buf(pool.get());
 	ofstream dest;
 	size_t total = 0;
 
-	try {
-		dest.open(to, ofstream::binary | ofstream::in | ofstream::out |
-				ofstream::trunc);
-	} catch (istream::failure e) {
-		cout << "Failed to open file " << e.what() << endl;
-		return;
+	*verified = false;
+	if (!skip_dest) {
+		try {
+			dest.open(to, ofstream::binary | ofstream::in | ofstream::out |
+					ofstream::trunc);
+		} catch (istream::failure e) {
+			cout << "Failed to open file " << e.what() << endl;
+			return;
+		}
 	}
 
 	while (!do_exit && total < file_length) {
@@ -112,14 +196,33 @@ static void stream_in(FT_HANDLE handle, uint8_t channel,
 		if (!count) {
 			printf("Failed to read from channel %d, status:%d\r\n",
 					channel, status);
+			if (FT_TIMEOUT == status)
+				stats.channel(STATS_RX, channel).timeout();
+			else
+				stats.channel(STATS_RX, channel).error();
 			continue;
 		}
-		dest.write((const char *)buf.get(), count);
-		rx_count += count;
+		if (inline_verify) {
+			size_t offset = find_mismatch(source.data() + total,
+					buf.get(), count, 1);
+
+			if (offset != count) {
+				cout << to << " content not same at " << total + offset
+					<< endl;
+				transfer_failed = true;
+				do_exit = true;
+				break;
+			}
+		}
+		if (!skip_dest)
+			dest.write((const char *)buf.get(), count);
+		stats.channel(STATS_RX, channel).add(count);
 		total += count;
 	}
-	dest.close();
+	if (!skip_dest)
+		dest.close();
 	printf("Channel %d read stopped, %zu\r\n", channel, total);
+	*verified = inline_verify && total == file_length;
 }
 
 static void sig_hdlr(int signum)
@@ -136,207 +239,63 @@ static void register_signals(void)
 	signal(SIGINT, sig_hdlr);
 }
 
-static void get_version(void)
-{
-	DWORD dwVersion;
-
-	FT_GetDriverVersion(NULL, &dwVersion);
-	printf("Driver version:%d.%d.%d.%d\r\n", dwVersion >> 24,
-			(uint8_t)(dwVersion >> 16), (uint8_t)(dwVersion >> 8),
-			dwVersion & 0xFF);
-
-	FT_GetLibraryVersion(&dwVersion);
-	printf("Library version:%d.%d.%d\r\n", dwVersion >> 24,
-			(uint8_t)(dwVersion >> 16), dwVersion & 0xFFFF);
-}
-
-static void get_vid_pid(FT_HANDLE handle)
-{
-	WORD vid, pid;
-
-	if (FT_OK != FT_GetVIDPID(handle, &vid, &pid))
-		return;
-	printf("VID:%04X PID:%04X\r\n", vid, pid);
-}
-
-#if defined(_WIN32) || defined(_WIN64)
-#define turn_off_all_pipes()
-#define turn_off_thread_safe()
-#else /* _WIN32 || _WIN64 */
-static void turn_off_all_pipes(void)
+static UCHAR channel_config(void)
 {
-	FT_TRANSFER_CONF conf;
-
-	memset(&conf, 0, sizeof(FT_TRANSFER_CONF));
-	conf.wStructSize = sizeof(FT_TRANSFER_CONF);
-	conf.pipe[FT_PIPE_DIR_IN].fPipeNotUsed = true;
-	conf.pipe[FT_PIPE_DIR_OUT].fPipeNotUsed = true;
-	for (DWORD i = 0; i < 4; i++)
-		FT_SetTransferParams(&conf, i);
-}
-
-static void turn_off_thread_safe(void)
-{
-	FT_TRANSFER_CONF conf;
-
-	memset(&conf, 0, sizeof(FT_TRANSFER_CONF));
-	conf.wStructSize = sizeof(FT_TRANSFER_CONF);
-	conf.pipe[FT_PIPE_DIR_IN].fNonThreadSafeTransfer = true;
-	conf.pipe[FT_PIPE_DIR_OUT].fNonThreadSafeTransfer = true;
-	for (DWORD i = 0; i < 4; i++)
-		FT_SetTransferParams(&conf, i);
-}
-
-#endif /* !_WIN32 && !_WIN64 */
-
-static bool get_device_lists(int timeout_ms)
-{
-	DWORD count;
-	FT_DEVICE_LIST_INFO_NODE nodes[16];
-
-	chrono::steady_clock::time_point const timeout =
-		chrono::steady_clock::now() +
-		chrono::milliseconds(timeout_ms);
-
-	do {
-		if (FT_OK == FT_CreateDeviceInfoList(&count))
-			break;
-		this_thread::sleep_for(chrono::microseconds(10));
-	} while (chrono::steady_clock::now() < timeout);
-	printf("Total %u device(s)\r\n", count);
-	if (!count)
-		return false;
-
-	if (FT_OK != FT_GetDeviceInfoList(nodes, &count))
-		return false;
-	return true;
-}
-
-
-static bool set_ft600_channel_config(FT_60XCONFIGURATION *cfg,
-		CONFIGURATION_FIFO_CLK clock, bool is_600_mode)
-{
-	bool needs_update = false;
-	bool current_is_600mode;
-
-	if (cfg->OptionalFeatureSupport &
-			CONFIGURATION_OPTIONAL_FEATURE_ENABLENOTIFICATIONMESSAGE_INCHALL) {
-		/* Notification in D3XX for Linux is implemented at OS level
-		 * Turn off notification feature in firmware */
-		cfg->OptionalFeatureSupport &=
-			~CONFIGURATION_OPTIONAL_FEATURE_ENABLENOTIFICATIONMESSAGE_INCHALL;
-		needs_update = true;
-		printf("Turn off firmware notification feature\r\n");
-	}
-
-	if (!(cfg->OptionalFeatureSupport &
-			CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN)) {
-		/* Turn off feature not supported by D3XX for Linux */
-		cfg->OptionalFeatureSupport |=
-			CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN;
-		needs_update = true;
-		printf("disable cancel session on FIFO underrun 0x%X\r\n",
-				cfg->OptionalFeatureSupport);
-	}
-
-	if (cfg->FIFOClock != clock)
-		needs_update = true;
-
-	if (cfg->FIFOMode == CONFIGURATION_FIFO_MODE_245) {
-		printf("FIFO is running at FT245 mode\r\n");
-		current_is_600mode = false;
-	} else if (cfg->FIFOMode == CONFIGURATION_FIFO_MODE_600) {
-		printf("FIFO is running at FT600 mode\r\n");
-		current_is_600mode = true;
-	} else {
-		printf("FIFO is running at unknown mode\r\n");
-		exit(-1);
-	}
-
-	UCHAR ch;
-
 	if (ch_cnt < 2)
-		ch = CONFIGURATION_CHANNEL_CONFIG_1;
-	else if (ch_cnt == 2)
-		ch = CONFIGURATION_CHANNEL_CONFIG_2;
-	else if (ch_cnt == 4)
-		ch = CONFIGURATION_CHANNEL_CONFIG_4;
-	else
-		exit(-1);
-
-	if (cfg->ChannelConfig == ch && current_is_600mode == is_600_mode &&
-			!needs_update)
-		return false;
-	cfg->ChannelConfig = ch;
-	cfg->FIFOClock = clock;
-	cfg->FIFOMode = is_600_mode ? CONFIGURATION_FIFO_MODE_600 :
-		CONFIGURATION_FIFO_MODE_245;
-	return true;
-}
-
-static bool set_channel_config(CONFIGURATION_FIFO_CLK clock)
-{
-	FT_HANDLE handle;
-	bool is_600_mode = ch_cnt != 0;
-	DWORD dwType;
-
-	/* Must turn off all pipes before changing chip configuration */
-	turn_off_all_pipes();
-
-	// TODO: FT603
-	FT_GetDeviceInfoDetail(0, NULL, &dwType, NULL, NULL, NULL, NULL, &handle);
-	if (!handle)
-		return false;
-
-	get_vid_pid(handle);
-
-	union {
-		FT_60XCONFIGURATION ft600;
-	} cfg;
-	if (FT_OK != FT_GetChipConfiguration(handle, &cfg)) {
-		printf("Failed to get chip conf\r\n");
-		return false;
-	}
-
-	bool needs_update;
-		needs_update = set_ft600_channel_config(&cfg.ft600, clock, is_600_mode);
-	if (needs_update) {
-		if (FT_OK != FT_SetChipConfiguration(handle, &cfg))
-			printf("Failed to set chip conf\r\n");
-		else {
-			printf("Configuration changed\r\n");
-			this_thread::sleep_for(chrono::seconds(1));
-			get_device_lists(6000);
-		}
-	}
-
-	if (dwType == FT_DEVICE_600 || dwType == FT_DEVICE_601) {
-		bool rev_a_chip;
-		DWORD dwVersion;
-
-		FT_GetFirmwareVersion(handle, &dwVersion);
-		rev_a_chip = dwVersion <= 0x105;
-
-		FT_Close(handle);
-		return rev_a_chip;
-	}
-
-	FT_Close(handle);
-	return false;
+		return CONFIGURATION_CHANNEL_CONFIG_1;
+	if (ch_cnt == 2)
+		return CONFIGURATION_CHANNEL_CONFIG_2;
+	return CONFIGURATION_CHANNEL_CONFIG_4;
 }
 
 static void show_help(const char *bin)
 {
 	printf("File transfer through FT245 loopback FPGA\r\n");
-	printf("Usage: %s <src> <dest> <mode> [loop]\r\n", bin);
+	printf("Usage: %s [options] <src> <dest> <mode> [loop]\r\n", bin);
 	printf("  src: source file name to read\r\n");
 	printf("  dest: target file name to write\r\n");
 	printf("  mode: 0 = FT245 mode(default), 1-4 FT600 channel count\r\n");
 	printf("  loop: 0 = oneshot(default), 1 =  loop forever\r\n");
+	printf("Options:\r\n");
+	printf("  -B: copy the source through an ifstream buffer instead of\r\n");
+	printf("      sending it from a shared memory mapping\r\n");
+	printf("  -V: only compare <src> with <dest> and report the speed,\r\n");
+	printf("      no device needed, mode may be omitted\r\n");
+	printf("  -i: verify received data against <src> as it arrives and stop\r\n");
+	printf("      at the first mismatch, instead of comparing the files after\r\n");
+	printf("      every transfer\r\n");
+	printf("  -n: with -i, don't write <dest> at all\r\n");
 }
 
 static bool validate_arguments(int argc, char *argv[])
 {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "BVin")) != -1) {
+		switch (opt) {
+		case 'B':
+			buffered_source = true;
+			break;
+		case 'V':
+			verify_only = true;
+			break;
+		case 'i':
+			inline_verify = true;
+			break;
+		case 'n':
+			skip_dest = true;
+			break;
+		default:
+			return false;
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (skip_dest && !inline_verify)
+		return false;
+	if (verify_only && argc == 3)
+		return true;
 	if (argc != 4 && argc != 5)
 		return false;
 
@@ -348,7 +307,7 @@ static bool validate_arguments(int argc, char *argv[])
 	}
 
 	ch_cnt = atoi(argv[3]);
-	if (ch_cnt > 4)
+	if (ch_cnt > 4 || ch_cnt == 3)
 		return false;
 	return true;
 }
@@ -367,66 +326,65 @@ static inline ifstream::pos_type get_file_length(const string &name)
 
 static bool compare_content(const string &from, const string &to)
 {
-	ifstream in1(from);
-	ifstream in2(to);
-	ifstream::pos_type size1, size2;
-
-	size1 = get_file_length(in1);
-	in1.seekg(0, ifstream::beg);
-
-	size2 = get_file_length(in2);
-	in2.seekg(0, ifstream::beg);
+	ifstream::pos_type size1 = get_file_length(from);
+	ifstream::pos_type size2 = get_file_length(to);
 
 	if(size1 != size2) {
 		cout << to << " size not same: " << size1 << " " << size2 << endl;
-		in1.close();
-		in2.close();
 		return false;
 	}
 
-	static const size_t BLOCKSIZE = 4096;
-	size_t remaining = size1;
+	size_t len = size1;
 
-	while(remaining) {
-		char buffer1[BLOCKSIZE], buffer2[BLOCKSIZE];
-		size_t size = std::min(BLOCKSIZE, remaining);
+	if (!len) {
+		cout << to << " binary same" << endl;
+		return true;
+	}
 
-		in1.read(buffer1, size);
-		in2.read(buffer2, size);
+	mapped_file in1, in2;
 
-		if(0 != memcmp(buffer1, buffer2, size)) {
-			for (size_t i = 0; i < size; i++) {
-				if (buffer1[i] != buffer2[i]) {
-					size_t offset = (int)size1 - (int)remaining + i;
-					cout << to << " content not same at " << offset << endl;
-					break;
-				}
-			}
-			in1.close();
-			in2.close();
-			return false;
-		}
+	if (!in1.map(from.c_str()) || !in2.map(to.c_str())) {
+		cout << "Failed to map " << from << " or " << to << endl;
+		return false;
+	}
+
+	auto start = chrono::steady_clock::now();
+	size_t offset = find_mismatch(in1.data(), in2.data(), len);
+	double seconds = chrono::duration<double>(
+			chrono::steady_clock::now() - start).count();
 
-		remaining -= size;
+	if (offset != len) {
+		cout << to << " content not same at " << offset << endl;
+		return false;
 	}
-	in1.close();
-	in2.close();
 	cout << to << " binary same" << endl;
+	if (verify_only)
+		printf("Compared %zu bytes in %.3fs, %.2fGB/s\r\n", len,
+				seconds, len / seconds / 1000 / 1000 / 1000);
 	return true;
 }
 
 void file_transfer(FT_HANDLE handle, uint8_t channel, string from, string to)
 {
 	do {
+		bool verified;
 		thread write_thread = thread(stream_out, handle, channel, from);
-		thread read_thread = thread(stream_in, handle, channel, to);
+		thread read_thread = thread(stream_in, handle, channel, to,
+				&verified);
 
 		if (write_thread.joinable())
 			write_thread.join();
 		if (read_thread.joinable())
 			read_thread.join();
 
-		if (!compare_content(from, to))
+		if (inline_verify) {
+			if (verified)
+				cout << to << " binary same" << endl;
+			else if (!transfer_failed && !do_exit) {
+				cout << to << " incomplete" << endl;
+				transfer_failed = true;
+			}
+		} else if (!compare_content(from, to))
 			transfer_failed = true;
 	} while (loop_mode && !do_exit);
 }
@@ -434,29 +392,27 @@ void file_transfer(FT_HANDLE handle, uint8_t channel, string from, string to)
 int main(int argc, char *argv[])
 {
 
-	get_version();
+	show_versions();
 
 	if (!validate_arguments(argc, argv)) {
 		show_help(argv[0]);
 		return 1;
 	}
 
-	if (!get_device_lists(500))
-		return 1;
-
-	bool rev_a_chip = set_channel_config(CONFIGURATION_FIFO_CLK_100);
+	if (verify_only)
+		return !compare_content(argv[optind], argv[optind + 1]);
 
-	/* Must be called before FT_Create is called */
-	turn_off_thread_safe();
+	session_config cfg;
+	device_session dev;
 
-	FT_HANDLE handle;
+	session_config_init(&cfg);
+	cfg.channel_config = channel_config();
+	cfg.fifo_600mode = ch_cnt != 0;
+	if (!dev.open(cfg))
+		return 1;
 
-	FT_Create(0, FT_OPEN_BY_INDEX, &handle);
+	FT_HANDLE handle = dev.get();
 
-	if (!handle) {
-		printf("Failed to create device\r\n");
-		return -1;
-	}
 	register_signals();
 
 	if (ch_cnt == 0)
@@ -467,11 +423,8 @@ int main(int argc, char *argv[])
 		FT_SetPipeTimeout(handle, 0x82 + i, RD_CTRL_INTERVAL + 100);
 	}
 
-	thread transfer_thread[4];
-	thread measure_thread = thread(show_throughput, handle);
-
-	string from(argv[1]);
-	string to(argv[2]);
+	string from(argv[optind]);
+	string to(argv[optind + 1]);
 
 	file_length = get_file_length(from);
 
@@ -480,6 +433,22 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	if ((!buffered_source || inline_verify) && !source.map(from.c_str())) {
+		cout << "Failed to map " << from << endl;
+		return -1;
+	}
+
+	pool.reset(buffer_pool_create(BUFFER_LEN, ch_cnt * 2));
+	if (!pool) {
+		cout << "Failed to allocate transfer buffers" << endl;
+		return -1;
+	}
+	printf("Transfer buffers: %s\r\n", buffer_pool_describe(pool.get()));
+
+	/* Only now, a return above would leave it joinable */
+	thread transfer_thread[4];
+	thread measure_thread = thread(show_throughput, handle);
+
 	for (int i = 0; i < ch_cnt; i++) {
 		string target = to;
 		if (ch_cnt > 1)
@@ -494,9 +463,5 @@ int main(int argc, char *argv[])
 	if (measure_thread.joinable())
 		measure_thread.join();
 
-	/* Workaround for FT600/FT601 Rev.A device: Stop session before exit */
-	if (rev_a_chip)
-		FT_ResetDevicePort(handle);
-	FT_Close(handle);
 	return transfer_failed;
 }
@@ -0,0 +1,1192 @@
+/*
+ * Software loopback stand-in for libftd3xx
+ *
+ * Implements the part of the ftd3xx.h API used by the demo tools entirely
+ * in user space. Data written to an OUT channel is looped back to the IN
+ * channel with the same index, so host side pipelines can be exercised and
+ * benchmarked without an FT60x board attached.
+ *
+ * Behaviour is tuned with environment variables:
+ *   FT_LOOPBACK_DEVICES     number of emulated devices (default 1)
+ *   FT_LOOPBACK_BANDWIDTH   link bandwidth per direction in MiB/s
+ *                           (default 380, 0 = unlimited)
+ *   FT_LOOPBACK_LATENCY_US  completion latency of every transfer
+ *                           (default 125)
+ *   FT_LOOPBACK_JITTER_US   uniform random jitter added to the latency
+ *                           (default 0)
+ *   FT_LOOPBACK_FIFO        loopback FIFO size per channel in bytes
+ *                           (default 1MiB)
+ *   FT_LOOPBACK_SOURCE      "loopback" (default), "counter16" or "bytes":
+ *                           IN channels generate the 16-bit counter of the
+ *                           zynq test design (0-127, then wraps) or an
+ *                           i%256 byte pattern instead of returning OUT
+ *                           data
+ *   FT_LOOPBACK_REENUM_MS   time the device is gone from the device list
+ *                           after FT_SetChipConfiguration (default 500)
+ *   FT_LOOPBACK_SESSION_US  link time taken by setting up a transfer
+ *                           session with the chip (default 0). A pipe
+ *                           without FT_SetStreamPipe needs one for every
+ *                           transfer; a streaming pipe once when armed
+ *                           and again after every dwStreamingSize bytes.
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ftd3xx.h"
+
+using namespace std;
+
+typedef chrono::steady_clock clk;
+
+enum source_type {
+	SOURCE_LOOPBACK,
+	SOURCE_COUNTER16,
+	SOURCE_BYTES,
+};
+
+static const int MAX_DEVICES = 16;
+static const int MAX_CHANNELS = 4;
+static const DWORD LOOPBACK_FIRMWARE_VERSION = 0x0112;
+static const DWORD LOOPBACK_DRIVER_VERSION = 0x00040B00; /* 0.4.11.0 */
+static const DWORD LOOPBACK_LIBRARY_VERSION = 0x0004000B; /* 0.4.11 */
+
+struct loopback_config {
+	int devices;
+	double bandwidth; /* bytes per microsecond, 0 = unlimited */
+	uint32_t latency_us;
+	uint32_t jitter_us;
+	size_t fifo_size;
+	source_type source;
+	uint32_t reenum_ms;
+	uint32_t session_us;
+};
+
+static long env_long(const char *name, long def)
+{
+	const char *val = getenv(name);
+
+	return val && *val ? strtol(val, NULL, 0) : def;
+}
+
+static const loopback_config &config(void)
+{
+	static loopback_config cfg = [] {
+		loopback_config c;
+		const char *src = getenv("FT_LOOPBACK_SOURCE");
+
+		c.devices = min<long>(max<long>(
+				env_long("FT_LOOPBACK_DEVICES", 1), 1), MAX_DEVICES);
+		c.bandwidth = env_long("FT_LOOPBACK_BANDWIDTH", 380) *
+			1024.0 * 1024.0 / 1000000.0;
+		c.latency_us = env_long("FT_LOOPBACK_LATENCY_US", 125);
+		c.jitter_us = env_long("FT_LOOPBACK_JITTER_US", 0);
+		c.fifo_size = max<long>(env_long("FT_LOOPBACK_FIFO", 1 << 20), 4096);
+		c.reenum_ms = env_long("FT_LOOPBACK_REENUM_MS", 500);
+		c.session_us = env_long("FT_LOOPBACK_SESSION_US", 0);
+		if (src && !strcmp(src, "counter16"))
+			c.source = SOURCE_COUNTER16;
+		else if (src && !strcmp(src, "bytes"))
+			c.source = SOURCE_BYTES;
+		else
+			c.source = SOURCE_LOOPBACK;
+		return c;
+	}();
+	return cfg;
+}
+
+/* Bandwidth limited link shared by all channels of one direction */
+struct link_model {
+	mutex lock;
+	clk::time_point free_at;
+
+	/* Reserve the link for len bytes after setup, return time the last
+	 * byte is on the wire */
+	clk::time_point reserve(size_t len, clk::duration setup)
+	{
+		const loopback_config &cfg = config();
+		clk::time_point now = clk::now();
+		lock_guard<mutex> lk(lock);
+
+		if (free_at < now)
+			free_at = now;
+		free_at += setup;
+		if (cfg.bandwidth > 0)
+			free_at += chrono::nanoseconds(
+					(int64_t)(len * 1000 / cfg.bandwidth));
+		return free_at;
+	}
+};
+
+static clk::duration completion_latency(void)
+{
+	static thread_local mt19937 rng(random_device{}());
+	const loopback_config &cfg = config();
+	uint32_t us = cfg.latency_us;
+
+	if (cfg.jitter_us)
+		us += uniform_int_distribution<uint32_t>(0, cfg.jitter_us)(rng);
+	return chrono::microseconds(us);
+}
+
+struct overlapped_ctx;
+
+struct pipe_state {
+	mutex lock;
+	condition_variable cv;
+	DWORD timeout_ms = 5000;
+	bool aborting;
+	ULONG stream_size;   /* FT_SetStreamPipe, 0 = not streaming */
+	uint64_t session_left; /* bytes until the stream renegotiates */
+
+	/* overlapped requests, executed in order by the pipe worker */
+	deque<overlapped_ctx *> pending;
+	thread worker;
+	bool stopping;
+};
+
+struct channel_state {
+	/* loopback FIFO between OUT and IN pipe of the channel */
+	mutex lock;
+	condition_variable cv;
+	vector<uint8_t> fifo;
+	size_t head, used;
+	uint64_t generated;
+
+	pipe_state in, out;
+};
+
+struct device_state {
+	mutex lock;
+	char serial[16];
+	char description[32];
+	DWORD loc_id;
+	FT_60XCONFIGURATION chip;
+	clk::time_point present_at;
+	bool opened;
+
+	DWORD gpio_mask, gpio_dir, gpio_level;
+
+	FT_NOTIFICATION_CALLBACK callback;
+	PVOID callback_ctx;
+	thread notifier;
+	condition_variable notify_cv;
+	deque<FT_NOTIFICATION_CALLBACK_INFO_DATA> notifications;
+	bool notifier_stop;
+
+	link_model tx, rx;
+	channel_state ch[MAX_CHANNELS];
+	FT_TRANSFER_CONF transfer[MAX_CHANNELS];
+};
+
+struct overlapped_ctx {
+	mutex lock;
+	condition_variable cv;
+	device_state *dev;
+	bool busy;
+	bool done;
+	FT_STATUS status;
+	ULONG count;
+	clk::time_point complete_at;
+
+	bool read;
+	UCHAR fifo_id;
+	PUCHAR buf;
+	ULONG len;
+};
+
+static FT_TRANSFER_CONF pending_transfer[MAX_CHANNELS];
+
+static device_state *devices(void)
+{
+	static device_state *devs = [] {
+		device_state *d = new device_state[MAX_DEVICES];
+
+		for (int i = 0; i < MAX_DEVICES; i++) {
+			FT_60XCONFIGURATION &c = d[i].chip;
+
+			snprintf(d[i].serial, sizeof(d[i].serial), "LB%06d", i + 1);
+			snprintf(d[i].description, sizeof(d[i].description),
+					"FTDI SuperSpeed-FIFO Bridge");
+			d[i].loc_id = 0x10 + i;
+			memset(&c, 0, sizeof(c));
+			c.VendorID = CONFIGURATION_DEFAULT_VENDORID;
+			c.ProductID = CONFIGURATION_DEFAULT_PRODUCTID_601;
+			c.PowerAttributes = CONFIGURATION_DEFAULT_POWERATTRIBUTES;
+			c.PowerConsumption = CONFIGURATION_DEFAULT_POWERCONSUMPTION;
+			c.FIFOClock = CONFIGURATION_DEFAULT_FIFOCLOCK;
+			c.FIFOMode = CONFIGURATION_DEFAULT_FIFOMODE;
+			c.ChannelConfig = CONFIGURATION_DEFAULT_CHANNELCONFIG;
+			c.OptionalFeatureSupport =
+				CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN;
+			c.BatteryChargingGPIOConfig =
+				CONFIGURATION_DEFAULT_BATTERYCHARGING;
+			c.MSIO_Control = CONFIGURATION_DEFAULT_MSIOCONTROL;
+			c.GPIO_Control = CONFIGURATION_DEFAULT_GPIOCONTROL;
+		}
+		return d;
+	}();
+	return devs;
+}
+
+static int present_devices(void)
+{
+	clk::time_point now = clk::now();
+	int count = 0;
+
+	for (int i = 0; i < config().devices; i++)
+		if (devices()[i].present_at <= now)
+			count++;
+	return count;
+}
+
+static device_state *present_device(DWORD index)
+{
+	clk::time_point now = clk::now();
+
+	for (int i = 0; i < config().devices; i++) {
+		if (devices()[i].present_at > now)
+			continue;
+		if (!index--)
+			return &devices()[i];
+	}
+	return NULL;
+}
+
+static int channel_count(const device_state *dev)
+{
+	switch (dev->chip.ChannelConfig) {
+	case CONFIGURATION_CHANNEL_CONFIG_4:
+		return 4;
+	case CONFIGURATION_CHANNEL_CONFIG_2:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+static device_state *to_device(FT_HANDLE handle)
+{
+	device_state *devs = devices();
+
+	for (int i = 0; i < MAX_DEVICES; i++)
+		if (handle == &devs[i])
+			return devs[i].opened ? &devs[i] : NULL;
+	return NULL;
+}
+
+static bool valid_fifo(device_state *dev, UCHAR fifo_id)
+{
+	return fifo_id < channel_count(dev);
+}
+
+static void notifier_loop(device_state *dev)
+{
+	unique_lock<mutex> lk(dev->lock);
+
+	while (!dev->notifier_stop) {
+		if (dev->notifications.empty()) {
+			dev->notify_cv.wait(lk);
+			continue;
+		}
+		FT_NOTIFICATION_CALLBACK_INFO_DATA info = dev->notifications.front();
+		FT_NOTIFICATION_CALLBACK cb = dev->callback;
+		PVOID ctx = dev->callback_ctx;
+
+		dev->notifications.pop_front();
+		lk.unlock();
+		if (cb)
+			cb(ctx, E_FT_NOTIFICATION_CALLBACK_TYPE_DATA, &info);
+		lk.lock();
+	}
+}
+
+/* Like the driver, one notification per chunk received with its length,
+ * not the total waiting on the pipe */
+static void post_notification(device_state *dev, UCHAR fifo_id, size_t len)
+{
+	lock_guard<mutex> lk(dev->lock);
+
+	if (!dev->callback)
+		return;
+	FT_NOTIFICATION_CALLBACK_INFO_DATA info;
+	info.ulRecvNotificationLength = len;
+	info.ucEndpointNo = 0x82 + fifo_id;
+	dev->notifications.push_back(info);
+	dev->notify_cv.notify_one();
+}
+
+/* Move data into the loopback FIFO, returns once everything is queued,
+ * the deadline has passed or the pipe got aborted */
+static FT_STATUS fifo_push(device_state *dev, UCHAR fifo_id, const uint8_t *buf,
+		ULONG len, ULONG *count, clk::time_point deadline, bool wait_forever)
+{
+	channel_state &ch = dev->ch[fifo_id];
+	unique_lock<mutex> lk(ch.lock);
+	FT_STATUS status = FT_OK;
+
+	*count = 0;
+	while (*count < len) {
+		if (ch.out.aborting) {
+			status = FT_OPERATION_ABORTED;
+			break;
+		}
+		size_t space = ch.fifo.size() - ch.used;
+
+		if (!space) {
+			if (wait_forever)
+				ch.cv.wait(lk);
+			else if (ch.cv.wait_until(lk, deadline) ==
+					cv_status::timeout && ch.used == ch.fifo.size()) {
+				status = FT_TIMEOUT;
+				break;
+			}
+			continue;
+		}
+		size_t n = min<size_t>(space, len - *count);
+		size_t tail = (ch.head + ch.used) % ch.fifo.size();
+		size_t first = min(n, ch.fifo.size() - tail);
+
+		memcpy(&ch.fifo[tail], buf + *count, first);
+		memcpy(&ch.fifo[0], buf + *count + first, n - first);
+		ch.used += n;
+		*count += n;
+		ch.cv.notify_all();
+		lk.unlock();
+		post_notification(dev, fifo_id, n);
+		lk.lock();
+	}
+	return status;
+}
+
+/* Both generated patterns repeat every 256 bytes, so IN data is copied
+ * out of a table holding many periods instead of built byte by byte */
+static const size_t PATTERN_PERIOD = 256;
+static const size_t PATTERN_LEN = 64 * 1024;
+
+static const uint8_t *pattern_table(void)
+{
+	static const vector<uint8_t> table = [] {
+		vector<uint8_t> t(PATTERN_LEN + PATTERN_PERIOD);
+
+		for (size_t i = 0; i < t.size(); i++) {
+			if (config().source == SOURCE_COUNTER16)
+				t[i] = i & 1 ? 0 : (uint8_t)((i >> 1) % 128);
+			else
+				t[i] = (uint8_t)i;
+		}
+		return t;
+	}();
+	return table.data();
+}
+
+static void generate(channel_state &ch, uint8_t *buf, ULONG len)
+{
+	const uint8_t *table = pattern_table();
+
+	while (len) {
+		size_t n = min<size_t>(len, PATTERN_LEN);
+
+		memcpy(buf, table + ch.generated % PATTERN_PERIOD, n);
+		ch.generated += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+static FT_STATUS fifo_pop(device_state *dev, UCHAR fifo_id, uint8_t *buf,
+		ULONG len, ULONG *count, clk::time_point deadline, bool wait_forever)
+{
+	channel_state &ch = dev->ch[fifo_id];
+	unique_lock<mutex> lk(ch.lock);
+
+	*count = 0;
+	if (config().source != SOURCE_LOOPBACK) {
+		generate(ch, buf, len);
+		*count = len;
+		return FT_OK;
+	}
+	while (!ch.used) {
+		if (ch.in.aborting)
+			return FT_OPERATION_ABORTED;
+		if (wait_forever)
+			ch.cv.wait(lk);
+		else if (ch.cv.wait_until(lk, deadline) == cv_status::timeout &&
+				!ch.used)
+			return FT_TIMEOUT;
+	}
+	size_t n = min<size_t>(ch.used, len);
+	size_t first = min(n, ch.fifo.size() - ch.head);
+
+	memcpy(buf, &ch.fifo[ch.head], first);
+	memcpy(buf + first, &ch.fifo[0], n - first);
+	ch.head = (ch.head + n) % ch.fifo.size();
+	ch.used -= n;
+	*count = n;
+	ch.cv.notify_all();
+	return FT_OK;
+}
+
+/* Session setup time the link spends before a transfer of len bytes */
+static clk::duration session_setup(device_state *dev, bool read,
+		UCHAR fifo_id, ULONG len)
+{
+	const loopback_config &cfg = config();
+	channel_state &ch = dev->ch[fifo_id];
+	pipe_state &pipe = read ? ch.in : ch.out;
+	lock_guard<mutex> lk(pipe.lock);
+
+	if (!cfg.session_us)
+		return clk::duration::zero();
+	if (pipe.stream_size && pipe.session_left >= len) {
+		pipe.session_left -= len;
+		return clk::duration::zero();
+	}
+	if (pipe.stream_size) {
+		DWORD size = dev->transfer[fifo_id].pipe[read ?
+			FT_PIPE_DIR_IN : FT_PIPE_DIR_OUT].dwStreamingSize;
+
+		if (!size)
+			size = 1 << 30;
+		pipe.session_left = size > len ? size - len : 0;
+	}
+	return chrono::microseconds(cfg.session_us);
+}
+
+/* Run one transfer through the link model, returns the time the transfer
+ * is reported complete to the caller */
+static FT_STATUS do_transfer(device_state *dev, bool read, UCHAR fifo_id,
+		PUCHAR buf, ULONG len, ULONG *count, DWORD timeout_ms,
+		clk::time_point *complete_at)
+{
+	clk::time_point deadline = clk::now() + chrono::milliseconds(timeout_ms);
+	bool wait_forever = timeout_ms == 0xFFFFFFFF;
+	FT_STATUS status;
+
+	if (read)
+		status = fifo_pop(dev, fifo_id, buf, len, count, deadline,
+				wait_forever);
+	else
+		status = fifo_push(dev, fifo_id, buf, len, count, deadline,
+				wait_forever);
+
+	clk::time_point done = (read ? dev->rx : dev->tx).reserve(*count,
+			session_setup(dev, read, fifo_id, len));
+
+	this_thread::sleep_until(done);
+	*complete_at = done + completion_latency();
+	return status;
+}
+
+static void pipe_worker(device_state *dev, UCHAR fifo_id, bool read)
+{
+	channel_state &ch = dev->ch[fifo_id];
+	pipe_state &pipe = read ? ch.in : ch.out;
+	unique_lock<mutex> lk(pipe.lock);
+
+	while (!pipe.stopping) {
+		if (pipe.pending.empty()) {
+			pipe.cv.wait(lk);
+			continue;
+		}
+		overlapped_ctx *ctx = pipe.pending.front();
+		pipe.pending.pop_front();
+		lk.unlock();
+
+		ULONG count = 0;
+		clk::time_point complete_at = clk::now();
+		FT_STATUS status = do_transfer(dev, read, fifo_id, ctx->buf,
+				ctx->len, &count, pipe.timeout_ms ? pipe.timeout_ms :
+				0xFFFFFFFF, &complete_at);
+		{
+			lock_guard<mutex> ctx_lk(ctx->lock);
+
+			ctx->status = status;
+			ctx->count = count;
+			ctx->complete_at = complete_at;
+			ctx->done = true;
+			ctx->cv.notify_all();
+		}
+		lk.lock();
+	}
+}
+
+static void stop_pipe(pipe_state &pipe, channel_state &ch)
+{
+	{
+		lock_guard<mutex> lk(pipe.lock);
+		pipe.stopping = true;
+		pipe.cv.notify_all();
+	}
+	{
+		lock_guard<mutex> lk(ch.lock);
+		pipe.aborting = true;
+		ch.cv.notify_all();
+	}
+	if (pipe.worker.joinable())
+		pipe.worker.join();
+	pipe.stopping = false;
+	pipe.aborting = false;
+}
+
+static FT_STATUS submit(device_state *dev, bool read, UCHAR fifo_id,
+		PUCHAR buf, ULONG len, PULONG count, LPOVERLAPPED ov)
+{
+	if (!valid_fifo(dev, fifo_id))
+		return FT_INVALID_PARAMETER;
+
+	channel_state &ch = dev->ch[fifo_id];
+	pipe_state &pipe = read ? ch.in : ch.out;
+
+	if (!ov) {
+		clk::time_point complete_at;
+		ULONG transferred;
+		FT_STATUS status = do_transfer(dev, read, fifo_id, buf, len,
+				&transferred, pipe.timeout_ms ? pipe.timeout_ms :
+				0xFFFFFFFF, &complete_at);
+
+		this_thread::sleep_until(complete_at);
+		if (count)
+			*count = transferred;
+		return status;
+	}
+
+	overlapped_ctx *ctx = (overlapped_ctx *)ov->hEvent;
+	if (!ctx)
+		return FT_INVALID_PARAMETER;
+	{
+		lock_guard<mutex> lk(ctx->lock);
+		ctx->busy = true;
+		ctx->done = false;
+		ctx->read = read;
+		ctx->fifo_id = fifo_id;
+		ctx->buf = buf;
+		ctx->len = len;
+		ctx->count = 0;
+	}
+
+	lock_guard<mutex> lk(pipe.lock);
+	if (!pipe.worker.joinable())
+		pipe.worker = thread(pipe_worker, dev, fifo_id, read);
+	pipe.pending.push_back(ctx);
+	pipe.cv.notify_one();
+	if (count)
+		*count = 0;
+	return FT_IO_PENDING;
+}
+
+static bool parse_endpoint(UCHAR ep, bool *read, UCHAR *fifo_id)
+{
+	if (ep >= 0x82 && ep <= 0x85) {
+		*read = true;
+		*fifo_id = ep - 0x82;
+		return true;
+	}
+	if (ep >= 0x02 && ep <= 0x05) {
+		*read = false;
+		*fifo_id = ep - 0x02;
+		return true;
+	}
+	return false;
+}
+
+extern "C" {
+
+FT_STATUS FT_SetTransferParams(FT_TRANSFER_CONF *pConf, DWORD dwFifoID)
+{
+	if (!pConf || dwFifoID >= MAX_CHANNELS ||
+			pConf->wStructSize != sizeof(FT_TRANSFER_CONF))
+		return FT_INVALID_PARAMETER;
+	pending_transfer[dwFifoID] = *pConf;
+	return FT_OK;
+}
+
+FT_STATUS FT_CreateDeviceInfoList(LPDWORD lpdwNumDevs)
+{
+	if (!lpdwNumDevs)
+		return FT_INVALID_PARAMETER;
+	*lpdwNumDevs = present_devices();
+	return FT_OK;
+}
+
+FT_STATUS FT_GetDeviceInfoList(FT_DEVICE_LIST_INFO_NODE *ptDest,
+		LPDWORD lpdwNumDevs)
+{
+	if (!ptDest || !lpdwNumDevs)
+		return FT_INVALID_PARAMETER;
+
+	DWORD count = present_devices();
+
+	for (DWORD i = 0; i < count; i++) {
+		device_state *dev = present_device(i);
+
+		memset(&ptDest[i], 0, sizeof(ptDest[i]));
+		ptDest[i].Flags = FT_FLAGS_SUPERSPEED |
+			(dev->opened ? FT_FLAGS_OPENED : 0);
+		ptDest[i].Type = FT_DEVICE_601;
+		ptDest[i].ID = (dev->chip.VendorID << 16) | dev->chip.ProductID;
+		ptDest[i].LocId = dev->loc_id;
+		memcpy(ptDest[i].SerialNumber, dev->serial,
+				sizeof(ptDest[i].SerialNumber));
+		memcpy(ptDest[i].Description, dev->description,
+				sizeof(ptDest[i].Description));
+		ptDest[i].ftHandle = dev->opened ? dev : NULL;
+	}
+	*lpdwNumDevs = count;
+	return FT_OK;
+}
+
+FT_STATUS FT_ListDevices(PVOID pArg1, PVOID pArg2, DWORD Flags)
+{
+	(void)pArg2;
+	if (!(Flags & FT_LIST_NUMBER_ONLY) || !pArg1)
+		return FT_NOT_SUPPORTED;
+	*(LPDWORD)pArg1 = present_devices();
+	return FT_OK;
+}
+
+static FT_STATUS open_device(device_state *dev, FT_HANDLE *pftHandle)
+{
+	if (!dev)
+		return FT_DEVICE_NOT_FOUND;
+	if (dev->opened)
+		return FT_DEVICE_NOT_OPENED;
+
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		channel_state &ch = dev->ch[i];
+
+		dev->transfer[i] = pending_transfer[i];
+		ch.fifo.assign(config().fifo_size, 0);
+		ch.head = ch.used = 0;
+		ch.generated = 0;
+		ch.in.timeout_ms = ch.out.timeout_ms = 5000;
+		ch.in.stream_size = ch.out.stream_size = 0;
+	}
+	dev->callback = NULL;
+	dev->notifier_stop = false;
+	dev->opened = true;
+	*pftHandle = dev;
+
+	/* Transfer parameters only apply to the next FT_Create call */
+	memset(pending_transfer, 0, sizeof(pending_transfer));
+	return FT_OK;
+}
+
+FT_STATUS FT_Create(PVOID pvArg, DWORD dwFlags, FT_HANDLE *pftHandle)
+{
+	if (!pftHandle)
+		return FT_INVALID_PARAMETER;
+	*pftHandle = NULL;
+
+	device_state *dev = NULL;
+
+	if (dwFlags == FT_OPEN_BY_INDEX)
+		dev = present_device((DWORD)(uintptr_t)pvArg);
+	else if (dwFlags == FT_OPEN_BY_SERIAL_NUMBER ||
+			dwFlags == FT_OPEN_BY_DESCRIPTION) {
+		for (DWORD i = 0; (dev = present_device(i)); i++) {
+			const char *name = dwFlags == FT_OPEN_BY_SERIAL_NUMBER ?
+				dev->serial : dev->description;
+
+			if (!strcmp(name, (const char *)pvArg))
+				break;
+		}
+	} else
+		return FT_NOT_SUPPORTED;
+
+	return open_device(dev, pftHandle);
+}
+
+FT_STATUS FT_GetDeviceInfoDetail(DWORD dwIndex, LPDWORD lpdwFlags,
+		LPDWORD lpdwType, LPDWORD lpdwID, LPDWORD lpdwLocId,
+		LPVOID lpSerialNumber, LPVOID lpDescription, FT_HANDLE *pftHandle)
+{
+	device_state *dev = present_device(dwIndex);
+
+	if (pftHandle)
+		*pftHandle = NULL;
+	if (!dev)
+		return FT_DEVICE_NOT_FOUND;
+	if (lpdwFlags)
+		*lpdwFlags = FT_FLAGS_SUPERSPEED |
+			(dev->opened ? FT_FLAGS_OPENED : 0);
+	if (lpdwType)
+		*lpdwType = FT_DEVICE_601;
+	if (lpdwID)
+		*lpdwID = (dev->chip.VendorID << 16) | dev->chip.ProductID;
+	if (lpdwLocId)
+		*lpdwLocId = dev->loc_id;
+	if (lpSerialNumber)
+		memcpy(lpSerialNumber, dev->serial, sizeof(dev->serial));
+	if (lpDescription)
+		memcpy(lpDescription, dev->description, sizeof(dev->description));
+	if (pftHandle && !dev->opened)
+		return open_device(dev, pftHandle);
+	return FT_OK;
+}
+
+FT_STATUS FT_Close(FT_HANDLE ftHandle)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	{
+		lock_guard<mutex> lk(dev->lock);
+		dev->notifier_stop = true;
+		dev->callback = NULL;
+		dev->notify_cv.notify_all();
+	}
+	if (dev->notifier.joinable())
+		dev->notifier.join();
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		stop_pipe(dev->ch[i].in, dev->ch[i]);
+		stop_pipe(dev->ch[i].out, dev->ch[i]);
+	}
+	dev->opened = false;
+	return FT_OK;
+}
+
+FT_STATUS FT_GetVIDPID(FT_HANDLE ftHandle, PUSHORT puwVID, PUSHORT puwPID)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	*puwVID = dev->chip.VendorID;
+	*puwPID = dev->chip.ProductID;
+	return FT_OK;
+}
+
+FT_STATUS FT_ReadPipeEx(FT_HANDLE ftHandle, UCHAR ucFifoID,
+		PUCHAR pucBuffer, ULONG ulBufferLength,
+		PULONG pulBytesTransferred, DWORD dwTimeoutInMs)
+{
+	device_state *dev = to_device(ftHandle);
+	clk::time_point complete_at;
+	ULONG count = 0;
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (!valid_fifo(dev, ucFifoID))
+		return FT_INVALID_PARAMETER;
+
+	FT_STATUS status = do_transfer(dev, true, ucFifoID, pucBuffer,
+			ulBufferLength, &count, dwTimeoutInMs, &complete_at);
+
+	this_thread::sleep_until(complete_at);
+	if (pulBytesTransferred)
+		*pulBytesTransferred = count;
+	return status;
+}
+
+FT_STATUS FT_WritePipeEx(FT_HANDLE ftHandle, UCHAR ucFifoID,
+		PUCHAR pucBuffer, ULONG ulBufferLength,
+		PULONG pulBytesTransferred, DWORD dwTimeoutInMs)
+{
+	device_state *dev = to_device(ftHandle);
+	clk::time_point complete_at;
+	ULONG count = 0;
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (!valid_fifo(dev, ucFifoID))
+		return FT_INVALID_PARAMETER;
+
+	FT_STATUS status = do_transfer(dev, false, ucFifoID, pucBuffer,
+			ulBufferLength, &count, dwTimeoutInMs, &complete_at);
+
+	this_thread::sleep_until(complete_at);
+	if (pulBytesTransferred)
+		*pulBytesTransferred = count;
+	return status;
+}
+
+FT_STATUS FT_ReadPipe(FT_HANDLE ftHandle, UCHAR ucEndpoint,
+		PUCHAR pucBuffer, ULONG ulBufferLength,
+		PULONG pulBytesTransferred, LPOVERLAPPED pOverlapped)
+{
+	device_state *dev = to_device(ftHandle);
+	UCHAR fifo_id;
+	bool read;
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (!parse_endpoint(ucEndpoint, &read, &fifo_id) || !read)
+		return FT_INVALID_PARAMETER;
+	return submit(dev, true, fifo_id, pucBuffer, ulBufferLength,
+			pulBytesTransferred, pOverlapped);
+}
+
+FT_STATUS FT_WritePipe(FT_HANDLE ftHandle, UCHAR ucEndpoint,
+		PUCHAR pucBuffer, ULONG ulBufferLength,
+		PULONG pulBytesTransferred, LPOVERLAPPED pOverlapped)
+{
+	device_state *dev = to_device(ftHandle);
+	UCHAR fifo_id;
+	bool read;
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (!parse_endpoint(ucEndpoint, &read, &fifo_id) || read)
+		return FT_INVALID_PARAMETER;
+	return submit(dev, false, fifo_id, pucBuffer, ulBufferLength,
+			pulBytesTransferred, pOverlapped);
+}
+
+FT_STATUS FT_InitializeOverlapped(FT_HANDLE ftHandle,
+		LPOVERLAPPED pOverlapped)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (!pOverlapped)
+		return FT_INVALID_PARAMETER;
+
+	overlapped_ctx *ctx = new overlapped_ctx();
+
+	ctx->dev = dev;
+	memset(pOverlapped, 0, sizeof(*pOverlapped));
+	pOverlapped->hEvent = ctx;
+	return FT_OK;
+}
+
+FT_STATUS FT_ReleaseOverlapped(FT_HANDLE ftHandle, LPOVERLAPPED pOverlapped)
+{
+	(void)ftHandle;
+	if (!pOverlapped || !pOverlapped->hEvent)
+		return FT_INVALID_PARAMETER;
+
+	overlapped_ctx *ctx = (overlapped_ctx *)pOverlapped->hEvent;
+	{
+		unique_lock<mutex> lk(ctx->lock);
+		ctx->cv.wait(lk, [ctx] { return !ctx->busy || ctx->done; });
+	}
+	delete ctx;
+	pOverlapped->hEvent = NULL;
+	return FT_OK;
+}
+
+FT_STATUS FT_GetOverlappedResult(FT_HANDLE ftHandle,
+		LPOVERLAPPED pOverlapped, PULONG pulBytesTransferred, BOOL bWait)
+{
+	(void)ftHandle;
+	if (!pOverlapped || !pOverlapped->hEvent)
+		return FT_INVALID_PARAMETER;
+
+	overlapped_ctx *ctx = (overlapped_ctx *)pOverlapped->hEvent;
+	unique_lock<mutex> lk(ctx->lock);
+
+	if (!ctx->busy)
+		return FT_INVALID_PARAMETER;
+	if (!ctx->done || clk::now() < ctx->complete_at) {
+		if (!bWait)
+			return FT_IO_INCOMPLETE;
+		ctx->cv.wait(lk, [ctx] { return ctx->done; });
+		clk::time_point complete_at = ctx->complete_at;
+
+		lk.unlock();
+		this_thread::sleep_until(complete_at);
+		lk.lock();
+	}
+	ctx->busy = false;
+	pOverlapped->Internal = ctx->status;
+	pOverlapped->InternalHigh = ctx->count;
+	if (pulBytesTransferred)
+		*pulBytesTransferred = ctx->count;
+	return ctx->status;
+}
+
+FT_STATUS FT_AbortPipe(FT_HANDLE ftHandle, UCHAR ucEndpoint)
+{
+	device_state *dev = to_device(ftHandle);
+	UCHAR fifo_id;
+	bool read;
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (!parse_endpoint(ucEndpoint, &read, &fifo_id) ||
+			!valid_fifo(dev, fifo_id))
+		return FT_INVALID_PARAMETER;
+
+	channel_state &ch = dev->ch[fifo_id];
+	pipe_state &pipe = read ? ch.in : ch.out;
+	deque<overlapped_ctx *> cancelled;
+	{
+		lock_guard<mutex> lk(pipe.lock);
+		cancelled.swap(pipe.pending);
+	}
+	for (overlapped_ctx *ctx : cancelled) {
+		lock_guard<mutex> lk(ctx->lock);
+		ctx->status = FT_OPERATION_ABORTED;
+		ctx->count = 0;
+		ctx->complete_at = clk::now();
+		ctx->done = true;
+		ctx->cv.notify_all();
+	}
+	/* Kick the request in progress and let the worker continue */
+	stop_pipe(pipe, ch);
+	return FT_OK;
+}
+
+FT_STATUS FT_FlushPipe(FT_HANDLE ftHandle, UCHAR ucEndpoint)
+{
+	device_state *dev = to_device(ftHandle);
+	UCHAR fifo_id;
+	bool read;
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (!parse_endpoint(ucEndpoint, &read, &fifo_id) ||
+			!valid_fifo(dev, fifo_id))
+		return FT_INVALID_PARAMETER;
+
+	channel_state &ch = dev->ch[fifo_id];
+	lock_guard<mutex> lk(ch.lock);
+
+	ch.head = ch.used = 0;
+	ch.cv.notify_all();
+	return FT_OK;
+}
+
+FT_STATUS FT_SetPipeTimeout(FT_HANDLE ftHandle, UCHAR ucEndpoint,
+		DWORD dwTimeoutInMs)
+{
+	device_state *dev = to_device(ftHandle);
+	UCHAR fifo_id;
+	bool read;
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (!parse_endpoint(ucEndpoint, &read, &fifo_id))
+		return FT_INVALID_PARAMETER;
+	(read ? dev->ch[fifo_id].in : dev->ch[fifo_id].out).timeout_ms =
+		dwTimeoutInMs;
+	return FT_OK;
+}
+
+FT_STATUS FT_SetStreamPipe(FT_HANDLE ftHandle, BOOL bAllWritePipes,
+		BOOL bAllReadPipes, UCHAR ucEndpoint, ULONG ulStreamSize)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	for (int i = 0; i < channel_count(dev); i++) {
+		pipe_state &out = dev->ch[i].out;
+		pipe_state &in = dev->ch[i].in;
+
+		if (bAllWritePipes || ucEndpoint == 0x02 + i) {
+			lock_guard<mutex> lk(out.lock);
+			out.stream_size = ulStreamSize;
+			out.session_left = 0;
+		}
+		if (bAllReadPipes || ucEndpoint == 0x82 + i) {
+			lock_guard<mutex> lk(in.lock);
+			in.stream_size = ulStreamSize;
+			in.session_left = 0;
+		}
+	}
+	return FT_OK;
+}
+
+FT_STATUS FT_ClearStreamPipe(FT_HANDLE ftHandle, BOOL bAllWritePipes,
+		BOOL bAllReadPipes, UCHAR ucEndpoint)
+{
+	return FT_SetStreamPipe(ftHandle, bAllWritePipes, bAllReadPipes,
+			ucEndpoint, 0);
+}
+
+FT_STATUS FT_GetReadQueueStatus(FT_HANDLE ftHandle, UCHAR ucFifoID,
+		LPDWORD lpdwAmountInQueue)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (!valid_fifo(dev, ucFifoID) || !lpdwAmountInQueue)
+		return FT_INVALID_PARAMETER;
+
+	lock_guard<mutex> lk(dev->ch[ucFifoID].lock);
+	*lpdwAmountInQueue = dev->ch[ucFifoID].used;
+	return FT_OK;
+}
+
+FT_STATUS FT_GetWriteQueueStatus(FT_HANDLE ftHandle, UCHAR ucFifoID,
+		LPDWORD lpdwAmountInQueue)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (!valid_fifo(dev, ucFifoID) || !lpdwAmountInQueue)
+		return FT_INVALID_PARAMETER;
+	*lpdwAmountInQueue = 0;
+	return FT_OK;
+}
+
+FT_STATUS FT_GetUnsentBuffer(FT_HANDLE ftHandle, UCHAR ucFifoID,
+		BYTE *byBuffer, LPDWORD lpdwBufferLength)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (!valid_fifo(dev, ucFifoID) || !lpdwBufferLength)
+		return FT_INVALID_PARAMETER;
+	/* Writes complete once they are in the loopback FIFO */
+	(void)byBuffer;
+	*lpdwBufferLength = 0;
+	return FT_OK;
+}
+
+FT_STATUS FT_SetNotificationCallback(FT_HANDLE ftHandle,
+		FT_NOTIFICATION_CALLBACK pCallback, PVOID pvCallbackContext)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	{
+		lock_guard<mutex> lk(dev->lock);
+		dev->callback = pCallback;
+		dev->callback_ctx = pvCallbackContext;
+		dev->notifier_stop = false;
+	}
+	if (!dev->notifier.joinable())
+		dev->notifier = thread(notifier_loop, dev);
+	return FT_OK;
+}
+
+VOID FT_ClearNotificationCallback(FT_HANDLE ftHandle)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return;
+	{
+		lock_guard<mutex> lk(dev->lock);
+		dev->callback = NULL;
+		dev->notifier_stop = true;
+		dev->notifications.clear();
+		dev->notify_cv.notify_all();
+	}
+	if (dev->notifier.joinable())
+		dev->notifier.join();
+}
+
+FT_STATUS FT_GetChipConfiguration(FT_HANDLE ftHandle, PVOID pvConfiguration)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	memcpy(pvConfiguration, &dev->chip, sizeof(dev->chip));
+	return FT_OK;
+}
+
+FT_STATUS FT_SetChipConfiguration(FT_HANDLE ftHandle, PVOID pvConfiguration)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	if (pvConfiguration)
+		memcpy(&dev->chip, pvConfiguration, sizeof(dev->chip));
+	/* The chip resets and re-enumerates with the new configuration */
+	dev->present_at = clk::now() +
+		chrono::milliseconds(config().reenum_ms);
+	return FT_OK;
+}
+
+FT_STATUS FT_GetFirmwareVersion(FT_HANDLE ftHandle, PULONG pulFirmwareVersion)
+{
+	if (!to_device(ftHandle))
+		return FT_INVALID_HANDLE;
+	*pulFirmwareVersion = LOOPBACK_FIRMWARE_VERSION;
+	return FT_OK;
+}
+
+FT_STATUS FT_ResetDevicePort(FT_HANDLE ftHandle)
+{
+	return to_device(ftHandle) ? FT_OK : FT_INVALID_HANDLE;
+}
+
+FT_STATUS FT_CycleDevicePort(FT_HANDLE ftHandle)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	dev->present_at = clk::now() +
+		chrono::milliseconds(config().reenum_ms);
+	return FT_OK;
+}
+
+FT_STATUS FT_GetDriverVersion(FT_HANDLE ftHandle, LPDWORD lpdwVersion)
+{
+	(void)ftHandle;
+	if (!lpdwVersion)
+		return FT_INVALID_PARAMETER;
+	*lpdwVersion = LOOPBACK_DRIVER_VERSION;
+	return FT_OK;
+}
+
+FT_STATUS FT_GetLibraryVersion(LPDWORD lpdwVersion)
+{
+	if (!lpdwVersion)
+		return FT_INVALID_PARAMETER;
+	*lpdwVersion = LOOPBACK_LIBRARY_VERSION;
+	return FT_OK;
+}
+
+FT_STATUS FT_EnableGPIO(FT_HANDLE ftHandle, DWORD dwMask, DWORD dwDirection)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	dev->gpio_mask |= dwMask & 0x7;
+	dev->gpio_dir = (dev->gpio_dir & ~dwMask) | (dwDirection & dwMask);
+	return FT_OK;
+}
+
+FT_STATUS FT_WriteGPIO(FT_HANDLE ftHandle, DWORD dwMask, DWORD dwLevel)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	dwMask &= dev->gpio_mask & dev->gpio_dir;
+	dev->gpio_level = (dev->gpio_level & ~dwMask) | (dwLevel & dwMask);
+	return FT_OK;
+}
+
+FT_STATUS FT_ReadGPIO(FT_HANDLE ftHandle, DWORD *pdwData)
+{
+	device_state *dev = to_device(ftHandle);
+
+	if (!dev)
+		return FT_INVALID_HANDLE;
+	*pdwData = dev->gpio_level;
+	return FT_OK;
+}
+
+FT_STATUS FT_SetGPIOPull(FT_HANDLE ftHandle, DWORD dwMask, DWORD dwPull)
+{
+	(void)dwMask;
+	(void)dwPull;
+	return to_device(ftHandle) ? FT_OK : FT_INVALID_HANDLE;
+}
+
+} /* extern "C" */
@@ -0,0 +1,233 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include "channel_stats.h"
+
+/* Log-bucketed latency histogram in the style of HdrHistogram. Values
+ * below 16ns get a bucket each; above that every power of two is split
+ * into 16 buckets, so a bucket is never wider than 1/16 of its values.
+ * One thread records into a histogram with relaxed load/store pairs while
+ * the measure thread reads it, no locked instructions on the data path. */
+class alignas(64) latency_histogram {
+public:
+	static const int SUB_BITS = 4;
+	static const int SUB_BUCKETS = 1 << SUB_BITS;
+	static const int MAX_BITS = 40; /* values saturate at ~18 minutes */
+	static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+	void record(uint64_t ns)
+	{
+		std::atomic<uint64_t> &bucket = counts[bucket_of(ns)];
+
+		bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+				std::memory_order_relaxed);
+		total.store(total.load(std::memory_order_relaxed) + ns,
+				std::memory_order_relaxed);
+		if (ns > max.load(std::memory_order_relaxed))
+			max.store(ns, std::memory_order_relaxed);
+	}
+
+	void record(std::chrono::steady_clock::time_point start)
+	{
+		record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start).count());
+	}
+
+	static int bucket_of(uint64_t ns)
+	{
+		if (ns >= 1ULL << MAX_BITS)
+			return BUCKETS - 1;
+		if (ns < SUB_BUCKETS)
+			return ns;
+
+		int msb = 63 - __builtin_clzll(ns);
+
+		return (msb - SUB_BITS + 1) * SUB_BUCKETS +
+			(int)(ns >> (msb - SUB_BITS)) - SUB_BUCKETS;
+	}
+
+	/* Highest value that lands in bucket idx */
+	static uint64_t bucket_high(int idx)
+	{
+		if (idx < SUB_BUCKETS)
+			return idx;
+
+		int shift = idx / SUB_BUCKETS - 1;
+		uint64_t low = (uint64_t)(SUB_BUCKETS + idx % SUB_BUCKETS) << shift;
+
+		return low + (1ULL << shift) - 1;
+	}
+
+	uint64_t count(int idx) const
+	{
+		return counts[idx].load(std::memory_order_relaxed);
+	}
+
+	uint64_t total_ns(void) const
+	{
+		return total.load(std::memory_order_relaxed);
+	}
+
+	uint64_t max_ns(void) const
+	{
+		return max.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<uint64_t> counts[BUCKETS];
+	std::atomic<uint64_t> total;
+	std::atomic<uint64_t> max;
+};
+
+/* Plain copy of histogram counts on the measure side, for differences
+ * between two readings and for merging channels */
+struct latency_snapshot {
+	uint64_t counts[latency_histogram::BUCKETS];
+	uint64_t samples;
+	uint64_t total_ns;
+	uint64_t max_ns; /* exact maximum since the start */
+
+	void clear(void)
+	{
+		memset(this, 0, sizeof(*this));
+	}
+
+	void read(const latency_histogram &h)
+	{
+		samples = 0;
+		for (int i = 0; i < latency_histogram::BUCKETS; i++) {
+			counts[i] = h.count(i);
+			samples += counts[i];
+		}
+		total_ns = h.total_ns();
+		max_ns = h.max_ns();
+	}
+
+	void subtract(const latency_snapshot &o)
+	{
+		for (int i = 0; i < latency_histogram::BUCKETS; i++)
+			counts[i] -= o.counts[i];
+		samples -= o.samples;
+		total_ns -= o.total_ns;
+	}
+
+	void merge(const latency_snapshot &o)
+	{
+		for (int i = 0; i < latency_histogram::BUCKETS; i++)
+			counts[i] += o.counts[i];
+		samples += o.samples;
+		total_ns += o.total_ns;
+		if (o.max_ns > max_ns)
+			max_ns = o.max_ns;
+	}
+
+	/* Value at or below which fraction p of the samples fall, rounded up
+	 * to the bucket edge; p = 1 gives the maximum */
+	uint64_t percentile(double p) const
+	{
+		uint64_t rank = (uint64_t)(p * samples + 0.5);
+		uint64_t seen = 0;
+
+		if (!rank)
+			rank = 1;
+		for (int i = 0; i < latency_histogram::BUCKETS; i++) {
+			seen += counts[i];
+			if (seen >= rank) {
+				uint64_t high = latency_histogram::bucket_high(i);
+
+				return high < max_ns ? high : max_ns;
+			}
+		}
+		return 0;
+	}
+
+	uint64_t avg_ns(void) const
+	{
+		return samples ? total_ns / samples : 0;
+	}
+};
+
+/* Histograms of every channel and direction of a device */
+class device_latency {
+public:
+	static const int MAX_CHANNELS = 4;
+
+	latency_histogram &channel(stats_dir dir, uint8_t ch)
+	{
+		return hist[dir][ch];
+	}
+
+	/* Print " <name> p50:x p99:x p99.9:x max:x" over all channels of one
+	 * direction for the samples since the previous call, measure thread
+	 * only. The caller ends the line. */
+	void show_interval(const char *name, stats_dir dir, uint8_t ch_cnt)
+	{
+		scratch.clear();
+		for (uint8_t ch = 0; ch < ch_cnt; ch++) {
+			current.read(hist[dir][ch]);
+			delta = current;
+			delta.subtract(last[dir][ch]);
+			last[dir][ch] = current;
+			scratch.merge(delta);
+		}
+		if (!scratch.samples)
+			return;
+		printf(" %s p50:%.1fus p99:%.1fus p99.9:%.1fus max:%.1fus", name,
+				scratch.percentile(0.5) / 1000.0,
+				scratch.percentile(0.99) / 1000.0,
+				scratch.percentile(0.999) / 1000.0,
+				scratch.percentile(1) / 1000.0);
+	}
+
+	/* Totals since the start over all channels of one direction */
+	const latency_snapshot &total(stats_dir dir, uint8_t ch_cnt)
+	{
+		scratch.clear();
+		for (uint8_t ch = 0; ch < ch_cnt; ch++) {
+			current.read(hist[dir][ch]);
+			scratch.merge(current);
+		}
+		return scratch;
+	}
+
+	/* Print every non-empty bucket of each channel of one direction */
+	void dump(const char *name, stats_dir dir, uint8_t ch_cnt)
+	{
+		for (uint8_t ch = 0; ch < ch_cnt; ch++) {
+			const latency_snapshot &s = current;
+			uint64_t seen = 0;
+
+			current.read(hist[dir][ch]);
+			if (!s.samples)
+				continue;
+			printf("%s CH%d latency histogram: %llu transfers, avg:%.1fus "
+					"max:%.1fus\r\n", name, ch,
+					(unsigned long long)s.samples, s.avg_ns() / 1000.0,
+					s.max_ns / 1000.0);
+			for (int i = 0; i < latency_histogram::BUCKETS; i++) {
+				if (!s.counts[i])
+					continue;
+				seen += s.counts[i];
+				printf("  <=%10.1fus %12llu %8.4f%%\r\n",
+						latency_histogram::bucket_high(i) / 1000.0,
+						(unsigned long long)s.counts[i],
+						100.0 * seen / s.samples);
+			}
+		}
+	}
+
+private:
+	latency_histogram hist[2][MAX_CHANNELS];
+	/* Measure thread only */
+	latency_snapshot last[2][MAX_CHANNELS];
+	latency_snapshot current;
+	latency_snapshot delta;
+	latency_snapshot scratch;
+};
+
+#endif /* LATENCY_HISTOGRAM_H */
@@ -0,0 +1,74 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Read-only memory mapping of a whole file */
+class mapped_file {
+public:
+	mapped_file() : addr(NULL), len(0) {}
+	~mapped_file() { unmap(); }
+
+	/* advice: madvise() hint for the whole mapping */
+	bool map(const char *path, int advice = MADV_SEQUENTIAL)
+	{
+		struct stat st;
+		int fd = open(path, O_RDONLY);
+
+		unmap();
+		if (fd < 0)
+			return false;
+		if (fstat(fd, &st) || st.st_size == 0) {
+			close(fd);
+			return false;
+		}
+
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+		close(fd);
+		if (p == MAP_FAILED)
+			return false;
+		addr = (uint8_t *)p;
+		len = st.st_size;
+		madvise(addr, len, advice);
+		return true;
+	}
+
+	void unmap(void)
+	{
+		if (addr)
+			munmap(addr, len);
+		addr = NULL;
+		len = 0;
+	}
+
+	/* Ask the kernel to start reading [offset, offset + length) */
+	void prefetch(size_t offset, size_t length) const
+	{
+		size_t page = sysconf(_SC_PAGESIZE);
+		size_t start = offset & ~(page - 1);
+
+		if (start >= len)
+			return;
+		if (offset + length > len)
+			length = len - offset;
+		madvise(addr + start, offset + length - start, MADV_WILLNEED);
+	}
+
+	const uint8_t *data(void) const { return addr; }
+	size_t size(void) const { return len; }
+
+private:
+	mapped_file(const mapped_file &);
+	mapped_file &operator=(const mapped_file &);
+
+	uint8_t *addr;
+	size_t len;
+};
+
+#endif /* MAPPED_FILE_H */
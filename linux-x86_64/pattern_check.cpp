@@ -0,0 +1,176 @@
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "pattern_check.h"
+
+static size_t find_break_scalar(const uint8_t *s, size_t n, int16_t prev)
+{
+	for (size_t i = 0; i < n; i++) {
+		int16_t cur = counter16_sample(s, i);
+
+		if (!counter16_step_ok(prev, cur))
+			return i;
+		prev = cur;
+	}
+	return n;
+}
+
+static size_t bytes_find_break_scalar(const uint8_t *s, size_t n,
+		uint8_t prev)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (s[i] != (uint8_t)(prev + 1))
+			return i;
+		prev = s[i];
+	}
+	return n;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Saturating subtraction yields the exact difference whenever it fits in
+ * 16 bits and a saturated value otherwise, so a lane passes exactly when
+ * the full-width difference is 1, 0 or -127 */
+__attribute__((target("sse2")))
+static size_t find_break_sse2(const uint8_t *s, size_t n, int16_t prev)
+{
+	if (!n)
+		return 0;
+	if (!counter16_step_ok(prev, counter16_sample(s, 0)))
+		return 0;
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i wrap = _mm_set1_epi16(-127);
+	size_t i = 1;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i cur = _mm_loadu_si128((const __m128i *)(s + i * 2));
+		__m128i prv = _mm_loadu_si128(
+				(const __m128i *)(s + (i - 1) * 2));
+		__m128i d = _mm_subs_epi16(cur, prv);
+		__m128i ok = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(d, zero),
+					_mm_cmpeq_epi16(d, one)), _mm_cmpeq_epi16(d, wrap));
+
+		if (_mm_movemask_epi8(ok) != 0xFFFF)
+			break;
+	}
+	return i + find_break_scalar(s + i * 2, n - i,
+			counter16_sample(s, i - 1));
+}
+
+__attribute__((target("avx2")))
+static size_t find_break_avx2(const uint8_t *s, size_t n, int16_t prev)
+{
+	if (!n)
+		return 0;
+	if (!counter16_step_ok(prev, counter16_sample(s, 0)))
+		return 0;
+
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi16(1);
+	const __m256i wrap = _mm256_set1_epi16(-127);
+	size_t i = 1;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i cur = _mm256_loadu_si256((const __m256i *)(s + i * 2));
+		__m256i prv = _mm256_loadu_si256(
+				(const __m256i *)(s + (i - 1) * 2));
+		__m256i d = _mm256_subs_epi16(cur, prv);
+		__m256i ok = _mm256_or_si256(_mm256_or_si256(
+					_mm256_cmpeq_epi16(d, zero),
+					_mm256_cmpeq_epi16(d, one)),
+				_mm256_cmpeq_epi16(d, wrap));
+
+		if ((uint32_t)_mm256_movemask_epi8(ok) != 0xFFFFFFFF)
+			break;
+	}
+	return i + find_break_sse2(s + i * 2, n - i,
+			counter16_sample(s, i - 1));
+}
+
+__attribute__((target("sse2")))
+static size_t bytes_find_break_sse2(const uint8_t *s, size_t n, uint8_t prev)
+{
+	if (!n)
+		return 0;
+	if (s[0] != (uint8_t)(prev + 1))
+		return 0;
+
+	const __m128i one = _mm_set1_epi8(1);
+	size_t i = 1;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i cur = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i prv = _mm_loadu_si128((const __m128i *)(s + i - 1));
+		__m128i ok = _mm_cmpeq_epi8(_mm_sub_epi8(cur, prv), one);
+
+		if (_mm_movemask_epi8(ok) != 0xFFFF)
+			break;
+	}
+	return i + bytes_find_break_scalar(s + i, n - i, s[i - 1]);
+}
+
+__attribute__((target("avx2")))
+static size_t bytes_find_break_avx2(const uint8_t *s, size_t n, uint8_t prev)
+{
+	if (!n)
+		return 0;
+	if (s[0] != (uint8_t)(prev + 1))
+		return 0;
+
+	const __m256i one = _mm256_set1_epi8(1);
+	size_t i = 1;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i cur = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i prv = _mm256_loadu_si256((const __m256i *)(s + i - 1));
+		__m256i ok = _mm256_cmpeq_epi8(_mm256_sub_epi8(cur, prv), one);
+
+		if ((uint32_t)_mm256_movemask_epi8(ok) != 0xFFFFFFFF)
+			break;
+	}
+	return i + bytes_find_break_sse2(s + i, n - i, s[i - 1]);
+}
+#endif
+
+typedef size_t (*find_break_fn)(const uint8_t *, size_t, int16_t);
+
+static find_break_fn select_find_break(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return find_break_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return find_break_sse2;
+#endif
+	return find_break_scalar;
+}
+
+size_t counter16_find_break(const uint8_t *s, size_t n, int16_t prev)
+{
+	static const find_break_fn find_break = select_find_break();
+
+	return find_break(s, n, prev);
+}
+
+typedef size_t (*bytes_find_break_fn)(const uint8_t *, size_t, uint8_t);
+
+static bytes_find_break_fn select_bytes_find_break(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return bytes_find_break_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return bytes_find_break_sse2;
+#endif
+	return bytes_find_break_scalar;
+}
+
+size_t bytes_find_break(const uint8_t *s, size_t n, uint8_t prev)
+{
+	static const bytes_find_break_fn find_break = select_bytes_find_break();
+
+	return find_break(s, n, prev);
+}
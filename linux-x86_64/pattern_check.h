@@ -0,0 +1,36 @@
+#ifndef PATTERN_CHECK_H
+#define PATTERN_CHECK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/* Test pattern of the zynq FPGA design: little-endian signed 16-bit
+ * samples that increment by one, repeat, or wrap back by 127 (the rules
+ * of the former testseq.py) */
+static inline bool counter16_step_ok(int16_t prev, int16_t cur)
+{
+	int diff = cur - prev;
+
+	return diff == 1 || diff == 0 || diff == -127;
+}
+
+/* Sample i of a counter16 stream at p, which need not be 2-byte aligned */
+static inline int16_t counter16_sample(const uint8_t *p, size_t i)
+{
+	int16_t v;
+
+	memcpy(&v, p + i * 2, sizeof(v));
+	return v;
+}
+
+/* Index of the first of the n samples at p that breaks the pattern, where
+ * prev is the sample preceding the first. Returns n if all samples are
+ * good. p may have any alignment. */
+size_t counter16_find_break(const uint8_t *p, size_t n, int16_t prev);
+
+/* Same for the i%256 byte pattern sent by zynqtest's write_test: every
+ * byte is the previous one plus one, modulo 256 */
+size_t bytes_find_break(const uint8_t *s, size_t n, uint8_t prev);
+
+#endif /* PATTERN_CHECK_H */
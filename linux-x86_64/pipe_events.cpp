@@ -0,0 +1,139 @@
+#include <cstdio>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "pipe_events.h"
+
+using namespace std;
+
+bool pipe_events::open(FT_HANDLE dev, UCHAR ep, int depth)
+{
+	close();
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0) {
+		printf("Failed to create eventfd for pipe %02X\r\n", ep);
+		return false;
+	}
+	handle = dev;
+	pipe = ep;
+	submitted = completed = collected = 0;
+	closing = false;
+	slots = vector<slot>(depth);
+	for (size_t i = 0; i < slots.size(); i++) {
+		if (FT_OK != FT_InitializeOverlapped(handle, &slots[i].ov)) {
+			printf("Failed to initialize overlapped\r\n");
+			slots.resize(i);
+			close();
+			return false;
+		}
+	}
+	FT_SetPipeTimeout(handle, pipe, 1000);
+	waiter = thread(&pipe_events::wait_completions, this);
+	return true;
+}
+
+void pipe_events::close(void)
+{
+	if (efd < 0)
+		return;
+	if (waiter.joinable()) {
+		FT_AbortPipe(handle, pipe);
+		{
+			lock_guard<mutex> lk(lock);
+			closing = true;
+			cv.notify_all();
+		}
+		waiter.join();
+	}
+	for (slot &s : slots)
+		FT_ReleaseOverlapped(handle, &s.ov);
+	slots.clear();
+	::close(efd);
+	efd = -1;
+}
+
+/* The helper thread: wait for the oldest transfer on the pipe, publish
+ * its result and wake the loop. Drains what is in flight before exiting
+ * on close. */
+void pipe_events::wait_completions(void)
+{
+	unique_lock<mutex> lk(lock);
+
+	for (;;) {
+		if (completed == submitted) {
+			if (closing)
+				break;
+			cv.wait(lk);
+			continue;
+		}
+
+		slot &s = slots[completed % slots.size()];
+		ULONG count = 0;
+
+		lk.unlock();
+		FT_STATUS status = FT_GetOverlappedResult(handle, &s.ov, &count,
+				true);
+		lk.lock();
+		s.result.count = count;
+		s.result.status = status;
+		completed++;
+
+		uint64_t one = 1;
+
+		if (write(efd, &one, sizeof(one)) != sizeof(one))
+			printf("Failed to signal pipe %02X\r\n", pipe);
+	}
+}
+
+bool pipe_events::submit(uint8_t *buf, ULONG len, void *ctx)
+{
+	unique_lock<mutex> lk(lock);
+
+	if (submitted - collected == slots.size())
+		return false;
+
+	slot &s = slots[submitted % slots.size()];
+	ULONG count = 0;
+	FT_STATUS status;
+
+	s.result.buf = buf;
+	s.result.ctx = ctx;
+	s.result.submitted = chrono::steady_clock::now();
+	/* Not holding the lock across the call, the waiter only looks at
+	 * slots below submitted */
+	lk.unlock();
+	if (pipe & 0x80)
+		status = FT_ReadPipe(handle, pipe, buf, len, &count, &s.ov);
+	else
+		status = FT_WritePipe(handle, pipe, buf, len, &count, &s.ov);
+	if (status != FT_IO_PENDING && status != FT_OK)
+		return false;
+	lk.lock();
+	submitted++;
+	cv.notify_one();
+	return true;
+}
+
+bool pipe_events::complete(pipe_completion *done)
+{
+	uint64_t signals;
+
+	/* Clear the eventfd first: a transfer completing after this either is
+	 * collected below or signals again */
+	if (read(efd, &signals, sizeof(signals)) < 0)
+		signals = 0;
+
+	lock_guard<mutex> lk(lock);
+
+	if (collected == completed)
+		return false;
+	*done = slots[collected % slots.size()].result;
+	collected++;
+	return true;
+}
+
+int pipe_events::queued(void)
+{
+	lock_guard<mutex> lk(lock);
+
+	return submitted - collected;
+}
@@ -0,0 +1,77 @@
+#ifndef PIPE_EVENTS_H
+#define PIPE_EVENTS_H
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ftd3xx.h"
+
+/* One pipe as a file descriptor for an epoll (or poll/select) loop.
+ *
+ * D3XX has nothing to wait on but blocking calls, so pipe_events keeps a
+ * queue of overlapped transfers on the pipe and a helper thread waits for
+ * them in order, signalling an eventfd as each completes. The loop thread
+ * only submits and collects and never blocks in the library. The pipe is
+ * then used from two threads, open the device with
+ * session_config.shared_pipes.
+ *
+ * data_notifier::fd() does the same for the notification callback. */
+
+struct pipe_completion {
+	uint8_t *buf;
+	ULONG count;
+	FT_STATUS status;
+	std::chrono::steady_clock::time_point submitted;
+	void *ctx; /* as given to submit */
+};
+
+class pipe_events {
+public:
+	pipe_events() : handle(NULL), efd(-1) {}
+	~pipe_events() { close(); }
+	pipe_events(const pipe_events &) = delete;
+	pipe_events &operator=(const pipe_events &) = delete;
+
+	/* Room for depth transfers on pipe (0x02+ch OUT, 0x82+ch IN). Prints
+	 * the reason and returns false on failure. */
+	bool open(FT_HANDLE handle, UCHAR pipe, int depth);
+	/* Abort the pipe, wait for everything in flight and release it */
+	void close(void);
+
+	/* Readable while completed transfers wait to be collected */
+	int fd(void) const { return efd; }
+
+	/* Queue a read or write of len bytes, false when depth transfers are
+	 * already queued or the library refused it */
+	bool submit(uint8_t *buf, ULONG len, void *ctx = NULL);
+	/* Oldest completed transfer, false when there is none (never blocks) */
+	bool complete(pipe_completion *done);
+	/* Transfers submitted and not collected yet */
+	int queued(void);
+
+private:
+	struct slot {
+		OVERLAPPED ov;
+		pipe_completion result;
+	};
+
+	void wait_completions(void);
+
+	FT_HANDLE handle;
+	UCHAR pipe;
+	int efd;
+	std::vector<slot> slots;
+	/* Running counts, slot = count % depth: transfers in [collected,
+	 * completed) are done, in [completed, submitted) on the pipe */
+	size_t submitted;
+	size_t completed;
+	size_t collected;
+	bool closing;
+	std::mutex lock;
+	std::condition_variable cv;
+	std::thread waiter;
+};
+
+#endif /* PIPE_EVENTS_H */
@@ -1,206 +1,267 @@
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include "ftd3xx.h"
+#include "device_session.h"
+#include "buffer_pool.h"
 
 static bool ft600_mode;
 static uint8_t channel;
-static long in_cnt;
-static long out_cnt;
-
-static void get_version(void)
-{
-	DWORD dwVersion;
-
-	FT_GetDriverVersion(NULL, &dwVersion);
-	printf("Driver version:%d.%d.%d.%d\r\n", dwVersion >> 24,
-			(uint8_t)(dwVersion >> 16), (uint8_t)(dwVersion >> 8),
-			dwVersion & 0xFF);
-
-	FT_GetLibraryVersion(&dwVersion);
-	printf("Library version:%d.%d.%d\r\n", dwVersion >> 24,
-			(uint8_t)(dwVersion >> 16), dwVersion & 0xFFFF);
-}
-
-static void get_vid_pid(FT_HANDLE handle)
+static uint64_t in_cnt;
+static uint64_t out_cnt;
+
+/* Transfers are split into chunks streamed through a pool of this size,
+ * so any length works in fixed memory. A chunk that times out is retried
+ * until the transfer completes or is interrupted. */
+#define CHUNK_LEN (1024 * 1024)
+#define CHUNK_TIMEOUT 1000 /* ms */
+/* Size of the first read when both directions run, so that the round
+ * trip is measured to the first data back rather than a full chunk */
+#define RTT_PROBE_LEN 4096
+
+static bool sequential; /* -s: write everything, then read */
+
+static FT_HANDLE handle;
+static struct buffer_pool *pool;
+static volatile sig_atomic_t do_exit;
+
+struct transfer {
+	const char *name;
+	bool write;
+	uint64_t len;
+	uint64_t done;  /* bytes so far, read by the progress report */
+	bool finished;
+	bool failed;
+	struct timespec start;
+	struct timespec first; /* first chunk submitted (TX), data back (RX) */
+	struct timespec end;
+};
+
+static UCHAR channel_config(void)
 {
-	WORD vid, pid;
-
-	if (FT_OK != FT_GetVIDPID(handle, &vid, &pid))
-		return;
-	printf("VID:%04X PID:%04X\r\n", vid, pid);
+	if (channel == 1) {
+		if (out_cnt == 0)
+			return CONFIGURATION_CHANNEL_CONFIG_1_INPIPE;
+		if (in_cnt == 0)
+			return CONFIGURATION_CHANNEL_CONFIG_1_OUTPIPE;
+		return CONFIGURATION_CHANNEL_CONFIG_1;
+	}
+	if (channel == 2)
+		return CONFIGURATION_CHANNEL_CONFIG_2;
+	return CONFIGURATION_CHANNEL_CONFIG_4;
 }
 
-static void turn_off_all_pipes(void)
+static void show_help(const char *bin)
 {
-	FT_TRANSFER_CONF conf;
-
-	memset(&conf, 0, sizeof(FT_TRANSFER_CONF));
-	conf.wStructSize = sizeof(FT_TRANSFER_CONF);
-	conf.pipe[FT_PIPE_DIR_IN].fPipeNotUsed = true;
-	conf.pipe[FT_PIPE_DIR_OUT].fPipeNotUsed = true;
-	for (DWORD i = 0; i < 4; i++)
-		FT_SetTransferParams(&conf, i);
+	printf("Usage: %s [-s] <read length> <write length> <channel> [mode]\r\n", bin);
+	printf("  -s: write everything before reading, instead of both directions\r\n");
+	printf("      at once (full duplex) with the round trip time measured\r\n");
+	printf("  length: in bytes, transferred in %d KiB chunks with progress\r\n",
+			CHUNK_LEN / 1024);
+	printf("          reported every second\r\n");
+	printf("  channel: which channel to use, must be 1 for FT245 mode, [1, 4] for FT600 mode\r\n");
+	printf("  mode: set fifo mode. 0 = FT245 mode (default), 1 = FT600 mode\r\n");
 }
 
-static bool get_device_lists(void)
+static bool validate_arguments(int argc, char *argv[])
 {
-	DWORD count;
-	FT_DEVICE_LIST_INFO_NODE nodes[16];
-
-	FT_CreateDeviceInfoList(&count);
-	printf("Total %u device(s)\r\n", count);
-	if (!count)
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s")) != -1) {
+		switch (opt) {
+		case 's':
+			sequential = true;
+			break;
+		default:
+			return false;
+		}
+	}
+	argv += optind - 1;
+	if (argc - optind != 4)
 		return false;
 
-	if (FT_OK != FT_GetDeviceInfoList(nodes, &count))
+	int val = atoi(argv[4]);
+	if (val != 0 && val != 1)
 		return false;
-	return true;
-}
-
-static bool set_channel_config(void)
-{
-	FT_HANDLE handle;
-	FT_60XCONFIGURATION cfg;
-	DWORD dwVersion;
-	bool current_is_600mode;
-	bool needs_update = false;
-	bool rev_a_chip;
-
-	/* Must turn off all pipes before changing chip configuration */
-	turn_off_all_pipes();
-
-	FT_GetDeviceInfoDetail(0, NULL, NULL, NULL, NULL, NULL, NULL, &handle);
+	ft600_mode = (bool)val;
 
-	if (!handle)
+	in_cnt = strtoull(argv[1], NULL, 0);
+	out_cnt = strtoull(argv[2], NULL, 0);
+	if (in_cnt == 0 && out_cnt == 0)
 		return false;
 
-	FT_GetFirmwareVersion(handle, &dwVersion);
-	rev_a_chip = dwVersion <= 0x105;
-
-	get_vid_pid(handle);
-
-	if (FT_OK != FT_GetChipConfiguration(handle, &cfg)) {
-		printf("Failed to get chip conf\r\n");
-		goto _Exit;
-	}
-	if (cfg.OptionalFeatureSupport &
-			CONFIGURATION_OPTIONAL_FEATURE_ENABLENOTIFICATIONMESSAGE_INCHALL) {
-		/* Notification in D3XX for Linux is implemented at OS level
-		 * Turn off notification feature in firmware */
-		cfg.OptionalFeatureSupport &=
-			~CONFIGURATION_OPTIONAL_FEATURE_ENABLENOTIFICATIONMESSAGE_INCHALL;
-		needs_update = true;
-		printf("Turn off firmware notification feature\r\n");
+	if (!ft600_mode)
+		channel = 1;
+	else {
+		channel = atoi(argv[3]);
+		if (channel < 1 || channel > 4)
+			return false;
 	}
 
-	if (!(cfg.OptionalFeatureSupport &
-			CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN)) {
-		/* Turn off feature not supported by D3XX for Linux */
-		cfg.OptionalFeatureSupport |=
-			CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN;
-		needs_update = true;
-		printf("disable cancel session on FIFO underrun 0x%X\r\n",
-				cfg.OptionalFeatureSupport);
-	}
+	return true;
+}
 
-	if (cfg.FIFOMode == CONFIGURATION_FIFO_MODE_245) {
-		printf("FIFO is running at FT245 mode\r\n");
-		current_is_600mode = false;
-	} else if (cfg.FIFOMode == CONFIGURATION_FIFO_MODE_600) {
-		printf("FIFO is running at FT600 mode\r\n");
-		current_is_600mode = true;
-	} else {
-		printf("FIFO is running at unknown mode\r\n");
-		goto _Exit;
+static double seconds_between(const struct timespec *from,
+		const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void *run_transfer(void *arg)
+{
+	struct transfer *t = (struct transfer *)arg;
+	uint8_t *buf = (uint8_t *)buffer_pool_get(pool);
+	uint64_t done = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+	t->first = t->start;
+	while (!do_exit && done < t->len) {
+		ULONG len = t->len - done < CHUNK_LEN ? t->len - done : CHUNK_LEN;
+		ULONG count = 0;
+		FT_STATUS status;
+
+		if (t->write) {
+			status = FT_WritePipeEx(handle, channel - 1, buf, len,
+					&count, CHUNK_TIMEOUT);
+		} else {
+			if (!done && !sequential && out_cnt && len > RTT_PROBE_LEN)
+				len = RTT_PROBE_LEN;
+			status = FT_ReadPipeEx(handle, channel - 1, buf, len,
+					&count, CHUNK_TIMEOUT);
+			if (!done && count)
+				clock_gettime(CLOCK_MONOTONIC, &t->first);
+		}
+		done += count;
+		__atomic_store_n(&t->done, done, __ATOMIC_RELAXED);
+		if (FT_OK != status && FT_TIMEOUT != status) {
+			printf("%s failed at %llu bytes, status %d\r\n", t->name,
+					(unsigned long long)done, status);
+			t->failed = true;
+			break;
+		}
 	}
+	clock_gettime(CLOCK_MONOTONIC, &t->end);
+	buffer_pool_put(pool, buf);
+	__atomic_store_n(&t->finished, true, __ATOMIC_RELEASE);
+	return NULL;
+}
 
-	UCHAR ch;
+static void show_progress(const struct transfer *t, int cnt)
+{
+	for (int i = 0; i < cnt; i++)
+		printf("%s%s %.2f/%.2fMiB", i ? ", " : "", t[i].name,
+				__atomic_load_n(&t[i].done, __ATOMIC_RELAXED) /
+				1024.0 / 1024, t[i].len / 1024.0 / 1024);
+	printf("\r\n");
+}
 
-	if (channel == 1) {
-		if (out_cnt == 0)
-			ch = CONFIGURATION_CHANNEL_CONFIG_1_INPIPE;
-		else if (in_cnt == 0)
-			ch = CONFIGURATION_CHANNEL_CONFIG_1_OUTPIPE;
-		else
-			ch = CONFIGURATION_CHANNEL_CONFIG_1;
-	} else if (channel == 3 || channel == 4)
-		ch = CONFIGURATION_CHANNEL_CONFIG_4;
-	else if (channel == 2)
-		ch = CONFIGURATION_CHANNEL_CONFIG_2;
-	else
-		goto _Exit;
+static double rate(uint64_t bytes, double seconds)
+{
+	return seconds > 0 ? bytes / seconds / 1024 / 1024 : 0.0;
+}
 
-	if (cfg.ChannelConfig == ch && current_is_600mode == ft600_mode &&
-			!needs_update)
-		goto _Exit;
-	cfg.ChannelConfig = ch;
-	cfg.FIFOMode = ft600_mode ? CONFIGURATION_FIFO_MODE_600 :
-		CONFIGURATION_FIFO_MODE_245;
-	if (FT_OK != FT_SetChipConfiguration(handle, &cfg)) {
-		printf("Failed to set chip conf\r\n");
-	} else
-		printf("Configuration changed CH:%d ft600:%d\r\n", ch, ft600_mode);
-	FT_Close(handle);
-
-	sleep(3);
-	get_device_lists();
-	return rev_a_chip;
+static void show_result(const struct transfer *t)
+{
+	double seconds = seconds_between(&t->start, &t->end);
 
-_Exit:
-	FT_Close(handle);
-	return rev_a_chip;
+	printf("%s %llu bytes in %.3fs, %.2fMiB/s%s\r\n",
+			t->write ? "Wrote" : "Read", (unsigned long long)t->done,
+			seconds, rate(t->done, seconds),
+			t->done < t->len ? " (incomplete)" : "");
 }
 
-static void show_help(const char *bin)
+/* Combined rate over the span both directions were running, and the
+ * time from the first write being submitted to the first data read */
+static void show_duplex(const struct transfer *tx, const struct transfer *rx)
 {
-	printf("Usage: %s <write length> <read length> <channel> [mode]\r\n", bin);
-	printf("  length: in bytes\r\n");
-	printf("  channel: which channel to use, must be 1 for FT245 mode, [1, 4] for FT600 mode\r\n");
-	printf("  mode: set fifo mode. 0 = FT245 mode (default), 1 = FT600 mode\r\n");
+	const struct timespec *end = seconds_between(&tx->end, &rx->end) > 0 ?
+		&rx->end : &tx->end;
+	double seconds = seconds_between(&tx->start, end);
+
+	printf("Full duplex: %.2fMiB/s combined over %.3fs\r\n",
+			rate(tx->done + rx->done, seconds), seconds);
+	if (rx->done)
+		printf("Round trip: %.3fms from first byte written to first byte read\r\n",
+				seconds_between(&tx->first, &rx->first) * 1000);
 }
 
-static void turn_off_thread_safe(void)
+static void sig_hdlr(int signum)
 {
-	FT_TRANSFER_CONF conf;
-
-	memset(&conf, 0, sizeof(FT_TRANSFER_CONF));
-	conf.wStructSize = sizeof(FT_TRANSFER_CONF);
-	conf.pipe[FT_PIPE_DIR_IN].fNonThreadSafeTransfer = true;
-	conf.pipe[FT_PIPE_DIR_OUT].fNonThreadSafeTransfer = true;
-	for (DWORD i = 0; i < 4; i++)
-		FT_SetTransferParams(&conf, i);
+	(void)signum;
+	do_exit = 1;
 }
 
-
-static bool validate_arguments(int argc, char *argv[])
+/* Report progress every second until the threads are done */
+static bool wait_transfers(struct transfer *t, pthread_t *threads, int cnt)
 {
-	if (argc != 5)
-		return false;
-
-	int val = atoi(argv[4]);
-	if (val != 0 && val != 1)
-		return false;
-	ft600_mode = (bool)val;
+	bool ok = true;
+
+	for (int ticks = 1;; ticks++) {
+		const struct timespec tick = { 0, 100 * 1000 * 1000 };
+		bool running = false;
+
+		for (int i = 0; i < cnt; i++)
+			running |= !__atomic_load_n(&t[i].finished, __ATOMIC_ACQUIRE);
+		if (!running)
+			break;
+		nanosleep(&tick, NULL);
+		if (ticks % 10 == 0)
+			show_progress(t, cnt);
+	}
 
-	in_cnt = atol(argv[1]);
-	out_cnt = atol(argv[2]);
-	if (in_cnt == 0 && out_cnt == 0)
-		return false;
+	for (int i = 0; i < cnt; i++) {
+		pthread_join(threads[i], NULL);
+		show_result(&t[i]);
+		ok = ok && !t[i].failed && t[i].done == t[i].len;
+	}
+	return ok;
+}
 
-	if (!ft600_mode)
-		channel = 1;
-	else {
-		channel = atoi(argv[3]);
-		if (channel < 1 || channel > 4)
-			return false;
+/* Write and read each from its own pool slot, both at once or with -s
+ * one after the other */
+static bool run_transfers(void)
+{
+	struct transfer t[2];
+	pthread_t threads[2];
+	int cnt = 0;
+	int started = 0;
+	bool ok = true;
+
+	memset(t, 0, sizeof(t));
+	if (out_cnt) {
+		t[cnt].name = "TX";
+		t[cnt].write = true;
+		t[cnt++].len = out_cnt;
+	}
+	if (in_cnt) {
+		t[cnt].name = "RX";
+		t[cnt++].len = in_cnt;
 	}
+	for (int i = 0; i < cnt && ok; i++) {
+		if (pthread_create(&threads[i], NULL, run_transfer, &t[i])) {
+			printf("Failed to start %s thread\r\n", t[i].name);
+			do_exit = 1;
+			ok = false;
+			break;
+		}
+		started++;
+		if (sequential) {
+			ok = wait_transfers(&t[i], &threads[i], 1);
+			started--;
+		}
+	}
+	if (!sequential)
+		ok = wait_transfers(t, threads, started) && ok;
 
-	return true;
+	if (!sequential && cnt == 2 && started == 2)
+		show_duplex(&t[0], &t[1]);
+	return ok;
 }
 
 int main(int argc, char *argv[])
@@ -209,56 +270,42 @@ int main(int argc, char *argv[])
 	FT_SetDebug(NULL, FT_LOG_VERBOSE);
 #endif /* FT_PRIVATE_API */
 
-	get_version();
+	show_versions();
 
 	if (!validate_arguments(argc, argv)) {
 		show_help(argv[0]);
 		return 1;
 	}
 
-	if (!get_device_lists())
-		return 1;
-
-	bool rev_a_chip = set_channel_config();
-
-	/* Must be called before FT_Create is called */
-	turn_off_thread_safe();
+	struct session_config cfg;
+	struct device_session *session;
 
-	FT_HANDLE handle;
+	session_config_init(&cfg);
+	cfg.channel_config = channel_config();
+	cfg.fifo_600mode = ft600_mode;
+	cfg.clock = -1;
+	session = device_session_open(&cfg);
+	if (!session)
+		return 1;
 
-	FT_Create(0, FT_OPEN_BY_INDEX, &handle);
+	handle = device_session_handle(session);
 
-	if (!handle) {
-		printf("Failed to create device\r\n");
-		return -1;
-	}
 	printf("Device created\r\n");
 
-	uint8_t *in_buf = (uint8_t *)malloc(in_cnt);
-	uint8_t *out_buf = (uint8_t *)malloc(out_cnt);
-	DWORD count;
+	uint64_t max_len = in_cnt > out_cnt ? in_cnt : out_cnt;
+	bool ok = false;
 
-	if (FT_OK != FT_WritePipeEx(handle, channel - 1, out_buf, out_cnt,
-				&count, 0xFFFFFFFF)) {
-		printf("Failed to write\r\n");
+	pool = buffer_pool_create(max_len < CHUNK_LEN ? max_len : CHUNK_LEN, 2);
+	if (!pool) {
+		printf("Failed to allocate buffers\r\n");
 		goto _Exit;
 	}
-	printf("Wrote %d bytes\r\n", count);
-
-	if (FT_OK != FT_ReadPipeEx(handle, channel - 1, in_buf, in_cnt,
-				&count, 0xFFFFFFFF)) {
-		printf("Failed to read\r\n");
-		goto _Exit;
-	}
-	printf("Read %d bytes\r\n", count);
+	signal(SIGINT, sig_hdlr);
+	ok = run_transfers();
 
 _Exit:
-	free(in_buf);
-	free(out_buf);
-
-	/* Workaround for FT600/FT601 Rev.A device: Stop session before exit */
-	if (rev_a_chip)
-		FT_ResetDevicePort(handle);
-	FT_Close(handle);
-	return 0;
+	buffer_pool_destroy(pool);
+
+	device_session_close(session);
+	return ok ? 0 : 1;
 }
@@ -0,0 +1,170 @@
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include "mapped_file.h"
+#include "pattern_check.h"
+
+using namespace std;
+
+/* Samples per work unit, breaks are printed in file order per unit */
+static const size_t CHUNK_SAMPLES = 4*1024*1024;
+static unsigned thread_cnt;
+static const char *file_name = "dumpfile.264";
+
+struct sample_break {
+	size_t idx;
+	int16_t act;
+	int16_t oldact;
+};
+
+struct chunk_result {
+	bool done;
+	vector<sample_break> breaks;
+};
+
+static mapped_file dump;
+static size_t sample_cnt;
+static vector<chunk_result> results;
+static atomic<size_t> next_chunk;
+static size_t printed_chunks;
+static mutex result_lock;
+static condition_variable result_cv;
+
+static void check_chunk(size_t chunk, vector<sample_break> &breaks)
+{
+	const uint8_t *s = (const uint8_t *)dump.data();
+	size_t i = chunk * CHUNK_SAMPLES;
+	size_t end = min(i + CHUNK_SAMPLES, sample_cnt);
+	int16_t prev = i ? counter16_sample(s, i - 1) : 0;
+
+	while (i < end) {
+		size_t run = counter16_find_break(s + i * 2, end - i, prev);
+
+		if (run)
+			prev = counter16_sample(s, i + run - 1);
+		i += run;
+		if (i == end)
+			break;
+		breaks.push_back(sample_break{i, counter16_sample(s, i), prev});
+		prev = counter16_sample(s, i++);
+	}
+}
+
+static void check_worker(void)
+{
+	size_t chunks = results.size();
+
+	for (;;) {
+		size_t chunk = next_chunk++;
+		vector<sample_break> breaks;
+
+		if (chunk >= chunks)
+			break;
+		{
+			/* Bound the memory held by unprinted results */
+			unique_lock<mutex> lk(result_lock);
+			result_cv.wait(lk, [chunk] {
+				return chunk < printed_chunks + 4 * thread_cnt;
+			});
+		}
+		check_chunk(chunk, breaks);
+
+		lock_guard<mutex> lk(result_lock);
+		results[chunk].breaks.swap(breaks);
+		results[chunk].done = true;
+		result_cv.notify_all();
+	}
+}
+
+static size_t print_results(void)
+{
+	size_t total = 0;
+
+	for (size_t chunk = 0; chunk < results.size(); chunk++) {
+		vector<sample_break> breaks;
+		{
+			unique_lock<mutex> lk(result_lock);
+			result_cv.wait(lk, [chunk] { return results[chunk].done; });
+			breaks.swap(results[chunk].breaks);
+			printed_chunks = chunk + 1;
+			result_cv.notify_all();
+		}
+		for (const sample_break &b : breaks)
+			printf("%zu  ->  %d - %d = %d  (offset 0x%zx)\r\n", b.idx,
+					b.act, b.oldact, b.act - b.oldact, b.idx * 2);
+		total += breaks.size();
+	}
+	return total;
+}
+
+static void show_help(const char *bin)
+{
+	printf("Check the 16-bit counter pattern of a zynqtest capture\r\n");
+	printf("Usage: %s [options] [file]\r\n", bin);
+	printf("  file: capture to check (default %s)\r\n", file_name);
+	printf("Options:\r\n");
+	printf("  -j threads: worker threads (default one per CPU)\r\n");
+}
+
+static bool validate_arguments(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		switch (opt) {
+		case 'j':
+			thread_cnt = atoi(optarg);
+			if (thread_cnt < 1)
+				return false;
+			break;
+		default:
+			return false;
+		}
+	}
+	if (argc - optind > 1)
+		return false;
+	if (argc - optind == 1)
+		file_name = argv[optind];
+	if (!thread_cnt)
+		thread_cnt = max(thread::hardware_concurrency(), 1U);
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	if (!validate_arguments(argc, argv)) {
+		show_help(argv[0]);
+		return 1;
+	}
+
+	if (!dump.map(file_name)) {
+		printf("Failed to map %s\r\n", file_name);
+		return 1;
+	}
+
+	auto start = chrono::steady_clock::now();
+
+	sample_cnt = dump.size() / 2;
+	results.resize((sample_cnt + CHUNK_SAMPLES - 1) / CHUNK_SAMPLES);
+
+	vector<thread> workers;
+	for (unsigned i = 0; i < thread_cnt; i++)
+		workers.push_back(thread(check_worker));
+	size_t breaks = print_results();
+	for (thread &t : workers)
+		t.join();
+
+	double seconds = chrono::duration<double>(
+			chrono::steady_clock::now() - start).count();
+	printf("%zu samples, %zu discontinuities, %.2fMiB/s\r\n", sample_cnt,
+			breaks, dump.size() / seconds / 1024 / 1024);
+	return breaks != 0;
+}
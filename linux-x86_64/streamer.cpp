@@ -4,316 +4,1172 @@
 #include <chrono>
 #include <csignal>
 #include <cstring>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
 #include "ftd3xx.h"
+#include "channel_stats.h"
+#include "latency_histogram.h"
+#include "transfer_profile.h"
+#include "device_session.h"
+#include "thread_placement.h"
+#include "buffer_pool.h"
+#include "data_notifier.h"
+#include "pipe_events.h"
+#include "write_coalescer.h"
+#if __cplusplus >= 202002L
+#include "co_transfer.h"
+#endif
 
 using namespace std;
 
 static bool do_exit;
 static bool fifo_600mode;
-static atomic_int tx_count;
-static atomic_int rx_count;
+static device_stats stats;
 static uint8_t in_ch_cnt;
 static uint8_t out_ch_cnt;
 static thread measure_thread;
-static thread write_thread;
-static thread read_thread;
-static const int BUFFER_LEN = 32*1024;
+static vector<thread> write_threads;
+static vector<thread> read_threads;
+static bool thread_per_channel; /* -t */
+static int buffer_len = 32*1024;
+static const int MAX_QUEUE_DEPTH = 64;
+static int queue_depth; /* 0 = synchronous FT_ReadPipeEx loop */
+static int run_seconds; /* 0 = run until SIGINT */
+static transfer_profile profile;
+static const char *tune_path; /* -T: sweep transfer parameters into it */
+static const int TUNE_SECONDS = 3;
+static thread_placement placement; /* -a */
+static int stream_frame;    /* -S size: fixed size frames */
+static bool stream_capture; /* -S capture: one unbounded stream */
+static bool event_reads; /* -e: read when notified instead of polling */
+static data_notifier notifier;
+static int duty_cycle; /* -u: percent of each period the writer sends */
+static const chrono::milliseconds DUTY_PERIOD(100);
+static bool epoll_loop; /* -E: one thread drives all pipes */
+static bool coroutines; /* -C (streamer_co): -E with one task per transfer */
+static int message_len;  /* -m: write messages of this size */
+static int message_rate; /* -r: messages per second per channel, 0 = max */
+static int coalesce_us = -1; /* -g: gather messages, flush deadline */
+static const chrono::milliseconds MESSAGE_BACKLOG(10);
+static atomic<uint64_t> messages_sent;
+static atomic<uint64_t> messages_dropped; /* queued when a batch failed */
+static atomic<uint64_t> batches_full;
+static atomic<uint64_t> batches_due;
+
+/* With -u, where each write's data ends in the stream and when it was
+ * queued, so RX latency is how long the data took to come back rather
+ * than how long a read call waited */
+struct delivery_log {
+	mutex lock;
+	deque<pair<uint64_t, chrono::steady_clock::time_point>> writes;
+	uint64_t written;  /* bytes, end of the newest write */
+	uint64_t received;
+};
+static delivery_log delivery[4];
+static const char *const thread_roles[] = {
+	"read", "write", "producer", "measure", "loop", NULL
+};
+
+static device_latency latency;
+static atomic_int tx_underrun;
+static atomic_int tx_stall;
+static uint64_t sum_underrun;
+static uint64_t sum_stall;
+static chrono::steady_clock::time_point start_time;
+/* When the run was asked to stop, before the threads wind down */
+static chrono::steady_clock::time_point stop_time;
+
+/* Length of the run for the summary rates: up to stop_time, not past a
+ * writer still stuck in a timeout after the reader stopped */
+static double run_length(void)
+{
+	auto end = stop_time == chrono::steady_clock::time_point() ?
+		chrono::steady_clock::now() : stop_time;
+
+	return chrono::duration<double>(end - start_time).count();
+}
 
 static void show_throughput(FT_HANDLE handle)
 {
-	auto next = chrono::steady_clock::now() + chrono::seconds(1);;
 	(void)handle;
+	placement.apply("measure");
+
+	auto next = chrono::steady_clock::now() + chrono::seconds(1);
 
 	while (!do_exit) {
 		this_thread::sleep_until(next);
 		next += chrono::seconds(1);
 
-		int tx = tx_count.exchange(0);
-		int rx = rx_count.exchange(0);
+		stats.show_rates(out_ch_cnt, in_ch_cnt);
+		if (out_ch_cnt && queue_depth) {
+			int underrun = tx_underrun.exchange(0);
+			int stall = tx_stall.exchange(0);
+
+			sum_underrun += underrun;
+			sum_stall += stall;
+			printf(" TX underrun:%d stall:%d", underrun, stall);
+		}
+		latency.show_interval("TX", STATS_TX, out_ch_cnt);
+		latency.show_interval("RX", STATS_RX, in_ch_cnt);
+		printf("\r\n");
+
+		if (run_seconds && next - start_time >=
+				chrono::seconds(run_seconds + 1)) {
+			stop_time = chrono::steady_clock::now();
+			do_exit = true;
+		}
+	}
+}
+
+static const char *mode_name(stats_dir dir)
+{
+	return coroutines ? "coroutines" : epoll_loop ? "epoll" :
+		dir == STATS_TX && coalesce_us >= 0 ? "coalesced" :
+		queue_depth ? "overlapped" : "synchronous";
+}
+
+static void show_summary(const char *name, stats_dir dir, uint8_t ch_cnt)
+{
+	uint64_t bytes = 0, requests = 0;
+	double seconds = run_length();
+
+	for (uint8_t channel = 0; channel < ch_cnt; channel++) {
+		stats_sample total = stats.total(dir, channel);
 
-		printf("TX:%.2fMiB/s RX:%.2fMiB/s, total:%.2fMiB\r\n",
-			(float)tx/1000/1000, (float)rx/1000/1000,
-			(float)(tx+ rx)/1000/1000);
+		bytes += total.bytes;
+		requests += total.transfers;
 	}
+
+	const latency_snapshot &lat = latency.total(dir, ch_cnt);
+
+	printf("%s %s: %.2fMiB/s sustained over %.1fs, %lu requests, "
+			"latency avg:%.1fus p99:%.1fus p99.9:%.1fus max:%.1fus\r\n",
+			name, mode_name(dir),
+			bytes / seconds / 1000 / 1000, seconds,
+			(unsigned long)requests, lat.avg_ns() / 1000.0,
+			lat.percentile(0.99) / 1000.0,
+			lat.percentile(0.999) / 1000.0, lat.max_ns / 1000.0);
 }
 
-static void write_test(FT_HANDLE handle)
+static void show_underrun_summary(void)
 {
-	unique_ptr<uint8_t[]> buf(new uint8_t[BUFFER_LEN]);
+	sum_underrun += tx_underrun.exchange(0);
+	sum_stall += tx_stall.exchange(0);
+	printf("TX %s: %lu underrun(s)", mode_name(STATS_TX),
+			(unsigned long)sum_underrun);
+	/* Only -q has producer threads */
+	if (!epoll_loop && !coroutines)
+		printf(", %lu producer stall(s)", (unsigned long)sum_stall);
+	printf("\r\n");
+}
+
+static void count_failure(stats_dir dir, uint8_t channel, FT_STATUS status)
+{
+	if (status == FT_TIMEOUT)
+		stats.channel(dir, channel).timeout();
+	else
+		stats.channel(dir, channel).error();
+}
+
+/* Logged before the write is queued: the loopback can return the data
+ * to the reader before the write call completes */
+static void log_write(uint8_t channel, ULONG len,
+		chrono::steady_clock::time_point start)
+{
+	if (!duty_cycle)
+		return;
+
+	delivery_log &log = delivery[channel];
+	lock_guard<mutex> lk(log.lock);
+
+	log.written += len;
+	log.writes.emplace_back(log.written, start);
+}
+
+static void record_write(uint8_t channel, ULONG count, ULONG len,
+		chrono::steady_clock::time_point start)
+{
+	latency.channel(STATS_TX, channel).record(start);
+	stats.channel(STATS_TX, channel).add(count);
+	if (!duty_cycle || count == len)
+		return;
+
+	delivery_log &log = delivery[channel];
+	lock_guard<mutex> lk(log.lock);
+
+	/* Short write, the data ends earlier than logged */
+	log.written -= len - count;
+	if (!log.writes.empty() && log.writes.back().second == start)
+		log.writes.back().first = log.written;
+}
+
+static void record_read(uint8_t channel, ULONG count,
+		chrono::steady_clock::time_point start)
+{
+	stats.channel(STATS_RX, channel).add(count);
+	if (!duty_cycle) {
+		latency.channel(STATS_RX, channel).record(start);
+		return;
+	}
+
+	delivery_log &log = delivery[channel];
+	lock_guard<mutex> lk(log.lock);
+
+	log.received += count;
+	while (!log.writes.empty() && log.writes.front().first <= log.received) {
+		latency.channel(STATS_RX, channel).record(log.writes.front().second);
+		log.writes.pop_front();
+	}
+}
+
+/* A streaming pipe that timed out gets its stream set again so the chip
+ * resumes, keeping the transfers queued on it. False when not streaming. */
+static bool rearm_stream(FT_HANDLE handle, UCHAR pipe)
+{
+	if (!stream_frame && !stream_capture)
+		return false;
+	return FT_OK == FT_SetStreamPipe(handle, false, false, pipe, buffer_len);
+}
+
+/* Channels [first, end) served by one reader or writer thread */
+struct channel_range {
+	uint8_t first;
+	uint8_t end;
+};
+
+/* Buffers of one reader or writer thread. Created after the thread
+ * applied its placement, so the pool is faulted in on its NUMA node. */
+static bool create_pool(buffer_pool_ptr *pool, size_t count, const char *role)
+{
+	pool->reset(buffer_pool_create(buffer_len, count));
+	if (!*pool) {
+		printf("Failed to allocate %s buffers\r\n", role);
+		do_exit = true;
+		return false;
+	}
+	printf("%s buffers: %zu x %d bytes, %s\r\n", role, count, buffer_len,
+			buffer_pool_describe(pool->get()));
+	return true;
+}
+
+static void write_test(FT_HANDLE handle, channel_range chs)
+{
+	placement.apply("write", chs.first);
+
+	buffer_pool_ptr pool;
+
+	if (!create_pool(&pool, 1, "Write"))
+		return;
+
+	uint8_t *buf = (uint8_t *)buffer_pool_get(pool.get());
+	auto period = chrono::steady_clock::now();
 
 	while (!do_exit) {
-		for (uint8_t channel = 0; channel < out_ch_cnt; channel++) {
+		if (duty_cycle && chrono::steady_clock::now() - period >=
+				DUTY_PERIOD * duty_cycle / 100) {
+			/* Burst over, idle for the rest of the period */
+			period += DUTY_PERIOD;
+			this_thread::sleep_until(period);
+		}
+		for (uint8_t channel = chs.first; channel < chs.end; channel++) {
 			ULONG count = 0;
-			if (FT_OK != FT_WritePipeEx(handle, channel,
-						buf.get(), BUFFER_LEN, &count, 1000)) {
+			auto start = chrono::steady_clock::now();
+
+			log_write(channel, buffer_len, start);
+			FT_STATUS status = FT_WritePipeEx(handle, channel,
+					buf, buffer_len, &count, 1000);
+			if (FT_TIMEOUT == status &&
+					rearm_stream(handle, 0x02 + channel)) {
+				count_failure(STATS_TX, channel, status);
+				record_write(channel, count, buffer_len, start);
+				continue;
+			}
+			if (FT_OK != status) {
+				count_failure(STATS_TX, channel, status);
 				do_exit = true;
 				break;
 			}
-			tx_count += count;
+			record_write(channel, count, buffer_len, start);
 		}
 	}
 	printf("Write stopped\r\n");
 }
 
-static void read_test(FT_HANDLE handle)
+/* A batch of -g messages is on the wire. TX latency is that of the
+ * oldest message in the batch, from being queued to written. */
+static void record_batch(uint8_t channel, const coalesced_batch &b)
 {
-	unique_ptr<uint8_t[]> buf(new uint8_t[BUFFER_LEN]);
+	for (unsigned i = 0; i < b.timeouts; i++)
+		count_failure(STATS_TX, channel, FT_TIMEOUT);
+	/* Queued behind a failed batch, the failure is already counted */
+	if (b.dropped) {
+		messages_dropped += b.messages;
+		return;
+	}
+	if (FT_OK != b.status) {
+		count_failure(STATS_TX, channel, b.status);
+		do_exit = true;
+		return;
+	}
+	latency.channel(STATS_TX, channel).record(b.first);
+	stats.channel(STATS_TX, channel).add(b.len);
+	messages_sent += b.messages;
+	if (b.full)
+		batches_full++;
+	else
+		batches_due++;
+}
+
+/* -m: message_len byte messages at message_rate per channel, each one
+ * FT_WritePipeEx, or with -g gathered into buffer_len batches */
+static void write_test_messages(FT_HANDLE handle, channel_range chs)
+{
+	placement.apply("write", chs.first);
+
+	buffer_pool_ptr pool;
+	write_coalescer gather[4];
+
+	if (!create_pool(&pool, 1, "Message"))
+		return;
+
+	uint8_t *msg = (uint8_t *)buffer_pool_get(pool.get());
+
+	for (uint8_t channel = chs.first; channel < chs.end &&
+			coalesce_us >= 0; channel++) {
+		if (!gather[channel].open(handle, channel, buffer_len,
+					chrono::microseconds(coalesce_us),
+					[channel](const coalesced_batch &b) {
+						record_batch(channel, b);
+					})) {
+			do_exit = true;
+			break;
+		}
+	}
+
+	auto period = chrono::nanoseconds(message_rate ?
+			1000000000 / message_rate : 0);
+	auto next = chrono::steady_clock::now();
 
 	while (!do_exit) {
-		for (uint8_t channel = 0; channel < in_ch_cnt; channel++) {
+		if (message_rate) {
+			auto now = chrono::steady_clock::now();
+
+			/* Messages that are due go out back to back, a sleep is
+			 * longer than the period at high rates. More than
+			 * MESSAGE_BACKLOG behind is dropped rather than sent as
+			 * one burst. */
+			next += period;
+			if (next > now)
+				this_thread::sleep_until(next);
+			else if (now - next > MESSAGE_BACKLOG)
+				next = now - MESSAGE_BACKLOG;
+		}
+		for (uint8_t channel = chs.first; channel < chs.end; channel++) {
+			if (coalesce_us >= 0) {
+				if (!gather[channel].write(msg, message_len)) {
+					do_exit = true;
+					break;
+				}
+				continue;
+			}
+
 			ULONG count = 0;
-			if (FT_OK != FT_ReadPipeEx(handle, channel,
-						buf.get(), BUFFER_LEN, &count, 1000)) {
+			auto start = chrono::steady_clock::now();
+
+			FT_STATUS status = FT_WritePipeEx(handle, channel,
+					msg, message_len, &count, 1000);
+			if (FT_OK != status) {
+				count_failure(STATS_TX, channel, status);
 				do_exit = true;
 				break;
 			}
-			rx_count += count;
+			record_write(channel, count, message_len, start);
+			messages_sent++;
 		}
 	}
-	printf("Read stopped\r\n");
+	for (uint8_t channel = chs.first; channel < chs.end; channel++)
+		gather[channel].close();
+	printf("Write stopped\r\n");
 }
 
-static void sig_hdlr(int signum)
+static void show_message_summary(void)
 {
-	switch (signum) {
-	case SIGINT:
-		do_exit = true;
-		break;
-	}
+	double seconds = run_length();
+	uint64_t writes = 0;
+
+	for (uint8_t channel = 0; channel < out_ch_cnt; channel++)
+		writes += stats.total(STATS_TX, channel).transfers;
+	printf("TX messages: %lu of %d bytes, %.0f/s, %.1f per write",
+			(unsigned long)messages_sent.load(), message_len,
+			messages_sent / seconds,
+			writes ? (double)messages_sent / writes : 0.0);
+	if (coalesce_us >= 0)
+		printf(", %lu batch(es) full, %lu by the %dus deadline",
+				(unsigned long)batches_full.load(),
+				(unsigned long)batches_due.load(), coalesce_us);
+	if (messages_dropped)
+		printf(", %lu dropped after a failed write",
+				(unsigned long)messages_dropped.load());
+	printf("\r\n");
 }
 
-static void test_gpio(HANDLE handle)
+static void read_test(FT_HANDLE handle, channel_range chs)
 {
-#define GPIO(x) (1 << (x))
-#define GPIO_OUT(x) (1 << (x))
-#define GPIO_HIGH(x) (1 << (x))
+	placement.apply("read", chs.first);
 
-	DWORD dwMask = GPIO(0) | GPIO(1) | GPIO(2);
-	DWORD dwDirection = GPIO_OUT(0) | GPIO_OUT(1) |GPIO_OUT(2);
-	DWORD dwLevel = GPIO_HIGH(0) | GPIO_HIGH(1) |GPIO_HIGH(2);
+	buffer_pool_ptr pool;
 
-	if (FT_NOT_SUPPORTED == FT_EnableGPIO(handle, dwMask, dwDirection)) {
-		printf("FT_EnableGPIO not implemented\r\n");
-		return;
-	}
-	if (FT_OK != FT_WriteGPIO(handle, dwMask, dwLevel)) {
-		printf("FT_WriteGPIO not implemented\r\n");
+	if (!create_pool(&pool, 1, "Read"))
 		return;
+
+	uint8_t *buf = (uint8_t *)buffer_pool_get(pool.get());
+
+	while (!do_exit) {
+		for (uint8_t channel = chs.first; channel < chs.end; channel++) {
+			ULONG count = 0;
+			auto start = chrono::steady_clock::now();
+
+			FT_STATUS status = FT_ReadPipeEx(handle, channel,
+					buf, buffer_len, &count, 1000);
+			if (FT_TIMEOUT == status &&
+					rearm_stream(handle, 0x82 + channel)) {
+				count_failure(STATS_RX, channel, status);
+				record_read(channel, count, start);
+				continue;
+			}
+			if (FT_OK != status) {
+				count_failure(STATS_RX, channel, status);
+				do_exit = true;
+				break;
+			}
+			record_read(channel, count, start);
+		}
 	}
-	printf("Change all GPIOs to output high\r\n");
-	if (FT_OK != FT_ReadGPIO(handle, &dwLevel)) {
-		printf("FT_ReadGPIO not implemented\r\n");
+	printf("Read stopped\r\n");
+}
+
+/* Sleep until the notification callback reports data on one of the
+ * channels, then read what is waiting, a buffer at a time, until the
+ * channel's unread count is back to 0 */
+static void read_test_notified(FT_HANDLE handle, channel_range chs)
+{
+	placement.apply("read", chs.first);
+
+	buffer_pool_ptr pool;
+
+	if (!create_pool(&pool, 1, "Read"))
 		return;
+
+	uint8_t *buf = (uint8_t *)buffer_pool_get(pool.get());
+
+	while (!do_exit) {
+		uint8_t channel;
+		ULONG left = notifier.wait(chs.first, chs.end, &channel,
+				chrono::milliseconds(100));
+
+		while (left && !do_exit) {
+			ULONG len = min<ULONG>(left, buffer_len);
+			ULONG count = 0;
+			auto start = chrono::steady_clock::now();
+
+			FT_STATUS status = FT_ReadPipeEx(handle, channel,
+					buf, len, &count, 1000);
+			if (FT_OK != status)
+				count_failure(STATS_RX, channel, status);
+			if (FT_OK != status && FT_TIMEOUT != status) {
+				do_exit = true;
+				break;
+			}
+			notifier.consumed(channel, count);
+			record_read(channel, count, start);
+			if (count < len)
+				break;
+			left = notifier.unread(channel);
+		}
 	}
-	for (int i = 0; i < 3; i++)
-		printf("GPIO%d level is %s\r\n", i,
-				dwLevel & GPIO_HIGH(i) ? "high" : "low");
+	printf("Read stopped\r\n");
 }
 
-static void register_signals(void)
+struct overlapped_request {
+	OVERLAPPED ov;
+	uint8_t *buf;
+	chrono::steady_clock::time_point submitted;
+	bool pending;
+};
+
+static bool submit_read(FT_HANDLE handle, uint8_t channel,
+		overlapped_request &req)
 {
-	signal(SIGINT, sig_hdlr);
+	ULONG count = 0;
+
+	req.submitted = chrono::steady_clock::now();
+	FT_STATUS status = FT_ReadPipe(handle, 0x82 + channel, req.buf,
+			buffer_len, &count, &req.ov);
+	req.pending = status == FT_IO_PENDING || status == FT_OK;
+	return req.pending;
 }
 
-static void get_version(void)
+/* Keep queue_depth reads in flight on every channel and resubmit each
+ * request as soon as it completes, so the pipe never idles between calls */
+static void read_test_overlapped(FT_HANDLE handle, channel_range chs)
 {
-	DWORD dwVersion;
+	placement.apply("read", chs.first);
+
+	vector<vector<overlapped_request>> rings(in_ch_cnt);
+	buffer_pool_ptr pool;
+
+	if (!create_pool(&pool, (chs.end - chs.first) * queue_depth, "Read"))
+		return;
+	for (uint8_t channel = chs.first; channel < chs.end; channel++) {
+		rings[channel] = vector<overlapped_request>(queue_depth);
+		for (overlapped_request &req : rings[channel]) {
+			req.buf = (uint8_t *)buffer_pool_get(pool.get());
+			req.pending = false;
+			if (FT_OK != FT_InitializeOverlapped(handle, &req.ov)) {
+				printf("Failed to initialize overlapped\r\n");
+				do_exit = true;
+			}
+		}
+		FT_SetPipeTimeout(handle, 0x82 + channel, 1000);
+	}
+
+	for (uint8_t channel = chs.first; channel < chs.end && !do_exit;
+			channel++)
+		for (overlapped_request &req : rings[channel])
+			if (!submit_read(handle, channel, req)) {
+				do_exit = true;
+				break;
+			}
 
-	FT_GetDriverVersion(NULL, &dwVersion);
-	printf("Driver version:%d.%d.%d.%d\r\n", dwVersion >> 24,
-			(uint8_t)(dwVersion >> 16), (uint8_t)(dwVersion >> 8),
-			dwVersion & 0xFF);
+	for (int idx = 0; !do_exit; idx = (idx + 1) % queue_depth) {
+		for (uint8_t channel = chs.first; channel < chs.end; channel++) {
+			overlapped_request &req = rings[channel][idx];
+			ULONG count = 0;
 
-	FT_GetLibraryVersion(&dwVersion);
-	printf("Library version:%d.%d.%d\r\n", dwVersion >> 24,
-			(uint8_t)(dwVersion >> 16), dwVersion & 0xFFFF);
+			FT_STATUS status = FT_GetOverlappedResult(handle, &req.ov,
+					&count, true);
+			req.pending = false;
+			if (FT_OK != status)
+				count_failure(STATS_RX, channel, status);
+			if (FT_TIMEOUT == status)
+				rearm_stream(handle, 0x82 + channel);
+			if (FT_OK != status && FT_TIMEOUT != status) {
+				do_exit = true;
+				break;
+			}
+			latency.channel(STATS_RX, channel).record(req.submitted);
+			stats.channel(STATS_RX, channel).add(count);
+			if (!do_exit && !submit_read(handle, channel, req)) {
+				do_exit = true;
+				break;
+			}
+		}
+	}
+
+	for (uint8_t channel = chs.first; channel < chs.end; channel++) {
+		FT_AbortPipe(handle, 0x82 + channel);
+		for (overlapped_request &req : rings[channel]) {
+			ULONG count;
+
+			if (req.pending)
+				FT_GetOverlappedResult(handle, &req.ov, &count, true);
+			FT_ReleaseOverlapped(handle, &req.ov);
+		}
+	}
+	printf("Read stopped\r\n");
 }
 
-static void get_vid_pid(FT_HANDLE handle)
+struct write_slot {
+	OVERLAPPED ov;
+	uint8_t *buf;
+	chrono::steady_clock::time_point submitted;
+	atomic_bool filled;
+	bool pending;
+};
+
+struct write_ring {
+	vector<write_slot> slots;
+	size_t fill_idx;     /* next slot the producer fills */
+	size_t submit_idx;   /* next slot to queue to the pipe */
+	size_t complete_idx; /* oldest slot in flight */
+	int in_flight;
+	uint32_t sequence;   /* producer pattern */
+};
+
+/* Producer: refill every slot the writer has handed back with an
+ * incrementing 32-bit sequence so the loopback data stays checkable */
+static void produce_writes(vector<write_ring> *rings, int index)
 {
-	WORD vid, pid;
+	placement.apply("producer", index);
+	while (!do_exit) {
+		bool idle = true;
 
-	if (FT_OK != FT_GetVIDPID(handle, &vid, &pid))
-		return;
-	printf("VID:%04X PID:%04X\r\n", vid, pid);
+		for (write_ring &ring : *rings) {
+			write_slot &slot = ring.slots[ring.fill_idx];
+
+			if (slot.filled.load(memory_order_acquire))
+				continue;
+
+			uint32_t *p = (uint32_t *)slot.buf;
+			for (size_t i = 0; i < buffer_len / sizeof(uint32_t); i++)
+				p[i] = ring.sequence++;
+			slot.filled.store(true, memory_order_release);
+			ring.fill_idx = (ring.fill_idx + 1) % ring.slots.size();
+			idle = false;
+		}
+		if (idle)
+			this_thread::sleep_for(chrono::microseconds(50));
+	}
 }
 
-static void turn_off_all_pipes(void)
+/* Keep queue_depth writes in flight on every OUT channel. The ring holds
+ * twice as many buffers as are in flight, so the producer can fill the
+ * next batch while the current one is on the wire. */
+static void write_test_overlapped(FT_HANDLE handle, channel_range chs)
 {
-	FT_TRANSFER_CONF conf;
+	placement.apply("write", chs.first);
+
+	vector<write_ring> rings(chs.end - chs.first);
+	buffer_pool_ptr pool;
+
+	if (!create_pool(&pool, rings.size() * queue_depth * 2, "Write"))
+		return;
+	for (uint8_t channel = chs.first; channel < chs.end; channel++) {
+		write_ring &ring = rings[channel - chs.first];
+
+		ring.slots = vector<write_slot>(queue_depth * 2);
+		ring.fill_idx = ring.submit_idx = ring.complete_idx = 0;
+		ring.in_flight = 0;
+		ring.sequence = 0;
+		for (write_slot &slot : ring.slots) {
+			slot.buf = (uint8_t *)buffer_pool_get(pool.get());
+			slot.filled = false;
+			slot.pending = false;
+			if (FT_OK != FT_InitializeOverlapped(handle, &slot.ov)) {
+				printf("Failed to initialize overlapped\r\n");
+				do_exit = true;
+			}
+		}
+		FT_SetPipeTimeout(handle, 0x02 + channel, 1000);
+	}
+
+	thread producer(produce_writes, &rings, chs.first);
 
-	memset(&conf, 0, sizeof(FT_TRANSFER_CONF));
-	conf.wStructSize = sizeof(FT_TRANSFER_CONF);
-	conf.pipe[FT_PIPE_DIR_IN].fPipeNotUsed = true;
-	conf.pipe[FT_PIPE_DIR_OUT].fPipeNotUsed = true;
-	for (DWORD i = 0; i < 4; i++)
-		FT_SetTransferParams(&conf, i);
+	while (!do_exit) {
+		for (uint8_t channel = chs.first; channel < chs.end && !do_exit;
+				channel++) {
+			write_ring &ring = rings[channel - chs.first];
+
+			while (ring.in_flight < queue_depth) {
+				write_slot &slot = ring.slots[ring.submit_idx];
+				ULONG count = 0;
+
+				if (!slot.filled.load(memory_order_acquire)) {
+					tx_stall++;
+					break;
+				}
+				slot.submitted = chrono::steady_clock::now();
+				FT_STATUS status = FT_WritePipe(handle, 0x02 + channel,
+						slot.buf, buffer_len, &count, &slot.ov);
+				if (status != FT_IO_PENDING && status != FT_OK) {
+					printf("Failed to queue write on channel %d, "
+							"status:%d\r\n", channel, status);
+					count_failure(STATS_TX, channel, status);
+					do_exit = true;
+					break;
+				}
+				slot.pending = true;
+				ring.in_flight++;
+				ring.submit_idx = (ring.submit_idx + 1) % ring.slots.size();
+			}
+			if (!ring.in_flight) {
+				/* Nothing queued, wait for the producer */
+				this_thread::yield();
+				continue;
+			}
+
+			write_slot &slot = ring.slots[ring.complete_idx];
+			ULONG count = 0;
+
+			FT_STATUS status = FT_GetOverlappedResult(handle, &slot.ov,
+					&count, true);
+			slot.pending = false;
+			if (FT_OK != status)
+				count_failure(STATS_TX, channel, status);
+			if (FT_TIMEOUT == status)
+				rearm_stream(handle, 0x02 + channel);
+			if (FT_OK != status && FT_TIMEOUT != status) {
+				do_exit = true;
+				break;
+			}
+			latency.channel(STATS_TX, channel).record(slot.submitted);
+			stats.channel(STATS_TX, channel).add(count);
+			if (--ring.in_flight == 0)
+				tx_underrun++;
+			slot.filled.store(false, memory_order_release);
+			ring.complete_idx = (ring.complete_idx + 1) % ring.slots.size();
+		}
+	}
+
+	producer.join();
+	for (uint8_t channel = chs.first; channel < chs.end; channel++) {
+		FT_AbortPipe(handle, 0x02 + channel);
+		for (write_slot &slot : rings[channel - chs.first].slots) {
+			ULONG count;
+
+			if (slot.pending)
+				FT_GetOverlappedResult(handle, &slot.ov, &count, true);
+			FT_ReleaseOverlapped(handle, &slot.ov);
+		}
+	}
+	printf("Write stopped\r\n");
 }
 
-static bool get_device_lists(int timeout_ms)
+/* -E -e: an IN pipe's reads ask for what the notifier reported and no
+ * read queued yet covers, so they complete without waiting for data */
+struct notified_pipe {
+	vector<uint8_t *> idle; /* buffers not on the pipe */
+	ULONG queued = 0;       /* bytes the reads in flight ask for */
+};
+
+static void queue_notified(pipe_events &pipe, uint8_t channel,
+		notified_pipe &np)
 {
-	DWORD count;
-	FT_DEVICE_LIST_INFO_NODE nodes[16];
+	ULONG left = notifier.unread(channel);
 
-	chrono::steady_clock::time_point const timeout =
-		chrono::steady_clock::now() +
-		chrono::milliseconds(timeout_ms);
+	while (!do_exit && left > np.queued && !np.idle.empty()) {
+		ULONG len = min<ULONG>(left - np.queued, buffer_len);
 
-	do {
-		if (FT_OK == FT_CreateDeviceInfoList(&count))
+		/* The length rides along to be taken off np.queued again */
+		if (!pipe.submit(np.idle.back(), len, (void *)(uintptr_t)len)) {
+			do_exit = true;
 			break;
-		this_thread::sleep_for(chrono::microseconds(10));
-	} while (chrono::steady_clock::now() < timeout);
-	printf("Total %u device(s)\r\n", count);
-	if (!count)
-		return false;
+		}
+		np.idle.pop_back();
+		np.queued += len;
+	}
+}
 
-	if (FT_OK != FT_GetDeviceInfoList(nodes, &count))
-		return false;
-	return true;
+static void serve_notified(pipe_events &pipe, uint8_t channel,
+		notified_pipe &np)
+{
+	pipe_completion done;
+
+	while (!do_exit && pipe.complete(&done)) {
+		if (FT_OK != done.status)
+			count_failure(STATS_RX, channel, done.status);
+		if (FT_OK != done.status && FT_TIMEOUT != done.status) {
+			do_exit = true;
+			break;
+		}
+		notifier.consumed(channel, done.count);
+		np.queued -= (ULONG)(uintptr_t)done.ctx;
+		np.idle.push_back(done.buf);
+		record_read(channel, done.count, done.submitted);
+	}
+	queue_notified(pipe, channel, np);
 }
 
+/* The write pattern of -E and -C. A function of its own: GCC keeps the
+ * locals of a coroutine in its frame and does not vectorize the loop
+ * there, which cost -C several times the CPU of -E. */
+static void fill_sequence(uint32_t *p, size_t len, uint32_t *sequence)
+{
+	uint32_t seq = *sequence;
+
+	for (size_t i = 0; i < len / sizeof(uint32_t); i++)
+		p[i] = seq++;
+	*sequence = seq;
+}
 
-static bool set_ft600_channel_config(FT_60XCONFIGURATION *cfg,
-		CONFIGURATION_FIFO_CLK clock, bool is_600_mode)
+/* Collect what completed on one pipe and queue the buffers again, OUT
+ * buffers refilled with the channel's sequence like produce_writes */
+static void serve_pipe(FT_HANDLE handle, pipe_events &pipe, uint8_t channel,
+		bool in, uint32_t *sequence)
 {
-	bool needs_update = false;
-	bool current_is_600mode;
+	stats_dir dir = in ? STATS_RX : STATS_TX;
+	UCHAR ep = (in ? 0x82 : 0x02) + channel;
+	pipe_completion done;
+
+	while (!do_exit && pipe.complete(&done)) {
+		if (FT_OK != done.status)
+			count_failure(dir, channel, done.status);
+		if (FT_TIMEOUT == done.status)
+			rearm_stream(handle, ep);
+		if (FT_OK != done.status && FT_TIMEOUT != done.status) {
+			do_exit = true;
+			break;
+		}
+		latency.channel(dir, channel).record(done.submitted);
+		stats.channel(dir, channel).add(done.count);
+		if (!in) {
+			if (!pipe.queued())
+				tx_underrun++;
 
-	if (cfg->OptionalFeatureSupport &
-			CONFIGURATION_OPTIONAL_FEATURE_ENABLENOTIFICATIONMESSAGE_INCHALL) {
-		/* Notification in D3XX for Linux is implemented at OS level
-		 * Turn off notification feature in firmware */
-		cfg->OptionalFeatureSupport &=
-			~CONFIGURATION_OPTIONAL_FEATURE_ENABLENOTIFICATIONMESSAGE_INCHALL;
-		needs_update = true;
-		printf("Turn off firmware notification feature\r\n");
+			fill_sequence((uint32_t *)done.buf, buffer_len, sequence);
+		}
+		if (!pipe.submit(done.buf, buffer_len))
+			do_exit = true;
 	}
+}
+
+/* -E: this thread alone drives every pipe. Each pipe's overlapped
+ * completions, and with -e the notification callback, arrive on an
+ * eventfd and the thread sleeps in epoll_wait until one is readable. */
+static void transfer_epoll(FT_HANDLE handle)
+{
+	placement.apply("loop");
+
+	const uint32_t NOTIFY = 8;
+	int pipe_cnt = out_ch_cnt + in_ch_cnt;
+	vector<pipe_events> pipes(pipe_cnt);
+	vector<notified_pipe> notified(event_reads ? in_ch_cnt : 0);
+	uint32_t sequence[4] = { 0 };
+	buffer_pool_ptr pool;
+
+	if (!create_pool(&pool, pipe_cnt * queue_depth, "Loop"))
+		return;
 
-	if (!(cfg->OptionalFeatureSupport &
-			CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN)) {
-		/* Turn off feature not supported by D3XX for Linux */
-		cfg->OptionalFeatureSupport |=
-			CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN;
-		needs_update = true;
-		printf("disable cancel session on FIFO underrun 0x%X\r\n",
-				cfg->OptionalFeatureSupport);
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	auto watch = [ep](int fd, uint32_t tag) {
+		epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.u32 = tag;
+		return !epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+	};
+
+	if (ep < 0) {
+		printf("Failed to create epoll instance\r\n");
+		do_exit = true;
 	}
+	for (int i = 0; i < pipe_cnt && !do_exit; i++) {
+		bool in = i >= out_ch_cnt;
+		uint8_t channel = in ? i - out_ch_cnt : i;
+
+		if (!pipes[i].open(handle, (in ? 0x82 : 0x02) + channel,
+					queue_depth) || !watch(pipes[i].fd(), i)) {
+			do_exit = true;
+			break;
+		}
+		for (int n = 0; n < queue_depth; n++) {
+			uint8_t *buf = (uint8_t *)buffer_pool_get(pool.get());
 
-	if (cfg->FIFOClock != clock)
-		needs_update = true;
+			/* Notified reads are queued as data is reported */
+			if (in && event_reads) {
+				notified[channel].idle.push_back(buf);
+				continue;
+			}
+			if (!in)
+				fill_sequence((uint32_t *)buf, buffer_len,
+						&sequence[channel]);
+			if (!pipes[i].submit(buf, buffer_len)) {
+				do_exit = true;
+				break;
+			}
+		}
+	}
 
-	if (cfg->FIFOMode == CONFIGURATION_FIFO_MODE_245) {
-		printf("FIFO is running at FT245 mode\r\n");
-		current_is_600mode = false;
-	} else if (cfg->FIFOMode == CONFIGURATION_FIFO_MODE_600) {
-		printf("FIFO is running at FT600 mode\r\n");
-		current_is_600mode = true;
-	} else {
-		printf("FIFO is running at unknown mode\r\n");
-		exit(-1);
+	if (!do_exit && event_reads && in_ch_cnt &&
+			!watch(notifier.fd(), NOTIFY)) {
+		printf("Failed to watch the notification eventfd\r\n");
+		do_exit = true;
 	}
+	printf("Event loop: 1 thread, %d pipe(s) with %d transfers queued%s\r\n",
+			pipe_cnt, queue_depth, event_reads && in_ch_cnt ?
+			", notified reads" : "");
 
-	UCHAR ch;
+	while (!do_exit) {
+		epoll_event events[9];
+		int n = epoll_wait(ep, events, 9, 100);
 
-	if (in_ch_cnt == 1 && out_ch_cnt == 0)
-		ch = CONFIGURATION_CHANNEL_CONFIG_1_INPIPE;
-	else if (in_ch_cnt == 0 && out_ch_cnt == 1)
-		ch = CONFIGURATION_CHANNEL_CONFIG_1_OUTPIPE;
-	else {
-		UCHAR total = in_ch_cnt < out_ch_cnt ? out_ch_cnt : in_ch_cnt;
+		for (int e = 0; e < n && !do_exit; e++) {
+			uint32_t tag = events[e].data.u32;
 
-		if (total == 4)
-			ch = CONFIGURATION_CHANNEL_CONFIG_4;
-		else if (total == 2)
-			ch = CONFIGURATION_CHANNEL_CONFIG_2;
-		else
-			ch = CONFIGURATION_CHANNEL_CONFIG_1;
+			if (tag == NOTIFY) {
+				uint64_t signals;
 
-		if (cfg->FIFOMode == CONFIGURATION_FIFO_MODE_245 && total > 1) {
-			printf("245 mode only support single channel\r\n");
-			return false;
+				if (read(notifier.fd(), &signals, sizeof(signals)) > 0)
+					for (int ch = 0; ch < in_ch_cnt; ch++)
+						queue_notified(pipes[out_ch_cnt + ch],
+								ch, notified[ch]);
+				continue;
+			}
+
+			bool in = (int)tag >= out_ch_cnt;
+			uint8_t channel = in ? tag - out_ch_cnt : tag;
+
+			if (in && event_reads)
+				serve_notified(pipes[tag], channel, notified[channel]);
+			else
+				serve_pipe(handle, pipes[tag], channel, in,
+						&sequence[in ? 0 : tag]);
 		}
 	}
 
-	if (cfg->ChannelConfig == ch && current_is_600mode == is_600_mode &&
-			!needs_update)
-		return false;
-	cfg->ChannelConfig = ch;
-	cfg->FIFOClock = clock;
-	cfg->FIFOMode = is_600_mode ? CONFIGURATION_FIFO_MODE_600 :
-		CONFIGURATION_FIFO_MODE_245;
-	return true;
+	for (pipe_events &pipe : pipes)
+		pipe.close();
+	if (ep >= 0)
+		close(ep);
+	printf("Event loop stopped\r\n");
 }
 
+#if __cplusplus >= 202002L
+/* -C: the same pipeline as -E written as coroutines, queue_depth tasks
+ * per pipe each keeping one transfer in flight */
+static co_task read_task(FT_HANDLE handle, co_pipe &pipe, uint8_t channel,
+		span<uint8_t> buf)
+{
+	while (!do_exit) {
+		transfer_result res = co_await pipe.read(buf);
+
+		if (do_exit)
+			break;
+		if (FT_OK != res.status)
+			count_failure(STATS_RX, channel, res.status);
+		if (FT_TIMEOUT == res.status)
+			rearm_stream(handle, 0x82 + channel);
+		if (FT_OK != res.status && FT_TIMEOUT != res.status) {
+			do_exit = true;
+			break;
+		}
+		latency.channel(STATS_RX, channel).record(res.submitted);
+		stats.channel(STATS_RX, channel).add(res.count);
+	}
+}
 
-static bool set_channel_config(bool is_600_mode, CONFIGURATION_FIFO_CLK clock)
+/* Writes go out in the order the tasks fill their buffers, the pipe
+ * completes them in order, so the channel's sequence stays intact */
+static co_task write_task(FT_HANDLE handle, co_pipe &pipe, uint8_t channel,
+		span<uint8_t> buf, uint32_t *sequence)
 {
-	FT_HANDLE handle;
-	DWORD dwType;
+	uint32_t *p = (uint32_t *)buf.data();
 
-	/* Must turn off all pipes before changing chip configuration */
-	turn_off_all_pipes();
+	while (!do_exit) {
+		fill_sequence(p, buf.size(), sequence);
 
-	FT_GetDeviceInfoDetail(0, NULL, &dwType, NULL, NULL, NULL, NULL, &handle);
-	if (!handle)
-		return false;
+		transfer_result res = co_await pipe.write(buf);
 
-	get_vid_pid(handle);
-	test_gpio(handle);
+		if (do_exit)
+			break;
+		if (FT_OK != res.status)
+			count_failure(STATS_TX, channel, res.status);
+		if (FT_TIMEOUT == res.status)
+			rearm_stream(handle, 0x02 + channel);
+		if (FT_OK != res.status && FT_TIMEOUT != res.status) {
+			do_exit = true;
+			break;
+		}
+		latency.channel(STATS_TX, channel).record(res.submitted);
+		stats.channel(STATS_TX, channel).add(res.count);
+		if (!pipe.queued())
+			tx_underrun++;
+	}
+}
 
-	union {
-		FT_60XCONFIGURATION ft600;
-	} cfg;
-	if (FT_OK != FT_GetChipConfiguration(handle, &cfg)) {
-		printf("Failed to get chip conf\r\n");
-		return false;
+static void transfer_coroutines(FT_HANDLE handle)
+{
+	placement.apply("loop");
+
+	int pipe_cnt = out_ch_cnt + in_ch_cnt;
+	vector<co_pipe> pipes(pipe_cnt);
+	uint32_t sequence[4] = { 0 };
+	co_executor exec;
+	buffer_pool_ptr pool;
+
+	if (!create_pool(&pool, pipe_cnt * queue_depth, "Task"))
+		return;
+	if (!exec.init()) {
+		do_exit = true;
+		return;
 	}
+	for (int i = 0; i < pipe_cnt && !do_exit; i++) {
+		bool in = i >= out_ch_cnt;
+		uint8_t channel = in ? i - out_ch_cnt : i;
 
-	bool needs_update;
-		needs_update = set_ft600_channel_config(&cfg.ft600, clock, is_600_mode);
-	if (needs_update) {
-		if (FT_OK != FT_SetChipConfiguration(handle, &cfg))
-			printf("Failed to set chip conf\r\n");
-		else {
-			printf("Configuration changed\r\n");
-			this_thread::sleep_for(chrono::seconds(1));
-			get_device_lists(6000);
+		if (!pipes[i].open(exec, handle, (in ? 0x82 : 0x02) + channel,
+					queue_depth)) {
+			do_exit = true;
+			break;
+		}
+		for (int n = 0; n < queue_depth; n++) {
+			span<uint8_t> buf((uint8_t *)buffer_pool_get(pool.get()),
+					buffer_len);
+
+			if (in)
+				exec.spawn(read_task(handle, pipes[i], channel, buf));
+			else
+				exec.spawn(write_task(handle, pipes[i], channel, buf,
+							&sequence[channel]));
 		}
 	}
+	printf("Coroutines: 1 thread, %d task(s) on %d pipe(s)\r\n",
+			exec.tasks(), pipe_cnt);
+
+	exec.run(&do_exit);
+	for (co_pipe &pipe : pipes)
+		pipe.close();
+	printf("Coroutines stopped\r\n");
+}
+#endif /* C++20 */
 
-	if (dwType == FT_DEVICE_600 || dwType == FT_DEVICE_601) {
-		bool rev_a_chip;
-		DWORD dwVersion;
+/* One writer and one reader for all channels, or with -t one of each
+ * per channel so a slow channel does not hold up the others, or with -E
+ * one event loop for everything */
+static void start_transfers(FT_HANDLE handle)
+{
+	auto writer = queue_depth ? write_test_overlapped :
+		message_len ? write_test_messages : write_test;
+	auto reader = queue_depth ? read_test_overlapped :
+		event_reads ? read_test_notified : read_test;
+	uint8_t step_out = thread_per_channel ? 1 : out_ch_cnt;
+	uint8_t step_in = thread_per_channel ? 1 : in_ch_cnt;
+
+	if (event_reads && in_ch_cnt && !notifier.start(handle)) {
+		do_exit = true;
+		return;
+	}
+#if __cplusplus >= 202002L
+	if (coroutines) {
+		read_threads.push_back(thread(transfer_coroutines, handle));
+		return;
+	}
+#endif
+	if (epoll_loop) {
+		read_threads.push_back(thread(transfer_epoll, handle));
+		return;
+	}
+	for (uint8_t ch = 0; ch < out_ch_cnt; ch += step_out)
+		write_threads.push_back(thread(writer, handle,
+					channel_range{ch, (uint8_t)(ch + step_out)}));
+	for (uint8_t ch = 0; ch < in_ch_cnt; ch += step_in)
+		read_threads.push_back(thread(reader, handle,
+					channel_range{ch, (uint8_t)(ch + step_in)}));
+}
 
-		FT_GetFirmwareVersion(handle, &dwVersion);
-		rev_a_chip = dwVersion <= 0x105;
+static void join_transfers(void)
+{
+	for (thread &t : write_threads)
+		t.join();
+	for (thread &t : read_threads)
+		t.join();
+	write_threads.clear();
+	read_threads.clear();
+	notifier.stop();
+}
 
-		FT_Close(handle);
-		return rev_a_chip;
+static void sig_hdlr(int signum)
+{
+	switch (signum) {
+	case SIGINT:
+		if (!do_exit)
+			stop_time = chrono::steady_clock::now();
+		do_exit = true;
+		break;
 	}
+}
 
-	FT_Close(handle);
-	return false;
+static void test_gpio(HANDLE handle)
+{
+#define GPIO(x) (1 << (x))
+#define GPIO_OUT(x) (1 << (x))
+#define GPIO_HIGH(x) (1 << (x))
+
+	DWORD dwMask = GPIO(0) | GPIO(1) | GPIO(2);
+	DWORD dwDirection = GPIO_OUT(0) | GPIO_OUT(1) |GPIO_OUT(2);
+	DWORD dwLevel = GPIO_HIGH(0) | GPIO_HIGH(1) |GPIO_HIGH(2);
+
+	if (FT_NOT_SUPPORTED == FT_EnableGPIO(handle, dwMask, dwDirection)) {
+		printf("FT_EnableGPIO not implemented\r\n");
+		return;
+	}
+	if (FT_OK != FT_WriteGPIO(handle, dwMask, dwLevel)) {
+		printf("FT_WriteGPIO not implemented\r\n");
+		return;
+	}
+	printf("Change all GPIOs to output high\r\n");
+	if (FT_OK != FT_ReadGPIO(handle, &dwLevel)) {
+		printf("FT_ReadGPIO not implemented\r\n");
+		return;
+	}
+	for (int i = 0; i < 3; i++)
+		printf("GPIO%d level is %s\r\n", i,
+				dwLevel & GPIO_HIGH(i) ? "high" : "low");
+}
+
+static void register_signals(void)
+{
+	signal(SIGINT, sig_hdlr);
 }
 
 static void show_help(const char *bin)
 {
-	printf("Usage: %s <out channel count> <in channel count> [mode]\r\n", bin);
+	printf("Usage: %s [options] <out channel count> <in channel count> [mode]\r\n", bin);
 	printf("  channel count: [0, 1] for 245 mode, [0-4] for 600 mode\r\n");
 	printf("  mode: 0 = FT245 mode (default), 1 = FT600 mode\r\n");
+	printf("Options:\r\n");
+	printf("  -q depth: keep [1-%d] overlapped transfers in flight per channel,\r\n", MAX_QUEUE_DEPTH);
+	printf("            0 = synchronous FT_ReadPipeEx/FT_WritePipeEx loop (default)\r\n");
+	printf("  -d seconds: stop after the given time and print a summary,\r\n");
+	printf("              with -T the time per tuning point (default %d)\r\n",
+			TUNE_SECONDS);
+	printf("  -p profile: load transfer parameters and buffer size\r\n");
+	printf("  -T profile: sweep URB count, URB buffer count and size, streaming\r\n");
+	printf("              size and buffer size, re-creating the device for\r\n");
+	printf("              each point, and write the best settings to profile\r\n");
+	printf("  -t: one reader and one writer thread per channel instead of\r\n");
+	printf("      one of each serving all channels in turn\r\n");
+	printf("  -a role=core[:priority],...: pin the read, write, producer\r\n");
+	printf("              (overlapped writes) and measure threads to a core\r\n");
+	printf("              and optionally run them SCHED_FIFO at priority\r\n");
+	printf("              [1-99]; buffers are allocated on the core's node.\r\n");
+	printf("              With -t list a core per channel for read, write\r\n");
+	printf("              and producer: read=2,3,4,5:50 (channel 0 on 2...)\r\n");
+	printf("  -S size: stream fixed size frames, every transfer is size bytes\r\n");
+	printf("           and the pipes stay in one chip session (FT_SetStreamPipe)\r\n");
+	printf("  -S capture: one unbounded stream of buffer size transfers, with\r\n");
+	printf("              the longest streaming session the driver allows\r\n");
+	printf("  -e: event driven reads, sleep until FT_SetNotificationCallback\r\n");
+	printf("      reports data and read exactly that much (synchronous or -E)\r\n");
+	printf("  -u percent: write in bursts for percent of every %lldms, RX\r\n",
+			(long long)DUTY_PERIOD.count());
+	printf("              latency is then measured from the start of the write\r\n");
+	printf("              (loopback delivery time; synchronous only)\r\n");
+	printf("  -E: one thread drives all pipes from an epoll loop, -q transfers\r\n");
+	printf("      in flight per pipe (default 8), with -e reads are notified\r\n");
+#if __cplusplus >= 202002L
+	printf("  -C: -E with every transfer a coroutine awaiting its completion\r\n");
+#endif
+	printf("  -m size: write size byte messages (at most the buffer size), one\r\n");
+	printf("           FT_WritePipeEx each (synchronous only)\r\n");
+	printf("  -r rate: messages per second per channel with -m (default: max)\r\n");
+	printf("  -g us: gather -m messages into buffer size writes, sending a\r\n");
+	printf("         batch when full or us microseconds after its first message\r\n");
 }
 
-static void turn_off_thread_safe(void)
+/* The device for the current channel counts and transfer profile */
+static bool open_device(device_session *dev)
 {
 	FT_TRANSFER_CONF conf;
-
-	memset(&conf, 0, sizeof(FT_TRANSFER_CONF));
-	conf.wStructSize = sizeof(FT_TRANSFER_CONF);
-	conf.pipe[FT_PIPE_DIR_IN].fNonThreadSafeTransfer = true;
-	conf.pipe[FT_PIPE_DIR_OUT].fNonThreadSafeTransfer = true;
-	for (DWORD i = 0; i < 4; i++)
-		FT_SetTransferParams(&conf, i);
+	session_config cfg;
+
+	memset(&conf, 0, sizeof(conf));
+	apply_transfer_profile(&profile, &conf);
+	session_config_init(&cfg);
+	cfg.channel_config = session_channel_config(out_ch_cnt, in_ch_cnt);
+	cfg.fifo_600mode = fifo_600mode;
+	cfg.transfer = &conf;
+	if (stream_frame || stream_capture)
+		cfg.stream_size = buffer_len;
+	cfg.shared_pipes = epoll_loop;
+	if (stream_capture)
+		for (int dir = 0; dir < FT_PIPE_DIR_COUNT; dir++)
+			conf.pipe[dir].dwStreamingSize = 0xFFFFFFFF;
+	return dev->open(cfg);
 }
 
 static void get_queue_status(HANDLE handle)
@@ -347,8 +1203,281 @@ static void get_queue_status(HANDLE handle)
 	}
 }
 
+struct tune_result {
+	double rate; /* MiB/s, TX and RX together */
+	double cpu;  /* percent of one core */
+};
+
+struct tune_param {
+	const char *name;
+	void (*set)(transfer_profile *p, DWORD val);
+	int count;
+	DWORD values[8];
+};
+
+static const tune_param tune_params[] = {
+	{ "buffer_len",
+		[](transfer_profile *p, DWORD v) { p->buffer_len = v; },
+		7, { 16384, 32768, 65536, 131072, 262144, 524288, 1048576 } },
+	{ "urb_buffer_size",
+		[](transfer_profile *p, DWORD v) { p->urb_buffer_size = v; },
+		5, { 16384, 32768, 65536, 131072, 262144 } },
+	{ "urb_count",
+		[](transfer_profile *p, DWORD v) { p->urb_count = v; },
+		5, { 2, 4, 8, 16, 32 } },
+	{ "urb_buffer_count",
+		[](transfer_profile *p, DWORD v) { p->urb_buffer_count = v; },
+		4, { 16, 64, 256, 1024 } },
+	{ "streaming_size",
+		[](transfer_profile *p, DWORD v) { p->streaming_size = v; },
+		3, { 0, 4*1024*1024, 64*1024*1024 } },
+};
+
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+		(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static uint64_t total_bytes(void)
+{
+	uint64_t bytes = 0;
+
+	for (uint8_t channel = 0; channel < out_ch_cnt; channel++)
+		bytes += stats.total(STATS_TX, channel).bytes;
+	for (uint8_t channel = 0; channel < in_ch_cnt; channel++)
+		bytes += stats.total(STATS_RX, channel).bytes;
+	return bytes;
+}
+
+/* Stream for the tuning time on a freshly created device with the
+ * current profile, after half a second for the pipes to fill up.
+ * Returns false when interrupted or the device cannot be created. */
+static bool run_tune_point(int seconds, tune_result *res)
+{
+	device_session dev;
+
+	buffer_len = profile.buffer_len;
+	if (!open_device(&dev))
+		return false;
+
+	FT_HANDLE handle = dev.get();
+
+	do_exit = false;
+	start_transfers(handle);
+
+	this_thread::sleep_for(chrono::milliseconds(500));
+
+	auto begin = chrono::steady_clock::now();
+	auto end = begin + chrono::seconds(seconds);
+	uint64_t bytes = total_bytes();
+	double cpu = cpu_seconds();
+
+	while (!do_exit && chrono::steady_clock::now() < end)
+		this_thread::sleep_for(chrono::milliseconds(50));
+
+	bool completed = !do_exit;
+	double elapsed = chrono::duration<double>(
+			chrono::steady_clock::now() - begin).count();
+
+	res->rate = (total_bytes() - bytes) / elapsed / 1000 / 1000;
+	res->cpu = (cpu_seconds() - cpu) / elapsed * 100;
+	do_exit = true;
+	join_transfers();
+	dev.close();
+
+	printf("urb_count=%u urb_buffer_count=%u urb_buffer_size=%u "
+			"streaming_size=%u buffer_len=%d: %.2fMiB/s, CPU %.1f%%\r\n",
+			profile.urb_count, profile.urb_buffer_count,
+			profile.urb_buffer_size, profile.streaming_size,
+			profile.buffer_len, res->rate, res->cpu);
+	return completed;
+}
+
+/* Field by field, the struct has padding */
+static bool same_profile(const transfer_profile &a, const transfer_profile &b)
+{
+	return a.urb_count == b.urb_count &&
+		a.urb_buffer_count == b.urb_buffer_count &&
+		a.urb_buffer_size == b.urb_buffer_size &&
+		a.streaming_size == b.streaming_size &&
+		a.buffer_len == b.buffer_len;
+}
+
+/* Within 2% counts as the same throughput, then less CPU wins */
+static bool tune_better(const tune_result &a, const tune_result &b)
+{
+	if (a.rate > b.rate * 1.02)
+		return true;
+	return a.rate >= b.rate * 0.98 && a.cpu < b.cpu;
+}
+
+/* Sweep one parameter at a time around the best point so far, starting
+ * from the driver defaults (or the -p profile) */
+static int tune(void)
+{
+	int seconds = run_seconds ? run_seconds : TUNE_SECONDS;
+	transfer_profile best = profile;
+	tune_result best_res;
+
+	if (!best.urb_count)
+		best.urb_count = 8;
+	if (!best.urb_buffer_count)
+		best.urb_buffer_count = 256;
+	if (!best.urb_buffer_size)
+		best.urb_buffer_size = 32*1024;
+	/* Profiles hold whole 512 byte packets, a -S frame may not be */
+	best.buffer_len = (buffer_len + 511) / 512 * 512;
+	if (best.buffer_len > PROFILE_MAX_BUFFER_LEN) {
+		printf("Buffer size %d too large for a profile\r\n", buffer_len);
+		return 1;
+	}
+	if (best.buffer_len != buffer_len)
+		printf("Tuning with buffer_len=%d, %d rounded up to 512 byte "
+				"packets\r\n", best.buffer_len, buffer_len);
+
+	profile = best;
+	if (!run_tune_point(seconds, &best_res))
+		return 1;
+
+	for (const tune_param &param : tune_params) {
+		for (int i = 0; i < param.count; i++) {
+			transfer_profile cand = best;
+			tune_result res;
+
+			param.set(&cand, param.values[i]);
+			if (same_profile(cand, best))
+				continue;
+			profile = cand;
+			if (!run_tune_point(seconds, &res)) {
+				printf("Tuning interrupted, %s not written\r\n",
+						tune_path);
+				return 1;
+			}
+			if (tune_better(res, best_res)) {
+				best = cand;
+				best_res = res;
+			}
+		}
+	}
+
+	char comment[128];
+
+	snprintf(comment, sizeof(comment), "%.2fMiB/s, CPU %.1f%%, %d OUT/%d IN "
+			"channel(s), queue depth %d", best_res.rate, best_res.cpu,
+			out_ch_cnt, in_ch_cnt, queue_depth);
+	printf("Best: %s\r\n", comment);
+	return save_transfer_profile(tune_path, &best, comment) ? 0 : 1;
+}
+
+/* With -t every channel has a thread of the role, which -a gives a core
+ * each: one core for several would run them one after the other */
+static bool placement_fits(const char *role, int ch_cnt)
+{
+	int cores = placement.count(role);
+	int threads = thread_per_channel && ch_cnt > 1 ? ch_cnt : 1;
+
+	if (!cores || cores == threads)
+		return true;
+	printf("-a %s= needs %d core(s), one per %s thread\r\n", role,
+			threads, role);
+	return false;
+}
+
 static bool validate_arguments(int argc, char *argv[])
 {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "q:d:p:T:a:tS:eu:ECm:r:g:")) != -1) {
+		switch (opt) {
+		case 'q':
+			queue_depth = atoi(optarg);
+			if (queue_depth < 0 || queue_depth > MAX_QUEUE_DEPTH)
+				return false;
+			break;
+		case 'd':
+			run_seconds = atoi(optarg);
+			if (run_seconds < 0)
+				return false;
+			break;
+		case 'p':
+			if (!load_transfer_profile(optarg, &profile))
+				return false;
+			if (profile.buffer_len)
+				buffer_len = profile.buffer_len;
+			break;
+		case 'T':
+			tune_path = optarg;
+			break;
+		case 'a':
+			if (!placement.parse(optarg, thread_roles))
+				return false;
+			break;
+		case 't':
+			thread_per_channel = true;
+			break;
+		case 'S':
+			stream_capture = !strcmp(optarg, "capture");
+			stream_frame = stream_capture ? 0 : atoi(optarg);
+			if (!stream_capture && stream_frame <= 0)
+				return false;
+			break;
+		case 'e':
+			event_reads = true;
+			break;
+		case 'u':
+			duty_cycle = atoi(optarg);
+			if (duty_cycle <= 0 || duty_cycle > 100)
+				return false;
+			break;
+		case 'E':
+			epoll_loop = true;
+			break;
+		case 'm':
+			message_len = atoi(optarg);
+			if (message_len <= 0)
+				return false;
+			break;
+		case 'r':
+			message_rate = atoi(optarg);
+			if (message_rate < 0)
+				return false;
+			break;
+		case 'g':
+			coalesce_us = atoi(optarg);
+			if (coalesce_us < 0)
+				return false;
+			break;
+#if __cplusplus >= 202002L
+		case 'C':
+			epoll_loop = coroutines = true;
+			break;
+#endif
+		default:
+			return false;
+		}
+	}
+	if (epoll_loop && !queue_depth)
+		queue_depth = 8;
+	if ((event_reads || duty_cycle) && queue_depth && !epoll_loop)
+		return false;
+	if (epoll_loop && (duty_cycle || thread_per_channel))
+		return false;
+	if (coroutines && event_reads)
+		return false;
+	if (stream_frame)
+		buffer_len = stream_frame;
+	if (message_len && (queue_depth || duty_cycle ||
+				message_len > buffer_len))
+		return false;
+	if ((message_rate || coalesce_us >= 0) && !message_len)
+		return false;
+	argc -= optind - 1;
+	argv += optind - 1;
+
 	if (argc != 3 && argc != 4)
 		return false;
 
@@ -363,58 +1492,59 @@ static bool validate_arguments(int argc, char *argv[])
 	in_ch_cnt = atoi(argv[2]);
 
 	if ((in_ch_cnt == 0 && out_ch_cnt == 0) ||
-			in_ch_cnt > 4 || out_ch_cnt > 4) {
-		show_help(argv[0]);
+			in_ch_cnt > 4 || out_ch_cnt > 4)
 		return false;
-	}
-	return true;
+	return placement_fits("read", in_ch_cnt) &&
+		placement_fits("write", out_ch_cnt) &&
+		placement_fits("producer", out_ch_cnt);
 }
 
 int main(int argc, char *argv[])
 {
 
-	get_version();
+	show_versions();
 
 	if (!validate_arguments(argc, argv)) {
 		show_help(argv[0]);
 		return 1;
 	}
 
-	if (!get_device_lists(500))
-		return 1;
-
-	bool rev_a_chip = set_channel_config(
-			fifo_600mode, CONFIGURATION_FIFO_CLK_100);
+	if (tune_path) {
+		register_signals();
+		return tune();
+	}
 
-	/* Must be called before FT_Create is called */
-	turn_off_thread_safe();
+	device_session dev;
 
-	FT_HANDLE handle;
+	if (!open_device(&dev))
+		return 1;
 
-	FT_Create(0, FT_OPEN_BY_INDEX, &handle);
+	FT_HANDLE handle = dev.get();
+	double cpu;
 
-	if (!handle) {
-		printf("Failed to create device\r\n");
-		return -1;
-	}
-	if (out_ch_cnt)
-		write_thread = thread(write_test, handle);
-	if (in_ch_cnt)
-		read_thread = thread(read_test, handle);
+	test_gpio(handle);
+	cpu = cpu_seconds();
+	start_time = chrono::steady_clock::now();
+	start_transfers(handle);
 	measure_thread = thread(show_throughput, handle);
 	register_signals();
 
-	if (write_thread.joinable())
-		write_thread.join();
-	if (read_thread.joinable())
-		read_thread.join();
+	join_transfers();
 	if (measure_thread.joinable())
 		measure_thread.join();
+	latency.dump("TX", STATS_TX, out_ch_cnt);
+	latency.dump("RX", STATS_RX, in_ch_cnt);
+	if (out_ch_cnt)
+		show_summary("TX", STATS_TX, out_ch_cnt);
+	if (out_ch_cnt && queue_depth)
+		show_underrun_summary();
+	if (out_ch_cnt && message_len)
+		show_message_summary();
+	if (in_ch_cnt)
+		show_summary("RX", STATS_RX, in_ch_cnt);
+	printf("CPU: %.1f%% of one core\r\n", (cpu_seconds() - cpu) /
+			chrono::duration<double>(chrono::steady_clock::now() -
+				start_time).count() * 100);
 	get_queue_status(handle);
-
-	/* Workaround for FT600/FT601 Rev.A device: Stop session before exit */
-	if (rev_a_chip)
-		FT_ResetDevicePort(handle);
-	FT_Close(handle);
 	return 0;
 }
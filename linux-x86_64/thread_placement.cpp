@@ -0,0 +1,129 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "thread_placement.h"
+
+static bool parse_number(const char *s, size_t len, int max, int *val)
+{
+	char *end;
+	long num = strtol(s, &end, 10);
+
+	if (end != s + len || !len || num < 0 || num > max)
+		return false;
+	*val = num;
+	return true;
+}
+
+bool thread_placement::parse(const char *arg, const char *const roles[])
+{
+	cnt = 0;
+	while (*arg) {
+		size_t len = strcspn(arg, ",");
+		const char *eq = (const char *)memchr(arg, '=', len);
+		/* Without role= the entry continues the previous one's list */
+		const char *start = eq ? eq : arg - 1;
+		const char *colon = (const char *)memchr(start + 1, ':',
+				arg + len - start - 1);
+		const char *core_end = colon ? colon : arg + len;
+		entry *e = &entries[cnt];
+		int i;
+
+		if ((!eq && !cnt) || cnt == MAX_ENTRIES)
+			goto bad;
+		if (eq) {
+			for (i = 0; roles[i]; i++)
+				if (strlen(roles[i]) == (size_t)(eq - arg) &&
+						!strncmp(roles[i], arg, eq - arg))
+					break;
+			if (!roles[i])
+				goto bad;
+			e->role = roles[i];
+		} else {
+			e->role = entries[cnt - 1].role;
+		}
+		e->core = -1;
+		e->priority = 0;
+		if (core_end != start + 1 && !parse_number(start + 1,
+					core_end - start - 1, CPU_SETSIZE - 1, &e->core))
+			goto bad;
+		if (colon && !parse_number(colon + 1, arg + len - colon - 1,
+					99, &e->priority))
+			goto bad;
+		cnt++;
+		arg += len;
+		if (*arg)
+			arg++;
+		continue;
+bad:
+		printf("Bad thread placement \"%.*s\", expected role=core[:priority]"
+				"[,core[:priority]...] with role one of:", (int)len, arg);
+		for (i = 0; roles[i]; i++)
+			printf(" %s", roles[i]);
+		printf("\r\n");
+		return false;
+	}
+	return true;
+}
+
+int thread_placement::count(const char *role) const
+{
+	int n = 0;
+
+	for (int i = 0; i < cnt; i++)
+		if (!strcmp(entries[i].role, role))
+			n++;
+	return n;
+}
+
+void thread_placement::apply(const char *role, int index) const
+{
+	const entry *e = NULL;
+	int n = 0;
+
+	for (int i = 0; i < cnt && n <= index; i++)
+		if (!strcmp(entries[i].role, role)) {
+			e = &entries[i];
+			n++;
+		}
+	if (!e)
+		return;
+
+	if (e->core >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(e->core, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+			printf("%s thread: failed to pin to core %d\r\n", role,
+					e->core);
+	}
+	if (e->priority) {
+		struct sched_param param;
+
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = e->priority;
+		if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+			printf("%s thread: SCHED_FIFO needs CAP_SYS_NICE or an "
+					"rtprio limit\r\n", role);
+	}
+
+	unsigned cpu = 0, node = 0;
+	int policy;
+	struct sched_param param;
+
+	syscall(SYS_getcpu, &cpu, &node, NULL);
+	pthread_getschedparam(pthread_self(), &policy, &param);
+	char name[32];
+
+	/* Numbered when the role has a list, one line per thread */
+	if (count(role) > 1)
+		snprintf(name, sizeof(name), "%s thread %d", role, index);
+	else
+		snprintf(name, sizeof(name), "%s thread", role);
+	printf("%s on core %u, NUMA node %u, %s\r\n", name, cpu, node,
+			policy == SCHED_FIFO ? "SCHED_FIFO" : "normal scheduling");
+}
@@ -0,0 +1,45 @@
+#ifndef THREAD_PLACEMENT_H
+#define THREAD_PLACEMENT_H
+
+/* Core and scheduling of the worker threads of a tool, given on the
+ * command line as "role=core[:priority],..." where priority selects
+ * SCHED_FIFO (1-99) and core may be left out, e.g. "read=2:50,write=3".
+ * A role with one thread per channel takes a list, the cores after
+ * role= without a role of their own: "read=2,3,4,5:50" puts the reader
+ * of channel 0 on core 2, of channel 1 on core 3 and so on.
+ *
+ * A thread applies its own placement before it allocates its buffers.
+ * Memory is placed on the NUMA node of the thread that first writes
+ * it, so buffers that the pinned thread allocates and touches end up on
+ * its core's node. */
+class thread_placement {
+public:
+	static const int MAX_ENTRIES = 16;
+
+	thread_placement() : cnt(0) {}
+
+	/* roles: NULL terminated list of the roles the tool has. Prints the
+	 * reason and returns false on a bad argument. */
+	bool parse(const char *arg, const char *const roles[]);
+
+	/* Pin the calling thread and set its scheduling as given for role,
+	 * the index'th entry of its list (the last one past its end), prints
+	 * where it runs. Nothing happens for a role not given. */
+	void apply(const char *role, int index = 0) const;
+	/* Entries given for role */
+	int count(const char *role) const;
+
+	bool empty(void) const { return !cnt; }
+
+private:
+	struct entry {
+		const char *role;
+		int core;     /* -1 = not pinned */
+		int priority; /* SCHED_FIFO priority, 0 = normal scheduling */
+	};
+
+	entry entries[MAX_ENTRIES];
+	int cnt;
+};
+
+#endif /* THREAD_PLACEMENT_H */
@@ -0,0 +1,95 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "transfer_profile.h"
+
+
+static bool parse_value(const char *key, const char *val,
+		transfer_profile *profile)
+{
+	char *end;
+	unsigned long num = strtoul(val, &end, 0);
+
+	if (end == val || (*end && *end != '\n' && *end != '\r'))
+		return false;
+
+	if (!strcmp(key, "urb_count") && num <= 0xFF)
+		profile->urb_count = num;
+	else if (!strcmp(key, "urb_buffer_count") && num <= 0xFFFF)
+		profile->urb_buffer_count = num;
+	else if (!strcmp(key, "urb_buffer_size") && num <= 0xFFFFFFFF)
+		profile->urb_buffer_size = num;
+	else if (!strcmp(key, "streaming_size") && num <= 0xFFFFFFFF)
+		profile->streaming_size = num;
+	else if (!strcmp(key, "buffer_len") && num <= PROFILE_MAX_BUFFER_LEN &&
+			num % 512 == 0)
+		profile->buffer_len = num;
+	else
+		return false;
+	return true;
+}
+
+bool load_transfer_profile(const char *path, transfer_profile *profile)
+{
+	FILE *fp = fopen(path, "r");
+	char line[256];
+	int line_no = 0;
+
+	if (!fp) {
+		printf("Failed to open profile %s\r\n", path);
+		return false;
+	}
+	memset(profile, 0, sizeof(*profile));
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *p = line + strspn(line, " \t");
+		char *eq;
+
+		line_no++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || !*p)
+			continue;
+		eq = strchr(p, '=');
+		if (eq) {
+			*eq = '\0';
+			p[strcspn(p, " \t")] = '\0';
+		}
+		if (!eq || !parse_value(p, eq + 1, profile)) {
+			printf("Bad line %d in profile %s\r\n", line_no, path);
+			fclose(fp);
+			return false;
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+bool save_transfer_profile(const char *path, const transfer_profile *profile,
+		const char *comment)
+{
+	FILE *fp = fopen(path, "w");
+
+	if (!fp) {
+		printf("Failed to create profile %s\r\n", path);
+		return false;
+	}
+	fprintf(fp, "# D3XX transfer profile\n");
+	if (comment)
+		fprintf(fp, "# %s\n", comment);
+	fprintf(fp, "urb_count=%u\n", profile->urb_count);
+	fprintf(fp, "urb_buffer_count=%u\n", profile->urb_buffer_count);
+	fprintf(fp, "urb_buffer_size=%u\n", profile->urb_buffer_size);
+	fprintf(fp, "streaming_size=%u\n", profile->streaming_size);
+	fprintf(fp, "buffer_len=%d\n", profile->buffer_len);
+	return fclose(fp) == 0;
+}
+
+void apply_transfer_profile(const transfer_profile *profile,
+		FT_TRANSFER_CONF *conf)
+{
+	for (int dir = 0; dir < FT_PIPE_DIR_COUNT; dir++) {
+		conf->pipe[dir].bURBCount = profile->urb_count;
+		conf->pipe[dir].wURBBufferCount = profile->urb_buffer_count;
+		conf->pipe[dir].dwURBBufferSize = profile->urb_buffer_size;
+		conf->pipe[dir].dwStreamingSize = profile->streaming_size;
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef TRANSFER_PROFILE_H
+#define TRANSFER_PROFILE_H
+
+#include "ftd3xx.h"
+
+/* Driver transfer parameters plus the application transfer size, as
+ * found by "streamer -T" and loaded by the streaming tools with -p.
+ * Zero fields keep the driver's or the tool's default. */
+struct transfer_profile {
+	BYTE urb_count;        /* concurrent URBs per pipe, driver default 8 */
+	WORD urb_buffer_count; /* driver default 256 */
+	DWORD urb_buffer_size; /* driver default 32KiB */
+	DWORD streaming_size;  /* FT600/FT601 only, driver default 1GiB */
+	int buffer_len;        /* bytes per read/write call, multiple of 512 */
+};
+
+/* Largest buffer_len a profile may hold */
+static const int PROFILE_MAX_BUFFER_LEN = 16*1024*1024;
+
+/* Parse a "key=value" profile, '#' starts a comment. Prints the reason
+ * and returns false on an unreadable file or a bad line. */
+bool load_transfer_profile(const char *path, transfer_profile *profile);
+
+/* comment: written as a '#' line above the values, may be NULL */
+bool save_transfer_profile(const char *path, const transfer_profile *profile,
+		const char *comment);
+
+/* Copy the driver parameters into both pipe directions of conf */
+void apply_transfer_profile(const transfer_profile *profile,
+		FT_TRANSFER_CONF *conf);
+
+#endif /* TRANSFER_PROFILE_H */
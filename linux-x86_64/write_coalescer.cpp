@@ -0,0 +1,181 @@
+#include <cstdio>
+#include <cstring>
+#include "write_coalescer.h"
+
+using namespace std;
+
+bool write_coalescer::open(FT_HANDLE dev, uint8_t ch, size_t len,
+		chrono::microseconds delay,
+		function<void(const coalesced_batch &)> done)
+{
+	close();
+	pool.reset(buffer_pool_create(len, BATCHES));
+	if (!pool) {
+		printf("Failed to allocate write batches\r\n");
+		return false;
+	}
+	for (batch &b : batches) {
+		b.buf = (uint8_t *)buffer_pool_get(pool.get());
+		b.info = coalesced_batch();
+	}
+	handle = dev;
+	channel = ch;
+	batch_len = len;
+	deadline = delay;
+	on_write = done;
+	filled = sent = 0;
+	failed = false;
+	closing = false;
+	sender = thread(&write_coalescer::send_batches, this);
+	return true;
+}
+
+void write_coalescer::close(void)
+{
+	if (!sender.joinable())
+		return;
+	{
+		lock_guard<mutex> lk(lock);
+
+		if (filled - sent < BATCHES && current().info.len)
+			seal(false);
+		closing = true;
+		sealed.notify_all();
+	}
+	sender.join();
+	pool.reset();
+}
+
+/* Hand the current batch to the sender. Called with the lock held. */
+void write_coalescer::seal(bool full)
+{
+	current().info.full = full;
+	filled++;
+	sealed.notify_all();
+}
+
+bool write_coalescer::writev(const struct iovec *iov, int iovcnt)
+{
+	size_t total = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	unique_lock<mutex> lk(lock);
+	bool first_piece = true;
+
+	for (int i = 0; i < iovcnt; i++) {
+		const uint8_t *src = (const uint8_t *)iov[i].iov_base;
+		size_t left = iov[i].iov_len;
+
+		while (left) {
+			space.wait(lk, [this] {
+				return failed || filled - sent < BATCHES;
+			});
+			if (failed)
+				return false;
+
+			/* Queued now, not when the call came in */
+			auto now = chrono::steady_clock::now();
+			batch &b = current();
+
+			/* Start a message that does not fit in a fresh batch */
+			if (first_piece && b.info.len &&
+					b.info.len + total > batch_len) {
+				seal(true);
+				continue;
+			}
+			if (!b.info.len) {
+				b.info.first = now;
+				b.info.messages = 0;
+				/* Start the deadline */
+				sealed.notify_all();
+			}
+			if (first_piece) {
+				b.info.messages++;
+				b.info.last = now;
+				first_piece = false;
+			}
+
+			size_t len = min(left, batch_len - b.info.len);
+
+			memcpy(b.buf + b.info.len, src, len);
+			b.info.len += len;
+			src += len;
+			left -= len;
+			if (b.info.len == batch_len)
+				seal(true);
+		}
+	}
+	return !failed;
+}
+
+void write_coalescer::flush(void)
+{
+	lock_guard<mutex> lk(lock);
+
+	if (current().info.len && filled - sent < BATCHES)
+		seal(false);
+}
+
+/* The sending thread: writes sealed batches in order and seals the
+ * current one when its deadline passes. After a failure the batches
+ * still sealed are reported dropped, not written. */
+void write_coalescer::send_batches(void)
+{
+	unique_lock<mutex> lk(lock);
+
+	for (;;) {
+		if (sent < filled) {
+			batch &b = batches[sent % BATCHES];
+			ULONG done = 0;
+			FT_STATUS status = FT_OK;
+
+			b.info.timeouts = 0;
+			b.info.dropped = failed;
+			lk.unlock();
+			while (!b.info.dropped && done < b.info.len) {
+				ULONG count = 0;
+
+				status = FT_WritePipeEx(handle, channel, b.buf + done,
+						b.info.len - done, &count, 1000);
+				done += count;
+				if (FT_TIMEOUT == status && !closing) {
+					/* Like rw, a timeout is retried */
+					b.info.timeouts++;
+					continue;
+				}
+				if (FT_OK != status)
+					break;
+			}
+			b.info.len = done;
+			b.info.status = status;
+			if (on_write)
+				on_write(b.info);
+			lk.lock();
+			b.info.len = 0;
+			b.info.messages = 0;
+			sent++;
+			if (FT_OK != status)
+				failed = true;
+			space.notify_all();
+			continue;
+		}
+		if (closing || failed)
+			break;
+
+		batch &cur = current();
+
+		if (!cur.info.len) {
+			sealed.wait(lk);
+			continue;
+		}
+
+		auto due = cur.info.first + deadline;
+
+		if (chrono::steady_clock::now() >= due)
+			seal(false);
+		else
+			sealed.wait_until(lk, due);
+	}
+}
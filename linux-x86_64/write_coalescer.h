@@ -0,0 +1,105 @@
+#ifndef WRITE_COALESCER_H
+#define WRITE_COALESCER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/uio.h>
+#include "ftd3xx.h"
+#include "buffer_pool.h"
+
+/* Gathers small messages on one OUT channel into batches of up to
+ * batch_len bytes (a URB's worth) and writes each batch with one
+ * FT_WritePipeEx, instead of one USB round trip per message.
+ *
+ * A batch is sent when the next message does not fit, or when its oldest
+ * message has waited deadline: 0 sends whatever is queued as soon as the
+ * channel is free, longer deadlines fill batches further at the cost of
+ * latency. Messages are copied into the batch, writev returns once they
+ * are queued; it only waits while all batches are in flight. Messages
+ * larger than a batch are split over several. The stream carries the
+ * messages back to back, framing is up to the caller.
+ *
+ * A write that times out is retried with what is left of the batch,
+ * except while closing. Any other failure fails the coalescer: writev
+ * returns false from then on and the batches already queued are not
+ * written, on_write gets them marked dropped.
+ *
+ * writev may be called from any number of threads. */
+
+struct coalesced_batch {
+	ULONG len;        /* bytes written */
+	FT_STATUS status;
+	unsigned timeouts; /* FT_TIMEOUTs retried on the way */
+	unsigned messages;
+	/* When the oldest and the newest message of the batch were queued */
+	std::chrono::steady_clock::time_point first;
+	std::chrono::steady_clock::time_point last;
+	bool full;        /* sent for lack of room, not by the deadline */
+	bool dropped;     /* not written, queued behind a failed batch */
+};
+
+class write_coalescer {
+public:
+	static const int BATCHES = 4;
+
+	write_coalescer() : handle(NULL), pool(nullptr), filled(0), sent(0),
+		failed(false), closing(false) {}
+	~write_coalescer() { close(); }
+	write_coalescer(const write_coalescer &) = delete;
+	write_coalescer &operator=(const write_coalescer &) = delete;
+
+	/* on_write, if given, is called from the sending thread after every
+	 * batch. Prints the reason and returns false on failure. */
+	bool open(FT_HANDLE handle, uint8_t channel, size_t batch_len,
+			std::chrono::microseconds deadline,
+			std::function<void(const coalesced_batch &)> on_write =
+			nullptr);
+	/* Send what is queued and stop */
+	void close(void);
+
+	/* Queue one message made of iovcnt pieces, false after a write failed */
+	bool writev(const struct iovec *iov, int iovcnt);
+	bool write(const void *msg, size_t len)
+	{
+		struct iovec iov = { (void *)msg, len };
+
+		return writev(&iov, 1);
+	}
+	/* Send the current batch without waiting for its deadline */
+	void flush(void);
+
+private:
+	struct batch {
+		uint8_t *buf;
+		coalesced_batch info;
+	};
+
+	batch &current(void) { return batches[filled % BATCHES]; }
+	void seal(bool full);
+	void send_batches(void);
+
+	FT_HANDLE handle;
+	uint8_t channel;
+	size_t batch_len;
+	std::chrono::microseconds deadline;
+	std::function<void(const coalesced_batch &)> on_write;
+	buffer_pool_ptr pool;
+	batch batches[BATCHES];
+	/* Running counts, batch = count % BATCHES: [sent, filled) are waiting
+	 * to be written, filled is being filled */
+	size_t filled;
+	size_t sent;
+	bool failed;
+	std::atomic<bool> closing; /* read by the sender while writing */
+	std::mutex lock;
+	std::condition_variable sealed;
+	std::condition_variable space;
+	std::thread sender;
+};
+
+#endif /* WRITE_COALESCER_H */
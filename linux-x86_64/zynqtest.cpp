@@ -5,337 +5,556 @@
 #include <csignal>
 #include <cstring>
 #include <fstream>
+#include <cstdlib>
+#include <algorithm>
+#include <unistd.h>
 #include "ftd3xx.h"
+#include "capture_sink.h"
+#include "capture_ring.h"
+#include "buffer_pool.h"
+#include "data_notifier.h"
+#include "pattern_check.h"
+#include "channel_stats.h"
+#include "latency_histogram.h"
+#include "transfer_profile.h"
+#include "device_session.h"
+#include "thread_placement.h"
 
 using namespace std;
 
 static bool do_exit;
 static bool fifo_600mode;
-static atomic_int tx_count;
-static atomic_int rx_count;
+static device_stats stats;
+static device_latency latency;
 static uint8_t in_ch_cnt;
 static uint8_t out_ch_cnt;
 static thread measure_thread;
 static thread write_thread;
 static thread read_thread;
-static const int BUFFER_LEN = 32*1024;
+static int buffer_len = 32*1024;
+static size_t ring_slots = 256;
+static bool drop_on_full;
+static atomic_int ring_stall;
+static atomic_int ring_drop;
+static const char *sink_type = "uring";
+static unique_ptr<capture_sink> sink; /* NULL with -s none */
+static int bench_rate; /* MiB/s of synthetic input, 0 = read from device */
+static int run_seconds; /* 0 = run until SIGINT */
+static transfer_profile profile;
+static thread_placement placement; /* -a */
+static int stream_frame;    /* -S size: fixed size frames */
+static bool stream_capture; /* -S capture: one unbounded stream */
+static bool event_reads; /* -e: read when notified instead of polling */
+static data_notifier notifier;
+static const char *const thread_roles[] = {
+	"read", "write", "dump", "verify", "measure", NULL
+};
+
+enum verify_pattern { VERIFY_NONE, VERIFY_COUNTER16, VERIFY_BYTES };
+static verify_pattern pattern;
+static atomic<uint64_t> verify_errors;
+static atomic<uint64_t> verify_bytes;
+static atomic_bool verify_failed;
+static uint8_t first_bad_channel;
+static uint64_t first_bad_offset; /* valid once verify_failed is set */
+
+static capture_ring ring;
+static int dump_consumer = -1;
+static int verify_consumer = -1;
 
 static void show_throughput(FT_HANDLE handle)
 {
-	auto next = chrono::steady_clock::now() + chrono::seconds(1);;
+	placement.apply("measure");
+
+	auto start = chrono::steady_clock::now();
+	auto next = start + chrono::seconds(1);;
 	(void)handle;
 
 	while (!do_exit) {
 		this_thread::sleep_until(next);
 		next += chrono::seconds(1);
 
-		int tx = tx_count.exchange(0);
-		int rx = rx_count.exchange(0);
+		stats.show_rates(out_ch_cnt, in_ch_cnt);
+		latency.show_interval("TX", STATS_TX, out_ch_cnt);
+		latency.show_interval("RX", STATS_RX, in_ch_cnt);
+		if (in_ch_cnt)
+			printf(" ring:%zu/%zu high water:%zu stall:%d drop:%d",
+				ring.used(), ring.capacity(), ring.peak(),
+				ring_stall.exchange(0), ring_drop.exchange(0));
+		if (pattern != VERIFY_NONE) {
+			printf(" verify errors:%llu",
+				(unsigned long long)verify_errors.load());
+			if (verify_failed.load(memory_order_acquire))
+				printf(" first bad:CH%d+0x%llx", first_bad_channel,
+					(unsigned long long)first_bad_offset);
+		}
+		printf("\r\n");
 
-		printf("TX:%.2fMiB/s RX:%.2fMiB/s, total:%.2fMiB\r\n",
-			(float)tx/1000/1000, (float)rx/1000/1000,
-			(float)(tx+ rx)/1000/1000);
+		if (run_seconds && next - start >=
+				chrono::seconds(run_seconds + 1))
+			do_exit = true;
 	}
 }
 
+static void count_failure(stats_dir dir, uint8_t channel, FT_STATUS status)
+{
+	if (status == FT_TIMEOUT)
+		stats.channel(dir, channel).timeout();
+	else
+		stats.channel(dir, channel).error();
+}
+
+/* A streaming pipe that timed out gets its stream set again so the chip
+ * resumes, keeping the transfers queued on it. False when not streaming. */
+static bool rearm_stream(FT_HANDLE handle, UCHAR pipe)
+{
+	if (!stream_frame && !stream_capture)
+		return false;
+	return FT_OK == FT_SetStreamPipe(handle, false, false, pipe, buffer_len);
+}
+
 static void write_test(FT_HANDLE handle)
 {
-	unique_ptr<uint8_t[]> buf(new uint8_t[BUFFER_LEN]);
-    uint8_t *p_buf=buf.get();
-    for(int i = 0; i<BUFFER_LEN; i++){
+	placement.apply("write");
+
+	buffer_pool_ptr pool(buffer_pool_create(buffer_len, 1));
+
+	if (!pool) {
+		printf("Failed to allocate write buffer\r\n");
+		do_exit = true;
+		return;
+	}
+    uint8_t *p_buf=(uint8_t *)buffer_pool_get(pool.get());
+    for(int i = 0; i<buffer_len; i++){
         p_buf[i]=/*(uint8_t(i/1024))*/i%256;
     }
 	while (!do_exit) {
 		for (uint8_t channel = 0; channel < out_ch_cnt; channel++) {
 			ULONG count = 0;
-            
-			if (FT_OK != FT_WritePipeEx(handle, channel,
-						buf.get(), BUFFER_LEN, &count, 1000)) {
+			auto start = chrono::steady_clock::now();
+
+			FT_STATUS status = FT_WritePipeEx(handle, channel,
+					p_buf, buffer_len, &count, 1000);
+			if (FT_TIMEOUT == status &&
+					rearm_stream(handle, 0x02 + channel)) {
+				count_failure(STATS_TX, channel, status);
+				continue;
+			}
+			if (FT_OK != status) {
+				count_failure(STATS_TX, channel, status);
 				do_exit = true;
 				break;
 			}
             /*
             printf(" p_buf ----------------------------- \r\n");			
-            for(int i = 0; i<BUFFER_LEN; i++){
+            for(int i = 0; i<buffer_len; i++){
                 printf("%d ",p_buf[i]);
             }
             printf(" ----------------------------------- \r\n");
             printf("\r\n");
 			*/
-			tx_count += count;
+			latency.channel(STATS_TX, channel).record(start);
+			stats.channel(STATS_TX, channel).add(count);
 		}
 	}
 	printf("Write stopped\r\n");
 }
 
-static void read_test(FT_HANDLE handle)
+static atomic_bool read_done;
+
+/* Drain the capture ring to disk so a slow disk never blocks the reader */
+static void dump_test(void)
 {
-	unique_ptr<uint8_t[]> buf(new uint8_t[BUFFER_LEN]);
-	const char *pBuf = (const char*)buf.get();
-	ofstream dumpFile;
+	placement.apply("dump");
 
-	dumpFile.open ("dumpfile.264", ios::out | ios::binary);
-    
-	while (!do_exit) {
-		for (uint8_t channel = 0; channel < in_ch_cnt; channel++) {
-			ULONG count = 0;
-			if (FT_OK != FT_ReadPipeEx(handle, channel,
-						buf.get(), BUFFER_LEN, &count, 1000)) {
-				do_exit = true;
-				break;
-			}
-            dumpFile.write(pBuf, count);
-            //printf("dumpFile.write %d byte\r\n",count);
+	for (;;) {
+		ULONG count;
+		uint8_t channel;
+		uint8_t *p = ring.peek(dump_consumer, &count, &channel);
 
-			rx_count += count;
+		if (!p) {
+			if (read_done)
+				break;
+			this_thread::sleep_for(chrono::microseconds(100));
+			continue;
 		}
+		if (!sink->write(p, count))
+			do_exit = true;
+		ring.release(dump_consumer);
 	}
 
-	dumpFile.close();
-	printf("Read stopped\r\n");
+	if (!sink->close())
+		printf("Failed to complete dumpfile.264\r\n");
+	printf("Dump stopped\r\n");
 }
 
-static void sig_hdlr(int signum)
+/* Pattern state of one IN channel, carried across buffers */
+struct verify_state {
+	bool started;
+	uint64_t offset; /* bytes of the channel stream checked so far */
+	int16_t prev_sample;
+	uint8_t prev_byte;
+	bool carry; /* low byte of a sample split across two buffers */
+	uint8_t carry_byte;
+};
+
+static void report_break(uint8_t channel, uint64_t offset)
 {
-	switch (signum) {
-	case SIGINT:
-		do_exit = true;
-		break;
+	if (!verify_errors++) {
+		first_bad_channel = channel;
+		first_bad_offset = offset;
+		verify_failed.store(true, memory_order_release);
 	}
 }
 
-static void test_gpio(HANDLE handle)
+/* The stream starts from 0 like testseq.py assumed (prev_sample starts
+ * at 0), so one that starts elsewhere is reported */
+static void check_sample(verify_state *st, uint8_t channel, int16_t cur,
+		uint64_t offset)
 {
-#define GPIO(x) (1 << (x))
-#define GPIO_OUT(x) (1 << (x))
-#define GPIO_HIGH(x) (1 << (x))
-
-	DWORD dwMask = GPIO(0) | GPIO(1) | GPIO(2);
-	DWORD dwDirection = GPIO_OUT(0) | GPIO_OUT(1) |GPIO_OUT(2);
-	DWORD dwLevel = GPIO_HIGH(0) | GPIO_HIGH(1) |GPIO_HIGH(2);
+	if (!counter16_step_ok(st->prev_sample, cur))
+		report_break(channel, offset);
+	st->prev_sample = cur;
+}
 
-	if (FT_NOT_SUPPORTED == FT_EnableGPIO(handle, dwMask, dwDirection)) {
-		printf("FT_EnableGPIO not implemented\r\n");
-		return;
+static void verify_counter16(verify_state *st, uint8_t channel,
+		const uint8_t *p, size_t len)
+{
+	uint64_t base = st->offset;
+
+	st->offset += len;
+	if (st->carry && len) {
+		check_sample(st, channel, (int16_t)(st->carry_byte | p[0] << 8),
+				base - 1);
+		st->carry = false;
+		p++;
+		len--;
+		base++;
 	}
-	if (FT_OK != FT_WriteGPIO(handle, dwMask, dwLevel)) {
-		printf("FT_WriteGPIO not implemented\r\n");
-		return;
+	if (len & 1) {
+		st->carry = true;
+		st->carry_byte = p[len - 1];
 	}
-	printf("Change all GPIOs to output high\r\n");
-	if (FT_OK != FT_ReadGPIO(handle, &dwLevel)) {
-		printf("FT_ReadGPIO not implemented\r\n");
-		return;
+
+	/* After a carry byte p is odd, samples are loaded bytewise */
+	size_t n = len / 2;
+	size_t i = 0;
+
+	while (i < n) {
+		size_t run = counter16_find_break(p + i * 2, n - i,
+				st->prev_sample);
+
+		if (run)
+			st->prev_sample = counter16_sample(p, i + run - 1);
+		i += run;
+		if (i == n)
+			break;
+		check_sample(st, channel, counter16_sample(p, i), base + i * 2);
+		i++;
 	}
-	for (int i = 0; i < 3; i++)
-		printf("GPIO%d level is %s\r\n", i,
-				dwLevel & GPIO_HIGH(i) ? "high" : "low");
 }
 
-static void register_signals(void)
+static void verify_bytes_pattern(verify_state *st, uint8_t channel,
+		const uint8_t *p, size_t len)
 {
-	signal(SIGINT, sig_hdlr);
+	uint64_t base = st->offset;
+	size_t i = 0;
+
+	st->offset += len;
+	if (!st->started && len) {
+		st->prev_byte = p[i++];
+		st->started = true;
+	}
+	while (i < len) {
+		i += bytes_find_break(p + i, len - i, st->prev_byte);
+		if (i == len)
+			break;
+		report_break(channel, base + i);
+		st->prev_byte = p[i++];
+	}
+	if (len)
+		st->prev_byte = p[len - 1];
 }
 
-static void get_version(void)
+/* Check the test pattern in place, right behind the reader */
+static void verify_test(void)
 {
-	DWORD dwVersion;
+	placement.apply("verify");
 
-	FT_GetDriverVersion(NULL, &dwVersion);
-	printf("Driver version:%d.%d.%d.%d\r\n", dwVersion >> 24,
-			(uint8_t)(dwVersion >> 16), (uint8_t)(dwVersion >> 8),
-			dwVersion & 0xFF);
+	verify_state state[4] = {};
 
-	FT_GetLibraryVersion(&dwVersion);
-	printf("Library version:%d.%d.%d\r\n", dwVersion >> 24,
-			(uint8_t)(dwVersion >> 16), dwVersion & 0xFFFF);
-}
+	for (;;) {
+		ULONG count;
+		uint8_t channel;
+		uint8_t *p = ring.peek(verify_consumer, &count, &channel);
 
-static void get_vid_pid(FT_HANDLE handle)
-{
-	WORD vid, pid;
+		if (!p) {
+			if (read_done)
+				break;
+			this_thread::sleep_for(chrono::microseconds(100));
+			continue;
+		}
+		if (pattern == VERIFY_COUNTER16)
+			verify_counter16(&state[channel], channel, p, count);
+		else
+			verify_bytes_pattern(&state[channel], channel, p, count);
+		verify_bytes += count;
+		ring.release(verify_consumer);
+	}
 
-	if (FT_OK != FT_GetVIDPID(handle, &vid, &pid))
-		return;
-	printf("VID:%04X PID:%04X\r\n", vid, pid);
+	printf("Verify stopped, %.2fMiB checked, %llu error(s)",
+			verify_bytes / 1024.0 / 1024,
+			(unsigned long long)verify_errors.load());
+	if (verify_failed)
+		printf(", first at CH%d offset 0x%llx", first_bad_channel,
+				(unsigned long long)first_bad_offset);
+	printf("\r\n");
 }
 
-static void turn_off_all_pipes(void)
+static void start_consumers(thread *dump_thread, thread *verify_thread)
 {
-	FT_TRANSFER_CONF conf;
-
-	memset(&conf, 0, sizeof(FT_TRANSFER_CONF));
-	conf.wStructSize = sizeof(FT_TRANSFER_CONF);
-	conf.pipe[FT_PIPE_DIR_IN].fPipeNotUsed = true;
-	conf.pipe[FT_PIPE_DIR_OUT].fPipeNotUsed = true;
-	for (DWORD i = 0; i < 4; i++)
-		FT_SetTransferParams(&conf, i);
+	if (dump_consumer >= 0)
+		*dump_thread = thread(dump_test);
+	if (verify_consumer >= 0)
+		*verify_thread = thread(verify_test);
 }
 
-static bool get_device_lists(int timeout_ms)
+static void stop_consumers(thread *dump_thread, thread *verify_thread)
 {
-	DWORD count;
-	FT_DEVICE_LIST_INFO_NODE nodes[16];
-
-	chrono::steady_clock::time_point const timeout =
-		chrono::steady_clock::now() +
-		chrono::milliseconds(timeout_ms);
-
-	do {
-		if (FT_OK == FT_CreateDeviceInfoList(&count))
-			break;
-		this_thread::sleep_for(chrono::microseconds(10));
-	} while (chrono::steady_clock::now() < timeout);
-	printf("Total %u device(s)\r\n", count);
-	if (!count)
-		return false;
-
-	if (FT_OK != FT_GetDeviceInfoList(nodes, &count))
-		return false;
-	return true;
+	read_done = true;
+	if (dump_thread->joinable())
+		dump_thread->join();
+	if (verify_thread->joinable())
+		verify_thread->join();
 }
 
-
-static bool set_ft600_channel_config(FT_60XCONFIGURATION *cfg,
-		CONFIGURATION_FIFO_CLK clock, bool is_600_mode)
+static void read_test(FT_HANDLE handle)
 {
-	bool needs_update = false;
-	bool current_is_600mode;
-
-	if (cfg->OptionalFeatureSupport &
-			CONFIGURATION_OPTIONAL_FEATURE_ENABLENOTIFICATIONMESSAGE_INCHALL) {
-		/* Notification in D3XX for Linux is implemented at OS level
-		 * Turn off notification feature in firmware */
-		cfg->OptionalFeatureSupport &=
-			~CONFIGURATION_OPTIONAL_FEATURE_ENABLENOTIFICATIONMESSAGE_INCHALL;
-		needs_update = true;
-		printf("Turn off firmware notification feature\r\n");
-	}
+	placement.apply("read");
+
+	buffer_pool_ptr scratch_pool(buffer_pool_create(buffer_len, 1));
+	thread dump_thread, verify_thread;
 
-	if (!(cfg->OptionalFeatureSupport &
-			CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN)) {
-		/* Turn off feature not supported by D3XX for Linux */
-		cfg->OptionalFeatureSupport |=
-			CONFIGURATION_OPTIONAL_FEATURE_DISABLECANCELSESSIONUNDERRUN;
-		needs_update = true;
-		printf("disable cancel session on FIFO underrun 0x%X\r\n",
-				cfg->OptionalFeatureSupport);
+	if (!ring.allocate() || !scratch_pool) {
+		printf("Failed to allocate capture ring\r\n");
+		do_exit = true;
+		return;
 	}
+	printf("Capture ring: %zu x %d bytes, %s\r\n", ring.capacity(),
+			buffer_len, ring.describe());
 
-	if (cfg->FIFOClock != clock)
-		needs_update = true;
+	uint8_t *scratch = (uint8_t *)buffer_pool_get(scratch_pool.get());
 
-	if (cfg->FIFOMode == CONFIGURATION_FIFO_MODE_245) {
-		printf("FIFO is running at FT245 mode\r\n");
-		current_is_600mode = false;
-	} else if (cfg->FIFOMode == CONFIGURATION_FIFO_MODE_600) {
-		printf("FIFO is running at FT600 mode\r\n");
-		current_is_600mode = true;
-	} else {
-		printf("FIFO is running at unknown mode\r\n");
-		exit(-1);
-	}
+	start_consumers(&dump_thread, &verify_thread);
 
-	UCHAR ch;
+	while (!do_exit) {
+		for (uint8_t next = 0; next < in_ch_cnt; next++) {
+			uint8_t channel = next;
+			ULONG len = buffer_len;
+			ULONG count = 0;
 
-	if (in_ch_cnt == 1 && out_ch_cnt == 0)
-		ch = CONFIGURATION_CHANNEL_CONFIG_1_INPIPE;
-	else if (in_ch_cnt == 0 && out_ch_cnt == 1)
-		ch = CONFIGURATION_CHANNEL_CONFIG_1_OUTPIPE;
-	else {
-		UCHAR total = in_ch_cnt < out_ch_cnt ? out_ch_cnt : in_ch_cnt;
+			if (event_reads) {
+				/* Read what was notified, a slot at a time */
+				len = notifier.wait(0, in_ch_cnt, &channel,
+						chrono::milliseconds(100));
+				if (!len)
+					continue;
+				len = min<ULONG>(len, buffer_len);
+			}
 
-		if (total == 4)
-			ch = CONFIGURATION_CHANNEL_CONFIG_4;
-		else if (total == 2)
-			ch = CONFIGURATION_CHANNEL_CONFIG_2;
-		else
-			ch = CONFIGURATION_CHANNEL_CONFIG_1;
+			uint8_t *buf = ring.acquire();
+
+			if (!buf) {
+				if (drop_on_full) {
+					/* Keep the device FIFO draining, lose the data */
+					buf = scratch;
+				} else {
+					ring_stall++;
+					while (!do_exit && !(buf = ring.acquire()))
+						this_thread::sleep_for(
+								chrono::microseconds(100));
+					if (!buf)
+						break;
+				}
+			}
 
-		if (cfg->FIFOMode == CONFIGURATION_FIFO_MODE_245 && total > 1) {
-			printf("245 mode only support single channel\r\n");
-			return false;
+			auto start = chrono::steady_clock::now();
+			FT_STATUS status = FT_ReadPipeEx(handle, channel,
+					buf, len, &count, 1000);
+			if (FT_TIMEOUT == status && (event_reads ||
+					rearm_stream(handle, 0x82 + channel))) {
+				count_failure(STATS_RX, channel, status);
+				if (!count)
+					continue;
+			} else if (FT_OK != status) {
+				count_failure(STATS_RX, channel, status);
+				do_exit = true;
+				break;
+			}
+			if (event_reads)
+				notifier.consumed(channel, count);
+			if (buf == scratch)
+				ring_drop += count;
+			else
+				ring.publish(count, channel);
+
+			latency.channel(STATS_RX, channel).record(start);
+			stats.channel(STATS_RX, channel).add(count);
 		}
 	}
 
-	if (cfg->ChannelConfig == ch && current_is_600mode == is_600_mode &&
-			!needs_update)
-		return false;
-	cfg->ChannelConfig = ch;
-	cfg->FIFOClock = clock;
-	cfg->FIFOMode = is_600_mode ? CONFIGURATION_FIFO_MODE_600 :
-		CONFIGURATION_FIFO_MODE_245;
-	return true;
+	stop_consumers(&dump_thread, &verify_thread);
+	printf("Read stopped, ring high water %zu/%zu slots\r\n",
+			ring.peak(), ring.capacity());
 }
 
-
-static bool set_channel_config(bool is_600_mode, CONFIGURATION_FIFO_CLK clock)
+/* Synthetic input for bench_test, the verified pattern when there is one */
+static void fill_bench_buffer(uint8_t *buf, uint32_t *seq)
 {
-	FT_HANDLE handle;
-	DWORD dwType;
+	if (pattern == VERIFY_COUNTER16) {
+		int16_t *s = (int16_t *)buf;
+
+		for (int i = 0; i < buffer_len / 2; i++)
+			s[i] = (*seq)++ % 128;
+	} else if (pattern == VERIFY_BYTES) {
+		for (int i = 0; i < buffer_len; i++)
+			buf[i] = i % 256;
+	} else {
+		/* Touch every page like a DMA transfer would */
+		for (int i = 0; i < buffer_len; i += 4096)
+			*(uint32_t *)(buf + i) = (*seq)++;
+	}
+}
 
-	/* Must turn off all pipes before changing chip configuration */
-	turn_off_all_pipes();
+/* Feed the capture ring with synthetic data at bench_rate MiB/s to
+ * measure the dump and verify paths without a device */
+static void bench_test(void)
+{
+	thread dump_thread, verify_thread;
+	auto interval = chrono::nanoseconds(
+			(int64_t)buffer_len * 1000000000 / (bench_rate * 1024LL * 1024));
+	auto begin = chrono::steady_clock::now();
+	auto next = begin;
+	uint64_t total = 0;
+	uint32_t seq = 0;
+	int stalls = 0;
+
+	placement.apply("read");
+	if (!ring.allocate()) {
+		printf("Failed to allocate capture ring\r\n");
+		return;
+	}
+	printf("Capture ring: %zu x %d bytes, %s\r\n", ring.capacity(),
+			buffer_len, ring.describe());
+	start_consumers(&dump_thread, &verify_thread);
+	while (!do_exit) {
+		uint8_t *buf = ring.acquire();
+
+		if (!buf) {
+			if (drop_on_full) {
+				ring_drop += buffer_len;
+			} else {
+				ring_stall++;
+				stalls++;
+				while (!do_exit && !(buf = ring.acquire()))
+					this_thread::sleep_for(chrono::microseconds(100));
+				if (!buf)
+					break;
+			}
+		}
+		if (buf) {
+			fill_bench_buffer(buf, &seq);
+			ring.publish(buffer_len, 0);
+		}
+		stats.channel(STATS_RX, 0).add(buffer_len);
+		total += buffer_len;
 
-	FT_GetDeviceInfoDetail(0, NULL, &dwType, NULL, NULL, NULL, NULL, &handle);
-	if (!handle)
-		return false;
+		next += interval;
+		this_thread::sleep_until(next);
+	}
 
-	get_vid_pid(handle);
-	test_gpio(handle);
+	auto start = chrono::steady_clock::now();
+	stop_consumers(&dump_thread, &verify_thread);
 
-	union {
-		FT_60XCONFIGURATION ft600;
-	} cfg;
-	if (FT_OK != FT_GetChipConfiguration(handle, &cfg)) {
-		printf("Failed to get chip conf\r\n");
-		return false;
-	}
+	double seconds = chrono::duration<double>(start - begin).count();
+	printf("Sink %s: %.2fMiB/s of %dMiB/s input, ring high water %zu/%zu "
+			"slots, %d stall(s), close took %.1fms\r\n",
+			sink ? sink->name() : "none",
+			total / seconds / 1024 / 1024, bench_rate, ring.peak(),
+			ring.capacity(), stalls, chrono::duration<double, milli>(
+				chrono::steady_clock::now() - start).count());
+}
 
-	bool needs_update;
-		needs_update = set_ft600_channel_config(&cfg.ft600, clock, is_600_mode);
-	if (needs_update) {
-		if (FT_OK != FT_SetChipConfiguration(handle, &cfg))
-			printf("Failed to set chip conf\r\n");
-		else {
-			printf("Configuration changed\r\n");
-			this_thread::sleep_for(chrono::seconds(1));
-			get_device_lists(6000);
-		}
+static void sig_hdlr(int signum)
+{
+	switch (signum) {
+	case SIGINT:
+		do_exit = true;
+		break;
 	}
+}
 
-	if (dwType == FT_DEVICE_600 || dwType == FT_DEVICE_601) {
-		bool rev_a_chip;
-		DWORD dwVersion;
+static void test_gpio(HANDLE handle)
+{
+#define GPIO(x) (1 << (x))
+#define GPIO_OUT(x) (1 << (x))
+#define GPIO_HIGH(x) (1 << (x))
 
-		FT_GetFirmwareVersion(handle, &dwVersion);
-		rev_a_chip = dwVersion <= 0x105;
+	DWORD dwMask = GPIO(0) | GPIO(1) | GPIO(2);
+	DWORD dwDirection = GPIO_OUT(0) | GPIO_OUT(1) |GPIO_OUT(2);
+	DWORD dwLevel = GPIO_HIGH(0) | GPIO_HIGH(1) |GPIO_HIGH(2);
 
-		FT_Close(handle);
-		return rev_a_chip;
+	if (FT_NOT_SUPPORTED == FT_EnableGPIO(handle, dwMask, dwDirection)) {
+		printf("FT_EnableGPIO not implemented\r\n");
+		return;
+	}
+	if (FT_OK != FT_WriteGPIO(handle, dwMask, dwLevel)) {
+		printf("FT_WriteGPIO not implemented\r\n");
+		return;
+	}
+	printf("Change all GPIOs to output high\r\n");
+	if (FT_OK != FT_ReadGPIO(handle, &dwLevel)) {
+		printf("FT_ReadGPIO not implemented\r\n");
+		return;
 	}
+	for (int i = 0; i < 3; i++)
+		printf("GPIO%d level is %s\r\n", i,
+				dwLevel & GPIO_HIGH(i) ? "high" : "low");
+}
 
-	FT_Close(handle);
-	return false;
+static void register_signals(void)
+{
+	signal(SIGINT, sig_hdlr);
 }
 
 static void show_help(const char *bin)
 {
-	printf("Usage: %s <out channel count> <in channel count> [mode]\r\n", bin);
+	printf("Usage: %s [options] <out channel count> <in channel count> [mode]\r\n", bin);
 	printf("  channel count: [0, 1] for 245 mode, [0-4] for 600 mode\r\n");
 	printf("  mode: 0 = FT245 mode (default), 1 = FT600 mode\r\n");
-}
-
-static void turn_off_thread_safe(void)
-{
-	FT_TRANSFER_CONF conf;
-
-	memset(&conf, 0, sizeof(FT_TRANSFER_CONF));
-	conf.wStructSize = sizeof(FT_TRANSFER_CONF);
-	conf.pipe[FT_PIPE_DIR_IN].fNonThreadSafeTransfer = true;
-	conf.pipe[FT_PIPE_DIR_OUT].fNonThreadSafeTransfer = true;
-	for (DWORD i = 0; i < 4; i++)
-		FT_SetTransferParams(&conf, i);
+	printf("Options:\r\n");
+	printf("  -r slots: capture ring size in %d byte buffers (default %zu)\r\n",
+			buffer_len, ring_slots);
+	printf("  -D: drop data when the ring is full instead of stalling the reader\r\n");
+	printf("  -s sink: dump file backend, ofstream, pwrite or uring (default),\r\n");
+	printf("           none to skip writing dumpfile.264 (needs -v)\r\n");
+	printf("  -v pattern: check the input on the fly, counter16 (16-bit counter\r\n");
+	printf("              of the FPGA design) or bytes (i%%256 sent by write_test)\r\n");
+	printf("  -b MiB/s: benchmark the dump path with synthetic input, no device\r\n");
+	printf("            needed, channel counts may be omitted\r\n");
+	printf("  -d seconds: stop after the given time\r\n");
+	printf("  -p profile: load transfer parameters and buffer size written\r\n");
+	printf("              by streamer -T\r\n");
+	printf("  -a role=core[:priority],...: pin the read, write, dump, verify\r\n");
+	printf("              and measure threads to a core and optionally run\r\n");
+	printf("              them SCHED_FIFO at priority [1-99]; the capture\r\n");
+	printf("              ring is allocated on the read thread's node\r\n");
+	printf("  -S size: stream fixed size frames, every transfer is size bytes\r\n");
+	printf("           and the pipes stay in one chip session (FT_SetStreamPipe)\r\n");
+	printf("  -S capture: one unbounded stream of buffer size transfers, with\r\n");
+	printf("              the longest streaming session the driver allows\r\n");
+	printf("  -e: event driven reads, sleep until FT_SetNotificationCallback\r\n");
+	printf("      reports data and read exactly that much\r\n");
 }
 
 static void get_queue_status(HANDLE handle)
@@ -371,6 +590,79 @@ static void get_queue_status(HANDLE handle)
 
 static bool validate_arguments(int argc, char *argv[])
 {
+	int opt;
+
+	while ((opt = getopt(argc, argv, "r:Ds:v:b:d:p:a:S:e")) != -1) {
+		switch (opt) {
+		case 'r':
+			ring_slots = atoi(optarg);
+			if (ring_slots < 2)
+				return false;
+			break;
+		case 'D':
+			drop_on_full = true;
+			break;
+		case 's':
+			sink_type = optarg;
+			break;
+		case 'v':
+			if (!strcmp(optarg, "counter16"))
+				pattern = VERIFY_COUNTER16;
+			else if (!strcmp(optarg, "bytes"))
+				pattern = VERIFY_BYTES;
+			else
+				return false;
+			break;
+		case 'b':
+			bench_rate = atoi(optarg);
+			if (bench_rate <= 0)
+				return false;
+			break;
+		case 'd':
+			run_seconds = atoi(optarg);
+			if (run_seconds < 0)
+				return false;
+			break;
+		case 'p':
+			if (!load_transfer_profile(optarg, &profile))
+				return false;
+			if (profile.buffer_len)
+				buffer_len = profile.buffer_len;
+			break;
+		case 'a':
+			if (!placement.parse(optarg, thread_roles))
+				return false;
+			break;
+		case 'S':
+			stream_capture = !strcmp(optarg, "capture");
+			stream_frame = stream_capture ? 0 : atoi(optarg);
+			if (!stream_capture && stream_frame <= 0)
+				return false;
+			break;
+		case 'e':
+			event_reads = true;
+			break;
+		default:
+			return false;
+		}
+	}
+	if (stream_frame)
+		buffer_len = stream_frame;
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (strcmp(sink_type, "none")) {
+		sink = create_capture_sink(sink_type);
+		if (!sink)
+			return false;
+	} else if (pattern == VERIFY_NONE) {
+		return false;
+	}
+
+	if (bench_rate && argc == 1) {
+		in_ch_cnt = 1;
+		return true;
+	}
 	if (argc != 3 && argc != 4)
 		return false;
 
@@ -385,41 +677,66 @@ static bool validate_arguments(int argc, char *argv[])
 	in_ch_cnt = atoi(argv[2]);
 
 	if ((in_ch_cnt == 0 && out_ch_cnt == 0) ||
-			in_ch_cnt > 4 || out_ch_cnt > 4) {
-		show_help(argv[0]);
+			in_ch_cnt > 4 || out_ch_cnt > 4)
 		return false;
-	}
 	return true;
 }
 
 int main(int argc, char *argv[])
 {
 
-	get_version();
+	show_versions();
 
 	if (!validate_arguments(argc, argv)) {
 		show_help(argv[0]);
 		return 1;
 	}
 
-	if (!get_device_lists(500))
+	int consumers = 0;
+
+	if (sink)
+		dump_consumer = consumers++;
+	if (pattern != VERIFY_NONE)
+		verify_consumer = consumers++;
+	if (in_ch_cnt)
+		ring.init(ring_slots, buffer_len, consumers);
+
+	if (in_ch_cnt && sink && !sink->open("dumpfile.264"))
 		return 1;
 
-	bool rev_a_chip = set_channel_config(
-			fifo_600mode, CONFIGURATION_FIFO_CLK_100);
+	if (bench_rate) {
+		register_signals();
+		measure_thread = thread(show_throughput, (FT_HANDLE)NULL);
+		bench_test();
+		do_exit = true;
+		measure_thread.join();
+		return verify_errors ? 1 : 0;
+	}
 
-	/* Must be called before FT_Create is called */
-	turn_off_thread_safe();
+	FT_TRANSFER_CONF conf;
+	session_config cfg;
+	device_session dev;
+
+	memset(&conf, 0, sizeof(conf));
+	apply_transfer_profile(&profile, &conf);
+	session_config_init(&cfg);
+	cfg.channel_config = session_channel_config(out_ch_cnt, in_ch_cnt);
+	cfg.fifo_600mode = fifo_600mode;
+	cfg.transfer = &conf;
+	if (stream_frame || stream_capture)
+		cfg.stream_size = buffer_len;
+	if (stream_capture)
+		for (int dir = 0; dir < FT_PIPE_DIR_COUNT; dir++)
+			conf.pipe[dir].dwStreamingSize = 0xFFFFFFFF;
+	if (!dev.open(cfg))
+		return 1;
 
-	FT_HANDLE handle;
+	FT_HANDLE handle = dev.get();
 
-	FT_Create(0, FT_OPEN_BY_INDEX, &handle);
+	test_gpio(handle);
+	if (in_ch_cnt && event_reads && !notifier.start(handle))
+		return 1;
 
-	if (!handle) {
-		printf("Failed to create device\r\n");
-		return -1;
-	}
-	
 	 if (out_ch_cnt)
 	 	write_thread = thread(write_test, handle);
 	if (in_ch_cnt)
@@ -432,14 +749,12 @@ int main(int argc, char *argv[])
 	 	write_thread.join();
 	if (read_thread.joinable())
 		read_thread.join();
+	notifier.stop();
 
 	if (measure_thread.joinable())
 		measure_thread.join();
+	latency.dump("TX", STATS_TX, out_ch_cnt);
+	latency.dump("RX", STATS_RX, in_ch_cnt);
 	get_queue_status(handle);
-
-	/* Workaround for FT600/FT601 Rev.A device: Stop session before exit */
-	if (rev_a_chip)
-		FT_ResetDevicePort(handle);
-	FT_Close(handle);
-	return 0;
+	return verify_errors ? 1 : 0;
 }